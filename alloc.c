@@ -1,7 +1,11 @@
+#include "const.h"
+#include "global.h"
 #include "proto.h"
 #include "vm.h"
+#include "workqueue.h"
 #include <errno.h>
 #include <stddef.h>
+#include <string.h>
 
 struct hole {
     struct hole* h_next;
@@ -11,10 +15,31 @@ struct hole {
 
 #define NR_HOLES 512
 
+/* background compaction keeps a block of this many pages available */
+#define COMPACT_TARGET_PAGES 512
+#define COMPACT_PERIOD 1000 /* timer ticks between background passes */
+
 static struct hole hole[NR_HOLES]; /* the hole table */
 static struct hole* hole_head;     /* pointer to first hole */
 static struct hole* free_slots;    /* ptr to list of unused table slots */
 
+/* frames zeroed ahead of time so that mapping fresh memory into a process does
+ * not clear it in the trap path. Idle harts keep the pool full, the worker
+ * refills it a batch at a time if it runs low while they are all busy. */
+#define ZERO_POOL_LOW 16
+#define ZERO_POOL_HIGH 64
+#define ZERO_POOL_BATCH 8
+
+static unsigned long zero_pool[ZERO_POOL_HIGH];
+static int zero_pool_count;
+
+static int compact_ticks;
+
+static void refill_zero_pool(struct work* work);
+static void compact_mem_work(struct work* work);
+static DEF_WORK(zero_pool_work, refill_zero_pool);
+static DEF_WORK(compact_work, compact_mem_work);
+
 static void delete_slot(struct hole* prev_ptr, struct hole* hp);
 static void merge_hole(struct hole* hp);
 
@@ -89,6 +114,9 @@ unsigned long alloc_pages(size_t nr_pages)
         hp = hp->h_next;
     }
 
+    /* no hole is large enough, try to build one by migrating movable frames */
+    if (nr_pages > 1) return compact_mem(nr_pages);
+
     return 0;
 }
 
@@ -152,3 +180,208 @@ static void merge_hole(struct hole* hp)
         delete_slot(hp, next_ptr);
     }
 }
+
+/* remove [base, base + len) from the hole list, the range must be free */
+static void take_mem(unsigned long base, unsigned long len)
+{
+    struct hole *hp, *new_ptr, *prev_ptr;
+
+    prev_ptr = NULL;
+    for (hp = hole_head; hp != NULL; prev_ptr = hp, hp = hp->h_next) {
+        unsigned long h_end = hp->h_base + hp->h_len;
+
+        if (base < hp->h_base || base + len > h_end) continue;
+
+        if (base == hp->h_base) {
+            hp->h_base += len;
+            hp->h_len -= len;
+            if (hp->h_len == 0) delete_slot(prev_ptr, hp);
+        } else if (base + len == h_end) {
+            hp->h_len -= len;
+        } else {
+            /* split the hole */
+            if ((new_ptr = free_slots) == NULL) panic("hole table full");
+            free_slots = new_ptr->h_next;
+
+            new_ptr->h_base = base + len;
+            new_ptr->h_len = h_end - new_ptr->h_base;
+            new_ptr->h_next = hp->h_next;
+            hp->h_next = new_ptr;
+            hp->h_len = base - hp->h_base;
+        }
+
+        return;
+    }
+}
+
+/* count the movable frames in [base, base + memsize), or return -1 if the
+ * range contains a page that is neither free nor movable */
+static long scan_window(struct hole* hp, unsigned long base,
+                        unsigned long memsize)
+{
+    unsigned long addr;
+    long movable = 0;
+
+    for (addr = base; addr < base + memsize; addr += PG_SIZE) {
+        while (hp != NULL && hp->h_base + hp->h_len <= addr)
+            hp = hp->h_next;
+
+        if (hp != NULL && hp->h_base <= addr &&
+            addr + PG_SIZE <= hp->h_base + hp->h_len)
+            continue;
+
+        if (!page_movable(addr)) return -1;
+        movable++;
+    }
+
+    return movable;
+}
+
+static int migrate_window(unsigned long base, unsigned long memsize)
+{
+    struct hole *hp, *next_ptr;
+    unsigned long addr, end = base + memsize;
+    struct tlb_batch batch;
+
+    /* reserve the free parts of the window first so that no migration target
+     * is allocated inside it */
+    for (hp = hole_head; hp != NULL && hp->h_base < end; hp = next_ptr) {
+        unsigned long start = hp->h_base;
+        unsigned long stop = hp->h_base + hp->h_len;
+
+        next_ptr = hp->h_next;
+        if (start < base) start = base;
+        if (stop > end) stop = end;
+        if (start < stop) take_mem(start, stop - start);
+    }
+
+    /* unmap all movable frames first so that the harts running their owners
+     * are interrupted only once */
+    tlb_batch_init(&batch);
+    for (addr = base; addr < end; addr += PG_SIZE) {
+        unmap_movable_page(addr, &batch);
+    }
+    tlb_batch_flush(&batch);
+
+    for (addr = base; addr < end; addr += PG_SIZE) {
+        unsigned long new_phys;
+
+        if (!page_movable(addr)) continue;
+
+        if ((new_phys = alloc_pages(1)) == 0) goto failed;
+        migrate_page(addr, new_phys);
+    }
+
+    return 0;
+
+failed:
+    /* give back everything we own in the window: the reserved holes and the
+     * frames that have already been migrated away, the rest are mapped
+     * again */
+    for (addr = base; addr < end; addr += PG_SIZE) {
+        if (page_movable(addr))
+            remap_movable_page(addr);
+        else
+            free_mem(addr, PG_SIZE);
+    }
+
+    return ENOMEM;
+}
+
+/* build a free block of nr_pages contiguous pages by relocating movable frames
+ * out of the way, the block is returned to the caller as allocated */
+unsigned long compact_mem(size_t nr_pages)
+{
+    unsigned long memsize = nr_pages * PG_SIZE;
+    unsigned long free_pages = 0;
+    struct hole* hp;
+
+    for (hp = hole_head; hp != NULL; hp = hp->h_next)
+        free_pages += hp->h_len / PG_SIZE;
+    if (free_pages < nr_pages) return 0;
+
+    for (hp = hole_head; hp != NULL; hp = hp->h_next) {
+        unsigned long base = roundup(hp->h_base, PG_SIZE);
+        long movable = scan_window(hp, base, memsize);
+        int retval;
+
+        if (movable < 0) continue;
+        /* enough free pages outside the window to take the movable frames? */
+        if (free_pages - (nr_pages - movable) < movable) continue;
+
+        retval = migrate_window(base, memsize);
+
+        return retval ? 0 : base;
+    }
+
+    return 0;
+}
+
+static void compact_mem_work(struct work* work)
+{
+    unsigned long base = compact_mem(COMPACT_TARGET_PAGES);
+
+    if (base) free_mem(base, COMPACT_TARGET_PAGES * PG_SIZE);
+}
+
+/* called on every timer tick, periodically makes sure that a large free
+ * block is still available. Migrating the frames takes too long for the
+ * interrupt, the worker does it. */
+void compact_mem_background()
+{
+    struct hole* hp;
+
+    if (++compact_ticks < COMPACT_PERIOD) return;
+    compact_ticks = 0;
+
+    for (hp = hole_head; hp != NULL; hp = hp->h_next) {
+        if (hp->h_len >= COMPACT_TARGET_PAGES * PG_SIZE) return;
+    }
+
+    queue_work(&compact_work);
+}
+
+static void refill_zero_pool(struct work* work)
+{
+    int i;
+
+    for (i = 0; i < ZERO_POOL_BATCH && zero_pool_count < ZERO_POOL_HIGH; i++) {
+        unsigned long phys = alloc_pages(1);
+
+        if (!phys) return;
+
+        memset(__va(phys), 0, PG_SIZE);
+        zero_pool[zero_pool_count++] = phys;
+    }
+
+    /* let the other items run before the next batch */
+    if (zero_pool_count < ZERO_POOL_HIGH) queue_work(work);
+}
+
+/* called by an idle hart, zero one more frame for the pool unless it is full.
+ * Returns 1 if there was something to do. */
+int idle_zero_page()
+{
+    unsigned long phys;
+
+    if (zero_pool_count >= ZERO_POOL_HIGH) return 0;
+    if (!(phys = alloc_pages(1))) return 0;
+
+    memset(__va(phys), 0, PG_SIZE);
+    zero_pool[zero_pool_count++] = phys;
+    return 1;
+}
+
+/* allocate a zeroed frame, it only has to be cleared here if the pool is
+ * empty */
+unsigned long alloc_zeroed_page()
+{
+    unsigned long phys;
+
+    if (zero_pool_count < ZERO_POOL_LOW) queue_work(&zero_pool_work);
+
+    if (zero_pool_count > 0) return zero_pool[--zero_pool_count];
+
+    if ((phys = alloc_pages(1)) != 0) memset(__va(phys), 0, PG_SIZE);
+    return phys;
+}
@@ -0,0 +1,337 @@
+#include "const.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Scheduler benchmarks, run by INIT when the kernel is built with make
+ * BENCH=1. Each one measures a latency many times in timer ticks read with
+ * rdtime and prints the minimum, median, 99th percentile and maximum:
+ *
+ *  - null syscall: a round trip through the kernel for an unknown call
+ *  - yield ping-pong: two processes on one hart yield to each other, from the
+ *    yield of one to the other running
+ *  - futex wake-to-run: from a FUTEX_WAKE to the waiter running on the same
+ *    hart, where it preempts the waker
+ *  - timer-to-run jitter: how late a process sleeping for 1ms runs, the
+ *    timer slack included
+ *  - cross-hart wakeup: as futex wake-to-run with the waiter on another hart,
+ *    which is woken up by an IPI
+ *
+ * Like the rest of the user image this is linked into the kernel: everything
+ * has to be in the user sections and there is no libc. Function pointers are
+ * only valid when taken at run time, the image is mapped at another address
+ * than it is linked at. */
+
+#define USER_TEXT __attribute__((__section__(".user_text")))
+#define USER_DATA __attribute__((__section__(".user_data")))
+#define USER_SHARED __attribute__((__section__(".user_shared")))
+
+#define NR_SAMPLES 1000
+#define SLEEP_NS 1000000UL /* 1ms */
+
+/* above the benchmark driver and everything else in user space */
+#define PRIO_HIGH 2
+#define PRIO_LOW 3
+
+long __syscall(int call_nr, ...);
+
+void Bench(unsigned long arg) USER_TEXT;
+
+const char name_null[] USER_DATA = "null syscall";
+const char name_yield[] USER_DATA = "yield ping-pong";
+const char name_futex[] USER_DATA = "futex wake-to-run";
+const char name_timer[] USER_DATA = "timer-to-run jitter";
+const char name_cross[] USER_DATA = "cross-hart wakeup";
+const char str_bench[] USER_DATA = "bench: ";
+const char str_samples[] USER_DATA = " samples, ticks (ns): min ";
+const char str_median[] USER_DATA = " median ";
+const char str_p99[] USER_DATA = " p99 ";
+const char str_max[] USER_DATA = " max ";
+const char str_skipped[] USER_DATA = ": skipped, needs a second hart";
+const char str_failed[] USER_DATA = ": failed";
+
+/* shared by the processes of a benchmark, see map_user_shared() */
+static uint64_t samples[NR_SAMPLES] USER_SHARED;
+static uint32_t nr_samples USER_SHARED;
+static uint64_t stamp USER_SHARED;       /* rdtime before the event */
+static uint32_t stamp_owner USER_SHARED; /* who took the stamp */
+static uint32_t nr_started USER_SHARED;
+static uint32_t futex_word USER_SHARED;
+static uint32_t waiter_armed USER_SHARED; /* about to wait on futex_word */
+static uint32_t waiter_done USER_SHARED;
+
+/* ns = ticks * ns_mult >> 16, from a sample of the kernel clock */
+static uint64_t ns_mult USER_SHARED;
+
+static inline uint64_t USER_TEXT rdtime()
+{
+    uint64_t n;
+
+    __asm__ __volatile__("rdtime %0" : "=r"(n));
+    return n;
+}
+
+static inline uint64_t USER_TEXT to_ns(uint64_t ticks)
+{
+    return (ticks * ns_mult) >> 16;
+}
+
+static inline uint64_t USER_TEXT to_ticks(uint64_t ns)
+{
+    return (ns << 16) / ns_mult;
+}
+
+static int USER_TEXT full()
+{
+    return __atomic_load_n(&nr_samples, __ATOMIC_ACQUIRE) >= NR_SAMPLES;
+}
+
+static void USER_TEXT record(uint64_t ticks)
+{
+    uint32_t i = __atomic_fetch_add(&nr_samples, 1, __ATOMIC_RELAXED);
+
+    if (i < NR_SAMPLES) samples[i] = ticks;
+}
+
+/* pin the caller to cpu at a fixed priority and wait for the other nr - 1
+ * processes of the benchmark to get there */
+static int USER_TEXT setup(int cpu, int prio, int nr)
+{
+    if (__syscall(SYS_SET_AFFINITY, 1UL << cpu)) return -1;
+    if (__syscall(SYS_SET_SCHED, SCHED_PRIO, prio)) return -1;
+
+    __atomic_add_fetch(&nr_started, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&nr_started, __ATOMIC_ACQUIRE) < nr)
+        __syscall(SYS_YIELD);
+
+    return 0;
+}
+
+static void USER_TEXT NullCall(unsigned long arg)
+{
+    uint64_t start;
+
+    if (setup(0, PRIO_HIGH, 1)) __syscall(SYS_EXIT, 1);
+
+    while (!full()) {
+        start = rdtime();
+        __syscall(NR_SYSCALLS);
+        record(rdtime() - start);
+    }
+
+    __syscall(SYS_EXIT, 0);
+}
+
+/* each sample is one switch, taken by the process switched to */
+static void USER_TEXT PingPong(unsigned long me)
+{
+    uint64_t now;
+
+    if (setup(0, PRIO_HIGH, 2)) __syscall(SYS_EXIT, 1);
+
+    while (!full()) {
+        stamp_owner = me;
+        stamp = rdtime();
+        __syscall(SYS_YIELD);
+        now = rdtime();
+
+        /* not a yield to itself */
+        if (stamp_owner != me) record(now - stamp);
+    }
+
+    __syscall(SYS_EXIT, 0);
+}
+
+static void USER_TEXT Waiter(unsigned long cpu)
+{
+    uint64_t now;
+    long retval;
+
+    if (setup(cpu, PRIO_HIGH, 2)) __syscall(SYS_EXIT, 1);
+
+    while (!full()) {
+        __atomic_store_n(&waiter_armed, 1, __ATOMIC_RELEASE);
+        retval = __syscall(SYS_FUTEX_WAIT, &futex_word, 0, 0);
+        now = rdtime();
+
+        /* -EAGAIN if the wakeup came before the wait */
+        if (!retval) record(now - stamp);
+        __atomic_store_n(&futex_word, 0, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&waiter_done, 1, __ATOMIC_RELEASE);
+    __syscall(SYS_EXIT, 0);
+}
+
+/* on the same hart as the waiter it only runs once the waiter sleeps */
+static void USER_TEXT Waker(unsigned long cpu)
+{
+    if (setup(cpu, PRIO_LOW, 2)) __syscall(SYS_EXIT, 1);
+
+    while (!__atomic_load_n(&waiter_done, __ATOMIC_ACQUIRE)) {
+        if (!__atomic_exchange_n(&waiter_armed, 0, __ATOMIC_ACQUIRE)) {
+            __syscall(SYS_YIELD);
+            continue;
+        }
+
+        stamp = rdtime();
+        __atomic_store_n(&futex_word, 1, __ATOMIC_RELEASE);
+        __syscall(SYS_FUTEX_WAKE, &futex_word, 1);
+    }
+
+    __syscall(SYS_EXIT, 0);
+}
+
+static void USER_TEXT Sleeper(unsigned long arg)
+{
+    uint64_t ticks, expires, now;
+
+    if (setup(0, PRIO_HIGH, 1)) __syscall(SYS_EXIT, 1);
+
+    ticks = to_ticks(SLEEP_NS);
+    while (!full()) {
+        expires = rdtime() + ticks;
+        __syscall(SYS_NANOSLEEP, SLEEP_NS);
+        now = rdtime();
+
+        /* the kernel may round the other way by a tick */
+        record(now > expires ? now - expires : 0);
+    }
+
+    __syscall(SYS_EXIT, 0);
+}
+
+static void USER_TEXT sort(uint64_t* a, int n)
+{
+    int gap, i, j;
+
+    for (gap = n / 2; gap > 0; gap /= 2) {
+        for (i = gap; i < n; i++) {
+            for (j = i; j >= gap && a[j - gap] > a[j]; j -= gap) {
+                uint64_t tmp = a[j];
+                a[j] = a[j - gap];
+                a[j - gap] = tmp;
+            }
+        }
+    }
+}
+
+/* nearest rank */
+static uint64_t USER_TEXT percentile(int n, int p)
+{
+    int rank = (n * p + 99) / 100;
+
+    return samples[rank > 0 ? rank - 1 : 0];
+}
+
+static int USER_TEXT put_str(char* buf, int len, const char* str)
+{
+    while (*str && len < 159)
+        buf[len++] = *str++;
+    return len;
+}
+
+static int USER_TEXT put_u64(char* buf, int len, uint64_t val)
+{
+    char digits[20];
+    int i = 0;
+
+    do {
+        digits[i++] = '0' + val % 10;
+        val /= 10;
+    } while (val);
+
+    while (i && len < 159)
+        buf[len++] = digits[--i];
+    return len;
+}
+
+static int USER_TEXT put_time(char* buf, int len, uint64_t ticks)
+{
+    len = put_u64(buf, len, ticks);
+    if (len < 158) {
+        buf[len++] = ' ';
+        buf[len++] = '(';
+    }
+    len = put_u64(buf, len, to_ns(ticks));
+    if (len < 159) buf[len++] = ')';
+    return len;
+}
+
+/* one line, with msg or the statistics of the samples if it is NULL */
+static void USER_TEXT report(const char* name, const char* msg)
+{
+    char buf[160];
+    int len = 0, n = nr_samples < NR_SAMPLES ? nr_samples : NR_SAMPLES;
+
+    len = put_str(buf, len, str_bench);
+    len = put_str(buf, len, name);
+
+    if (msg || !n) {
+        len = put_str(buf, len, msg ? msg : str_failed);
+    } else {
+        sort(samples, n);
+
+        buf[len++] = ':';
+        buf[len++] = ' ';
+        len = put_u64(buf, len, n);
+        len = put_str(buf, len, str_samples);
+        len = put_time(buf, len, samples[0]);
+        len = put_str(buf, len, str_median);
+        len = put_time(buf, len, percentile(n, 50));
+        len = put_str(buf, len, str_p99);
+        len = put_time(buf, len, percentile(n, 99));
+        len = put_str(buf, len, str_max);
+        len = put_time(buf, len, samples[n - 1]);
+    }
+
+    buf[len++] = '\n';
+    __syscall(SYS_WRITE_CONSOLE, (unsigned long)buf, len);
+}
+
+/* run up to two processes and wait for them to exit */
+static void USER_TEXT run(const char* name, void (*entry1)(unsigned long),
+                          unsigned long arg1, void (*entry2)(unsigned long),
+                          unsigned long arg2)
+{
+    long pid1, pid2 = 0;
+    int status;
+
+    nr_samples = 0;
+    nr_started = 0;
+    stamp_owner = -1;
+    futex_word = 0;
+    waiter_armed = 0;
+    waiter_done = 0;
+
+    pid1 = __syscall(SYS_SPAWN, (unsigned long)entry1, arg1);
+    if (pid1 > 0 && entry2)
+        pid2 = __syscall(SYS_SPAWN, (unsigned long)entry2, arg2);
+
+    if (pid1 > 0) __syscall(SYS_WAIT, pid1, &status, 0);
+    if (pid2 > 0) __syscall(SYS_WAIT, pid2, &status, 0);
+
+    report(name, NULL);
+}
+
+/* the benchmark driver, spawned by INIT */
+void Bench(unsigned long arg)
+{
+    struct cpu_times times;
+
+    /* the kernel clock and the ticks it is computed from */
+    __syscall(SYS_CPU_TIMES, 0, &times);
+    ns_mult = (times.clock << 16) / times.cycles;
+
+    run(name_null, NullCall, 0, NULL, 0);
+    run(name_yield, PingPong, 0, PingPong, 1);
+    run(name_futex, Waiter, 0, Waker, 0);
+    run(name_timer, Sleeper, 0, NULL, 0);
+
+    if (__syscall(SYS_CPU_TIMES, 1, &times) < 0)
+        report(name_cross, str_skipped);
+    else
+        run(name_cross, Waiter, 1, Waker, 0);
+
+    __syscall(SYS_EXIT, 0);
+}
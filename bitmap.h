@@ -9,8 +9,39 @@ typedef unsigned long bitchunk_t;
 
 #define MAP_CHUNK(map, bit) (map)[((bit) / BITCHUNK_BITS)]
 #define CHUNK_OFFSET(bit) ((bit) % BITCHUNK_BITS)
-#define GET_BIT(map, bit) (MAP_CHUNK(map, bit) & (1 << CHUNK_OFFSET(bit)))
-#define SET_BIT(map, bit) (MAP_CHUNK(map, bit) |= (1 << CHUNK_OFFSET(bit)))
-#define UNSET_BIT(map, bit) (MAP_CHUNK(map, bit) &= ~(1 << CHUNK_OFFSET(bit)))
+#define GET_BIT(map, bit) (MAP_CHUNK(map, bit) & (1UL << CHUNK_OFFSET(bit)))
+#define SET_BIT(map, bit) (MAP_CHUNK(map, bit) |= (1UL << CHUNK_OFFSET(bit)))
+#define UNSET_BIT(map, bit) \
+    (MAP_CHUNK(map, bit) &= ~(1UL << CHUNK_OFFSET(bit)))
+
+/* index of the least significant set bit, word must not be zero */
+static inline int bitchunk_ffs(bitchunk_t word)
+{
+    int bit = 0;
+
+    if ((word & 0xffffffffUL) == 0) {
+        bit += 32;
+        word >>= 32;
+    }
+    if ((word & 0xffff) == 0) {
+        bit += 16;
+        word >>= 16;
+    }
+    if ((word & 0xff) == 0) {
+        bit += 8;
+        word >>= 8;
+    }
+    if ((word & 0xf) == 0) {
+        bit += 4;
+        word >>= 4;
+    }
+    if ((word & 0x3) == 0) {
+        bit += 2;
+        word >>= 2;
+    }
+    if ((word & 0x1) == 0) bit += 1;
+
+    return bit;
+}
 
 #endif
@@ -1,14 +1,60 @@
 #ifndef _CONST_H_
 #define _CONST_H_
 
-#define KSTACK_SIZE 0x1000 /* kernel stack size 4kB */
+#define KSTACK_SIZE 0x2000 /* kernel stack size 8kB */
+
+#define CONFIG_SMP_MAX_CPUS 8   /* harts the kernel can run on */
+#define CONFIG_SMP_MAX_HARTS 64 /* upper bound of hart ids */
+
+/* percentage of each hart SCHED_DEADLINE processes may reserve, override with
+ * make DL_BW=<percent> */
+#ifndef CONFIG_DL_BANDWIDTH
+#define CONFIG_DL_BANDWIDTH 95
+#endif
 
 /* syscall numbers */
-#define NR_SYSCALLS 1
+#define NR_SYSCALLS 15
 #define SYS_WRITE_CONSOLE 0 /* write a string to console */
+#define SYS_TIMES 1         /* get user and system time of the caller */
+#define SYS_SET_AFFINITY 2  /* set the harts the caller may run on */
+#define SYS_LOCKSTAT 3      /* print lock statistics to the console */
+#define SYS_SPAWN 4         /* start a child at an entry of the user image */
+#define SYS_EXIT 5          /* terminate the caller */
+#define SYS_WAIT 6          /* wait for a child to exit, with a timeout */
+#define SYS_SET_SCHED 7     /* set the scheduling policy of the caller */
+#define SYS_SET_DEADLINE 8  /* make the caller SCHED_DEADLINE */
+#define SYS_NANOSLEEP 9     /* suspend the caller for some nanoseconds */
+#define SYS_FUTEX_WAIT 10   /* wait on a word while it has a given value */
+#define SYS_FUTEX_WAKE 11   /* wake up processes waiting on a word */
+#define SYS_FUTEX_REQUEUE 12 /* wake some waiters, move others to a word */
+#define SYS_CPU_TIMES 13     /* get the idle time of a hart */
+#define SYS_YIELD 14         /* let the next process of the queue run */
+
+/* scheduling policies */
+#define SCHED_PRIO 0 /* fixed priority queues, the parameter is the queue */
+#define SCHED_FAIR 1 /* fair share, the parameter is the nice value */
+#define SCHED_DEADLINE 2 /* EDF, set with SYS_SET_DEADLINE */
+
+#define NICE_MIN (-20)
+#define NICE_MAX 19
 
 #ifndef __ASSEMBLY__
 
+#include <stdint.h>
+
+struct proc_times {
+    uint64_t user_time; /* in nanoseconds */
+    uint64_t sys_time;
+};
+
+/* the utilization of a hart over an interval is 1 - (difference of idle_time)
+ * / (difference of clock) between two samples */
+struct cpu_times {
+    uint64_t idle_time; /* in nanoseconds */
+    uint64_t clock;     /* time of the sample */
+    uint64_t cycles;    /* the same in timer ticks, as read by rdtime */
+};
+
 #define roundup(x, align) \
     (((x) % align == 0) ? (x) : (((x) + align) - ((x) % align)))
 #define rounddown(x, align) ((x) - ((x) % align))
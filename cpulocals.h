@@ -0,0 +1,119 @@
+#ifndef _CPULOCALS_H_
+#define _CPULOCALS_H_
+
+#include "bitmap.h"
+#include "const.h"
+#include "ipi.h"
+#include "ktimer.h"
+#include "proc.h"
+#include "rbtree.h"
+#include "reg_offsets.h"
+#include "spinlock.h"
+#include "waitqueue.h"
+
+#include <stdint.h>
+
+/* Per-CPU variables. Every hart has its own copy of the structure below and
+ * finds it through the cpu number of the process that tp points to, which is
+ * the process the hart is currently handling or its idle task. */
+
+#define CPULOCAL_STRUCT __cpu_local_vars
+#define CPULOCALS_ALIGN 64 /* keep the copies on separate cache lines */
+
+#define ___CPULOCAL_START struct CPULOCAL_STRUCT {
+#define ___CPULOCAL_END                                               \
+    char __cpulocal_pad[0] __attribute__((aligned(CPULOCALS_ALIGN))); \
+    }
+
+#define DECLARE_CPULOCAL(type, name) type name
+
+___CPULOCAL_START
+
+/* idle task of the hart, must be the first member (see head.S) */
+DECLARE_CPULOCAL(struct proc, idle_proc);
+DECLARE_CPULOCAL(struct proc*, proc_ptr); /* process running on the hart */
+
+DECLARE_CPULOCAL(unsigned int, hart_id);
+DECLARE_CPULOCAL(volatile int, cpu_online);
+DECLARE_CPULOCAL(volatile int, cpu_is_idle);
+/* ticks the hart has spent halted in idle() */
+DECLARE_CPULOCAL(uint64_t, idle_time) __attribute__((aligned(8)));
+/* when the hart halted, valid while cpu_is_idle is set */
+DECLARE_CPULOCAL(uint64_t, halt_start) __attribute__((aligned(8)));
+
+DECLARE_CPULOCAL(uint64_t, next_timer_event); /* see timer.c */
+DECLARE_CPULOCAL(int, has_sstc);
+
+/* ready queues of the hart, see sched.c */
+DECLARE_CPULOCAL(struct list_head, run_queue[NR_SCHED_QUEUES]);
+DECLARE_CPULOCAL(bitchunk_t, ready_map);
+DECLARE_CPULOCAL(int, nr_ready);
+DECLARE_CPULOCAL(uint64_t, last_balance);
+
+/* SCHED_FAIR processes ready on the hart, see sched_fair.c */
+DECLARE_CPULOCAL(struct rb_root, fair_tree) __attribute__((aligned(8)));
+DECLARE_CPULOCAL(struct rb_node*, fair_leftmost);
+DECLARE_CPULOCAL(struct proc*, fair_last); /* preempted during its slice */
+DECLARE_CPULOCAL(uint64_t, min_vruntime);
+DECLARE_CPULOCAL(unsigned long, fair_weight); /* total weight in the tree */
+DECLARE_CPULOCAL(unsigned long, nr_fair);
+
+/* SCHED_DEADLINE processes of the hart, see sched_dl.c */
+DECLARE_CPULOCAL(struct rb_root, dl_tree) __attribute__((aligned(8)));
+DECLARE_CPULOCAL(struct rb_node*, dl_leftmost);
+DECLARE_CPULOCAL(unsigned long, nr_dl);
+DECLARE_CPULOCAL(unsigned long, dl_bw); /* bandwidth reserved on the hart */
+
+/* software timers of the hart, see ktimer.c */
+DECLARE_CPULOCAL(struct list_head, timer_wheel[WHEEL_LEVELS * WHEEL_SIZE]);
+DECLARE_CPULOCAL(bitchunk_t, wheel_pending[WHEEL_LEVELS]); /* slots in use */
+DECLARE_CPULOCAL(uint64_t, wheel_clk); /* slots up to here have run */
+DECLARE_CPULOCAL(struct rb_root, hrtimer_tree) __attribute__((aligned(8)));
+DECLARE_CPULOCAL(struct rb_node*, hrtimer_leftmost);
+
+/* deferred work of the hart and where the kernel thread that runs it waits
+ * for more, see workqueue.c */
+DECLARE_CPULOCAL(struct list_head, work_list);
+DECLARE_CPULOCAL(struct wait_queue_head, work_wait);
+
+/* IPIs, see ipi.c. The lock and the flags are accessed with AMOs so they need
+ * to be aligned inside the packed structure. */
+DECLARE_CPULOCAL(spinlock_t, ipi_lock) __attribute__((aligned(8)));
+DECLARE_CPULOCAL(unsigned int, ipi_pending) __attribute__((aligned(4)));
+DECLARE_CPULOCAL(struct list_head, ipi_call_queue); /* calls to run here */
+/* calls sent from this hart, one entry per target */
+DECLARE_CPULOCAL(struct ipi_call, ipi_call_data) __attribute__((aligned(8)));
+DECLARE_CPULOCAL(struct ipi_call_entry, ipi_call_entries[CONFIG_SMP_MAX_CPUS]);
+
+/* address space loaded in satp and the ASID generation the TLB is clean for,
+ * see tlb.c */
+DECLARE_CPULOCAL(struct vm_context*, active_vm);
+DECLARE_CPULOCAL(unsigned long, asid_gen);
+
+___CPULOCAL_END;
+
+extern struct CPULOCAL_STRUCT CPULOCAL_STRUCT[CONFIG_SMP_MAX_CPUS];
+
+#ifdef CONFIG_SIM
+/* the host simulator (see sim/) runs all harts on one thread */
+extern unsigned int sim_cpu;
+
+static inline unsigned int smp_processor_id() { return sim_cpu; }
+#else
+static inline unsigned int smp_processor_id()
+{
+    unsigned int cpu;
+
+    __asm__ __volatile__("lw %0, %1(tp)" : "=r"(cpu) : "i"(P_CPU));
+    return cpu;
+}
+#endif
+
+#define cpuid (smp_processor_id())
+
+#define get_cpu_var(cpu, name) CPULOCAL_STRUCT[cpu].name
+#define get_cpu_var_ptr(cpu, name) (&(get_cpu_var(cpu, name)))
+#define get_cpulocal_var(name) get_cpu_var(cpuid, name)
+#define get_cpulocal_var_ptr(name) get_cpu_var_ptr(cpuid, name)
+
+#endif
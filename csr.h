@@ -16,10 +16,14 @@
 /* SATP flags */
 #if __riscv_xlen == 32
 #define SATP_PPN 0x003FFFFFUL
+#define SATP_ASID_SHIFT 22
+#define SATP_ASID_MASK 0x1FFUL
 #define SATP_MODE_32 0x80000000UL
 #define SATP_MODE SATP_MODE_32
 #else
 #define SATP_PPN 0x00000FFFFFFFFFFFUL
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK 0xFFFFUL
 #define SATP_MODE_39 0x8000000000000000UL
 #define SATP_MODE SATP_MODE_39
 #endif
@@ -35,7 +39,11 @@
 #define EXC_LOAD_PAGE_FAULT 13
 #define EXC_STORE_PAGE_FAULT 15
 
-/* interrupt enable flags */
+/* counter enable flags */
+#define SCOUNTEREN_TM 0x00000002UL /* Time readable in user mode */
+
+/* interrupt enable/pending flags */
+#define SIE_SSIE 0x00000002UL /* Software Interrupt Enable */
 #define SIE_STIE 0x00000020UL /* Timer Interrupt Enable */
 
 #define csr_read(csr)                                                    \
@@ -1,18 +1,13 @@
 #include "sbi.h"
 
 #include <stdarg.h> /* for va_list */
+#include <string.h>
 
 int vsprintf(char* buf, const char* fmt, va_list args);
 
 void disp_char(const char c) { sbi_console_putchar((int)c); }
 
-void direct_put_str(const char* str)
-{
-    while (*str) {
-        disp_char(*str);
-        str++;
-    }
-}
+void direct_put_str(const char* str) { sbi_console_write(str, strlen(str)); }
 
 int printk(const char* fmt, ...)
 {
@@ -31,7 +26,6 @@ int printk(const char* fmt, ...)
 
 void panic(const char* fmt, ...)
 {
-    int i;
     char buf[256];
     va_list arg;
 
@@ -39,7 +33,7 @@ void panic(const char* fmt, ...)
     vsprintf(buf, fmt, arg);
     va_end(arg);
 
-    printk("Kernel panic: %s\n");
+    printk("Kernel panic: %s\n", buf);
 
     while (1)
         ;
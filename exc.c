@@ -1,13 +1,20 @@
 #include "csr.h"
 #include "proc.h"
 #include "proto.h"
+#include "vm.h"
+
+#include <errno.h>
 
 extern void trap_entry(void);
 
 void init_trap()
 {
     csr_write(stvec, (reg_t)&trap_entry);
+    /* we are in the kernel */
+    csr_write(sscratch, 0);
     csr_write(sie, -1);
+    /* user space may read the time, e.g. bench.c */
+    csr_set(scounteren, SCOUNTEREN_TM);
 }
 
 void do_trap_unknown(int in_kernel, struct proc* p)
@@ -58,9 +65,21 @@ void do_trap_ecall_s(int in_kernel, struct proc* p) { printk("ecall s\n"); }
 
 void do_trap_ecall_m(int in_kernel, struct proc* p) { printk("ecall m\n"); }
 
+/* A frame that is being migrated is not present until the copy is mapped
+ * (see migrate_window()). The trap has waited for the kernel lock, so the
+ * migration is over and the page is mapped again: the access is retried. Any
+ * other fault kills the process. */
 void do_page_fault(int in_kernel, struct proc* p)
 {
-    //   printk("page fault %d %x %lx %lx\n", in_kernel, p->regs.scause,
-    //   p->regs.sbadaddr, p->regs.sepc);
-    printk("page fault\n");
+    unsigned long addr = p->regs.sbadaddr;
+
+    if (vm_lookup(p, addr)) {
+        /* the hart may have cached the PTE that was not present */
+        flush_tlb_page(addr);
+        return;
+    }
+
+    printk("%s[%d]: page fault at %lx, pc %lx\n", p->name, p->pid, addr,
+           p->regs.sepc);
+    exit_proc(p, -EFAULT);
 }
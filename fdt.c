@@ -1,4 +1,6 @@
-#include "libfdt.h"
+#include "fdt.h"
+
+#include <string.h>
 
 int of_scan_fdt(int (*scan)(void*, unsigned long, const char*, int, void*),
                 void* arg, void* blob)
@@ -17,3 +19,58 @@ int of_scan_fdt(int (*scan)(void*, unsigned long, const char*, int, void*),
 
     return retval;
 }
+
+/* find the /cpus/cpu@... node of a hart */
+int of_find_cpu_node(void* blob, unsigned int hart_id)
+{
+    int cpus, offset;
+
+    if ((cpus = fdt_path_offset(blob, "/cpus")) < 0) return cpus;
+
+    fdt_for_each_subnode(offset, blob, cpus)
+    {
+        const char* type = fdt_getprop(blob, offset, "device_type", NULL);
+        const uint32_t* reg;
+        int len;
+
+        if (!type || strcmp(type, "cpu") != 0) continue;
+
+        reg = fdt_getprop(blob, offset, "reg", &len);
+        if (!reg || len < sizeof(uint32_t)) continue;
+
+        if (of_read_number(reg, len / sizeof(uint32_t)) == hart_id)
+            return offset;
+    }
+
+    return -FDT_ERR_NOTFOUND;
+}
+
+/* check whether a cpu node lists an ISA extension, either in the newer
+ * riscv,isa-extensions string list or in the riscv,isa string */
+int of_cpu_has_isa_ext(void* blob, int offset, const char* ext)
+{
+    const char *prop, *end;
+    int len, ext_len = strlen(ext);
+
+    prop = fdt_getprop(blob, offset, "riscv,isa-extensions", &len);
+    if (prop) {
+        for (end = prop + len; prop < end; prop += strlen(prop) + 1) {
+            if (!strcmp(prop, ext)) return 1;
+        }
+        return 0;
+    }
+
+    if ((prop = fdt_getprop(blob, offset, "riscv,isa", NULL)) == NULL)
+        return 0;
+
+    /* multi-letter extensions follow the single-letter ones, separated by
+     * underscores */
+    while ((prop = strchr(prop, '_')) != NULL) {
+        prop++;
+        if (!memcmp(prop, ext, ext_len) &&
+            (prop[ext_len] == '_' || prop[ext_len] == '\0'))
+            return 1;
+    }
+
+    return 0;
+}
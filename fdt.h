@@ -15,5 +15,7 @@ static inline uint64_t of_read_number(const uint32_t* cell, int size)
 
 int of_scan_fdt(int (*scan)(void*, unsigned long, const char*, int, void*),
                 void* arg, void* blob);
+int of_find_cpu_node(void* blob, unsigned int hart_id);
+int of_cpu_has_isa_ext(void* blob, int offset, const char* ext);
 
 #endif
@@ -0,0 +1,252 @@
+#include "global.h"
+#include "proc.h"
+#include "proto.h"
+#include "spinlock.h"
+#include "vm.h"
+
+#include <errno.h>
+
+/* Futexes. User space synchronizes with atomics on 32-bit words and only
+ * calls in when it has to wait: futex_wait() blocks the caller as long as a
+ * word contains the value it expects and futex_wake() wakes up the processes
+ * waiting on a word after it has been changed.
+ *
+ * Waiters are kept in a hash table keyed by the word. A word in private
+ * memory is identified by the address space and its virtual address since
+ * compaction may move the frame. A word in a frame that never moves, e.g. in
+ * the shared section of the user image, is identified by its physical
+ * address so that all processes mapping the frame agree on the key.
+ *
+ * Each bucket has its own lock. The value is checked and the waiter queued
+ * under it, a wakeup for a change made after the check cannot be missed. */
+
+#define FUTEX_HASH_BITS 8
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
+
+struct futex_bucket {
+    spinlock_t lock __attribute__((aligned(8)));
+    struct list_head waiters;
+};
+
+static struct futex_bucket futex_hash[FUTEX_HASH_SIZE];
+
+#ifdef CONFIG_LOCKSTAT
+static DEF_LOCK_CLASS(futex_bucket_lock);
+#endif
+
+void init_futex()
+{
+    int i;
+
+    for (i = 0; i < FUTEX_HASH_SIZE; i++) {
+        spinlock_init(&futex_hash[i].lock);
+        lock_set_class(&futex_hash[i].lock, &futex_bucket_lock);
+        INIT_LIST_HEAD(&futex_hash[i].waiters);
+    }
+}
+
+static struct futex_bucket* hash_bucket(const struct futex_key* key)
+{
+    unsigned long hash =
+        ((unsigned long)key->vm ^ key->addr) * 0x9e3779b97f4a7c15UL;
+
+    return &futex_hash[hash >> (64 - FUTEX_HASH_BITS)];
+}
+
+static inline int key_equal(const struct futex_key* a,
+                            const struct futex_key* b)
+{
+    return a->vm == b->vm && a->addr == b->addr;
+}
+
+/* find the key of the word at uaddr in the address space of p and the kernel
+ * address it can be read at */
+static int get_key(struct proc* p, uint32_t* uaddr, struct futex_key* key,
+                   uint32_t** word)
+{
+    unsigned long addr = (unsigned long)uaddr;
+    unsigned long phys;
+
+    if (addr % sizeof(uint32_t)) return EINVAL;
+    if (!(phys = vm_lookup(p, addr))) return EFAULT;
+
+    if (page_movable(rounddown(phys, PG_SIZE))) {
+        key->vm = &p->vm;
+        key->addr = addr;
+    } else {
+        key->vm = NULL;
+        key->addr = phys;
+    }
+
+    *word = __va(phys);
+    return 0;
+}
+
+/* lock the bucket p is queued in, a requeue may move it in the meantime */
+static struct futex_bucket* lock_waiter_bucket(struct proc* p)
+{
+    for (;;) {
+        struct futex_bucket* bucket = hash_bucket(&p->futex_key);
+
+        spinlock_lock(&bucket->lock);
+        if (bucket == hash_bucket(&p->futex_key)) return bucket;
+        spinlock_unlock(&bucket->lock);
+    }
+}
+
+/* lock two buckets in address order */
+static void lock_buckets(struct futex_bucket* b1, struct futex_bucket* b2)
+{
+    if (b1 > b2) {
+        struct futex_bucket* tmp = b1;
+        b1 = b2;
+        b2 = tmp;
+    }
+
+    spinlock_lock(&b1->lock);
+    if (b2 != b1) spinlock_lock(&b2->lock);
+}
+
+static void unlock_buckets(struct futex_bucket* b1, struct futex_bucket* b2)
+{
+    spinlock_unlock(&b1->lock);
+    if (b2 != b1) spinlock_unlock(&b2->lock);
+}
+
+/* wake up to nr processes of bucket waiting on key */
+static int wake_waiters(struct futex_bucket* bucket,
+                        const struct futex_key* key, int nr)
+{
+    struct proc *w, *tmp;
+    int woken = 0;
+
+    list_for_each_entry_safe(w, tmp, &bucket->waiters, futex_link)
+    {
+        if (woken >= nr) break;
+        if (!key_equal(&w->futex_key, key)) continue;
+
+        /* it finds itself off the queue when the call is restarted */
+        list_del(&w->futex_link);
+        PST_UNSET_FLAGS(w, PST_BLOCKED);
+        woken++;
+    }
+
+    return woken;
+}
+
+/* block p as long as uaddr contains val, for at most timeout nanoseconds
+ * unless it is 0. Returns 0 with PF_FUTEX set if p has been blocked, the
+ * caller restarts the call when p runs again, and 0 with PF_FUTEX clear once
+ * p has been woken up. */
+int futex_wait(struct proc* p, uint32_t* uaddr, uint32_t val, uint64_t timeout)
+{
+    struct futex_bucket* bucket;
+    uint32_t* word;
+    int retval;
+
+    if (p->flags & PF_FUTEX) {
+        bucket = lock_waiter_bucket(p);
+
+        /* woken up, or else the timeout has fired */
+        if (list_empty(&p->futex_link)) {
+            retval = 0;
+            goto out;
+        }
+
+        goto wait;
+    }
+
+    if ((retval = get_key(p, uaddr, &p->futex_key, &word)) != 0)
+        return retval;
+
+    bucket = hash_bucket(&p->futex_key);
+    spinlock_lock(&bucket->lock);
+
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) != val) {
+        spinlock_unlock(&bucket->lock);
+        return EAGAIN;
+    }
+
+    p->flags |= PF_FUTEX;
+    list_add_tail(&p->futex_link, &bucket->waiters);
+
+wait:
+    if ((retval = proc_timeout_begin(p, timeout, 1)) != 0) {
+        list_del(&p->futex_link);
+        goto out;
+    }
+
+    PST_SET_FLAGS(p, PST_BLOCKED);
+    spinlock_unlock(&bucket->lock);
+    return 0;
+
+out:
+    p->flags &= ~PF_FUTEX;
+    spinlock_unlock(&bucket->lock);
+    proc_timeout_end(p);
+    return retval;
+}
+
+/* wake up to nr processes waiting on uaddr, *woken is set to their number */
+int futex_wake(struct proc* p, uint32_t* uaddr, int nr, int* woken)
+{
+    struct futex_bucket* bucket;
+    struct futex_key key;
+    uint32_t* word;
+    int retval;
+
+    if (nr < 0) return EINVAL;
+    if ((retval = get_key(p, uaddr, &key, &word)) != 0) return retval;
+
+    bucket = hash_bucket(&key);
+    spinlock_lock(&bucket->lock);
+    *woken = wake_waiters(bucket, &key, nr);
+    spinlock_unlock(&bucket->lock);
+
+    return 0;
+}
+
+/* if uaddr still contains val, wake up to nr_wake processes waiting on it and
+ * move up to nr_requeue of the others to uaddr2. A condition variable
+ * broadcast wakes one waiter and requeues the rest on the mutex instead of
+ * letting them all contend for it. *count is set to the number of processes
+ * woken up or moved. */
+int futex_requeue(struct proc* p, uint32_t* uaddr, int nr_wake,
+                  uint32_t* uaddr2, int nr_requeue, uint32_t val, int* count)
+{
+    struct futex_bucket *b1, *b2;
+    struct futex_key key1, key2;
+    struct proc *w, *tmp;
+    uint32_t *word, *word2;
+    int retval, moved = 0;
+
+    if (nr_wake < 0 || nr_requeue < 0) return EINVAL;
+    if ((retval = get_key(p, uaddr, &key1, &word)) != 0) return retval;
+    if ((retval = get_key(p, uaddr2, &key2, &word2)) != 0) return retval;
+
+    b1 = hash_bucket(&key1);
+    b2 = hash_bucket(&key2);
+    lock_buckets(b1, b2);
+
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) != val) {
+        unlock_buckets(b1, b2);
+        return EAGAIN;
+    }
+
+    *count = wake_waiters(b1, &key1, nr_wake);
+
+    list_for_each_entry_safe(w, tmp, &b1->waiters, futex_link)
+    {
+        if (moved >= nr_requeue) break;
+        if (!key_equal(&w->futex_key, &key1)) continue;
+
+        w->futex_key = key2;
+        if (b2 != b1) list_move_tail(&w->futex_link, &b2->waiters);
+        moved++;
+    }
+
+    unlock_buckets(b1, b2);
+
+    *count += moved;
+    return 0;
+}
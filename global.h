@@ -11,6 +11,6 @@
 
 EXTERN unsigned long va_pa_offset;
 
-EXTERN struct proc proc_table[PROC_MAX];
+EXTERN int ncpus; /* number of harts the kernel runs on */
 
 #endif
@@ -0,0 +1,163 @@
+#include "cpulocals.h"
+#include "csr.h"
+#include "global.h"
+#include "proto.h"
+#include "sbi.h"
+#include "spinlock.h"
+
+/* Inter-processor interrupts. Every hart has a set of pending message flags
+ * and a queue of remote function calls. A message is posted by setting the
+ * flag (and queueing the call) first and sending the software interrupt
+ * after, so the receiver never sees the interrupt without the message.
+ *
+ * Remote functions run in interrupt context on the target hart and without
+ * the kernel lock, since the sender may be holding it while it waits for the
+ * call to finish. For the same reason a hart spinning on the kernel lock keeps
+ * running the calls queued for it. */
+
+void init_ipi()
+{
+    int cpu;
+
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        spinlock_init(get_cpu_var_ptr(cpu, ipi_lock));
+        INIT_LIST_HEAD(get_cpu_var_ptr(cpu, ipi_call_queue));
+        get_cpu_var(cpu, ipi_pending) = 0;
+    }
+}
+
+static void send_ipi_mask(unsigned long hart_mask)
+{
+    /* one SBI call interrupts all the harts in the mask */
+    if (hart_mask) sbi_send_ipi(&hart_mask);
+}
+
+static void run_ipi_calls()
+{
+    spinlock_t* lock = get_cpulocal_var_ptr(ipi_lock);
+    struct list_head* queue = get_cpulocal_var_ptr(ipi_call_queue);
+
+    for (;;) {
+        struct ipi_call_entry* entry;
+        struct ipi_call* call;
+
+        spinlock_lock(lock);
+        if (list_empty(queue)) {
+            spinlock_unlock(lock);
+            break;
+        }
+        entry = list_first_entry(queue, struct ipi_call_entry, list);
+        list_del(&entry->list);
+        spinlock_unlock(lock);
+
+        /* the entry may be reused by the sender as soon as pending drops */
+        call = entry->call;
+        call->func(call->arg);
+        __atomic_fetch_sub(&call->pending, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* handle the messages posted to this hart */
+void handle_ipi()
+{
+    unsigned int pending;
+
+    csr_clear(sip, SIE_SSIE);
+
+    pending = __atomic_exchange_n(get_cpulocal_var_ptr(ipi_pending), 0,
+                                  __ATOMIC_ACQUIRE);
+
+    if (pending & IPI_CALL_FUNC) run_ipi_calls();
+
+    /* nothing to do for IPI_RESCHEDULE, the hart goes through pick_proc() on
+     * its way back from the trap */
+}
+
+/* called while spinning for the kernel lock */
+void ipi_poll()
+{
+    if (__atomic_load_n(get_cpulocal_var_ptr(ipi_pending), __ATOMIC_RELAXED) &
+        IPI_CALL_FUNC)
+        handle_ipi();
+}
+
+static void wait_ipi_call(struct ipi_call* call)
+{
+    while (__atomic_load_n(&call->pending, __ATOMIC_ACQUIRE)) {
+        /* the target may be waiting for a call from us in turn */
+        ipi_poll();
+    }
+}
+
+/* run func(arg) on every online hart in cpu_mask, including this one if it is
+ * in the mask, all the other harts are interrupted with one SBI call. If wait
+ * is set return only after all of them have finished. */
+void smp_call_function_many(unsigned long cpu_mask, void (*func)(void*),
+                            void* arg, int wait)
+{
+    struct ipi_call* call = get_cpulocal_var_ptr(ipi_call_data);
+    unsigned long hart_mask = 0;
+    unsigned int nr_targets = 0;
+    int cpu, self = cpuid;
+
+    /* the call data and entries of this hart are reused, the previous
+     * asynchronous call may still be in flight */
+    wait_ipi_call(call);
+
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        if (cpu != self && (cpu_mask & (1UL << cpu)) &&
+            get_cpu_var(cpu, cpu_online))
+            nr_targets++;
+    }
+
+    call->func = func;
+    call->arg = arg;
+    __atomic_store_n(&call->pending, nr_targets, __ATOMIC_RELEASE);
+
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        struct ipi_call_entry* entry =
+            get_cpulocal_var_ptr(ipi_call_entries[cpu]);
+
+        if (cpu == self || !(cpu_mask & (1UL << cpu)) ||
+            !get_cpu_var(cpu, cpu_online))
+            continue;
+
+        entry->call = call;
+
+        spinlock_lock(get_cpu_var_ptr(cpu, ipi_lock));
+        list_add_tail(&entry->list, get_cpu_var_ptr(cpu, ipi_call_queue));
+        spinlock_unlock(get_cpu_var_ptr(cpu, ipi_lock));
+
+        __atomic_fetch_or(get_cpu_var_ptr(cpu, ipi_pending), IPI_CALL_FUNC,
+                          __ATOMIC_RELEASE);
+        hart_mask |= 1UL << get_cpu_var(cpu, hart_id);
+    }
+
+    send_ipi_mask(hart_mask);
+
+    if (cpu_mask & (1UL << self)) func(arg);
+
+    if (wait) wait_ipi_call(call);
+}
+
+void smp_call_function_single(int cpu, void (*func)(void*), void* arg,
+                              int wait)
+{
+    smp_call_function_many(1UL << cpu, func, arg, wait);
+}
+
+/* run func(arg) on all other harts */
+void smp_call_function(void (*func)(void*), void* arg, int wait)
+{
+    smp_call_function_many(CPU_MASK_ALL & ~(1UL << cpuid), func, arg, wait);
+}
+
+/* make the hart go through the scheduler */
+void smp_send_reschedule(int cpu)
+{
+    if (cpu == cpuid) return;
+
+    __atomic_fetch_or(get_cpu_var_ptr(cpu, ipi_pending), IPI_RESCHEDULE,
+                      __ATOMIC_RELEASE);
+    send_ipi_mask(1UL << get_cpu_var(cpu, hart_id));
+}
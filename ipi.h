@@ -0,0 +1,23 @@
+#ifndef _IPI_H_
+#define _IPI_H_
+
+#include "list.h"
+
+/* messages, see ipi.c */
+#define IPI_RESCHEDULE 0x1 /* go through the scheduler */
+#define IPI_CALL_FUNC 0x2  /* run the queued remote function calls */
+
+/* a remote function call, shared by all the harts it is sent to */
+struct ipi_call {
+    void (*func)(void*);
+    void* arg;
+    unsigned int pending __attribute__((aligned(4))); /* harts yet to run it */
+};
+
+/* links a call into the queue of one target hart */
+struct ipi_call_entry {
+    struct list_head list;
+    struct ipi_call* call;
+};
+
+#endif
@@ -1,13 +1,18 @@
+#include "csr.h"
 #include "proto.h"
 
 /* interrupt causes */
+#define INTERRUPT_CAUSE_SOFTWARE 1
 #define INTERRUPT_CAUSE_TIMER 5
 
 #define INTERRUPT_CAUSE_FLAG (1UL << (__riscv_xlen - 1))
 
-void handle_irq(struct proc* p)
+static void do_irq(reg_t scause)
 {
-    switch (p->regs.scause & ~INTERRUPT_CAUSE_FLAG) {
+    switch (scause & ~INTERRUPT_CAUSE_FLAG) {
+    case INTERRUPT_CAUSE_SOFTWARE:
+        handle_ipi();
+        break;
     case INTERRUPT_CAUSE_TIMER:
         timer_interrupt();
         break;
@@ -15,3 +20,32 @@ void handle_irq(struct proc* p)
         break;
     }
 }
+
+void handle_irq(struct proc* p) { do_irq(p->regs.scause); }
+
+/* traps taken in kernel mode, the kernel only enables interrupts while it is
+ * idle so anything else is a bug */
+void handle_kernel_trap(reg_t scause, reg_t sepc, reg_t sbadaddr)
+{
+    if (scause & INTERRUPT_CAUSE_FLAG) {
+        /* the hart does not hold the kernel lock while it is idle */
+        lock_kernel();
+        do_irq(scause);
+        unlock_kernel();
+        return;
+    }
+
+    panic("unhandled kernel trap(scause: %lx, sepc: %lx, sbadaddr: %lx)",
+          scause, sepc, sbadaddr);
+}
+
+/* wait for the next interrupt and handle it */
+void halt_cpu()
+{
+    /* wfi returns as soon as an interrupt is pending even if SIE is clear, so
+     * there is no window where a wakeup could be lost */
+    __asm__ __volatile__("wfi" : : : "memory");
+
+    csr_set(sstatus, SR_SIE);
+    csr_clear(sstatus, SR_SIE);
+}
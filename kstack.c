@@ -0,0 +1,106 @@
+#include "bitmap.h"
+#include "const.h"
+#include "proto.h"
+#include "stackframe.h"
+#include "vm.h"
+
+/* Kernel stacks live in their own virtual area. Every slot is a guard
+ * followed by the stack itself, the guard is never mapped so that a stack
+ * overflow faults instead of silently corrupting the neighbour. The trap
+ * taken for that fault cannot push its frame on the same stack,
+ * trap_entry_kernel (trap.S) checks for it and switches to the overflow stack
+ * of the hart to panic. */
+
+#if KSTACK_SLOT_SIZE != 2 * KSTACK_SIZE
+#error "a kernel stack slot is a guard and a stack of KSTACK_SIZE"
+#endif
+
+#define KSTACK_CACHE_MAX 16 /* freed stacks kept mapped for reuse */
+
+static bitchunk_t kstack_map[BITCHUNKS(KSTACK_MAX)];
+
+static void* kstack_cache[KSTACK_CACHE_MAX];
+static int kstack_cached;
+
+char overflow_stacks[CONFIG_SMP_MAX_CPUS][OVERFLOW_STACK_SIZE]
+    __attribute__((aligned(16)));
+
+/* called by trap_entry_kernel on the overflow stack of the hart */
+void kstack_overflow(reg_t sepc, reg_t sbadaddr)
+{
+    panic("kernel stack overflow (sepc: %lx, sbadaddr: %lx)", sepc, sbadaddr);
+}
+
+static int alloc_kstack_slot()
+{
+    int i, j;
+
+    for (i = 0; i < BITCHUNKS(KSTACK_MAX); i++) {
+        if (kstack_map[i] == ~0UL) continue;
+
+        for (j = 0; j < BITCHUNK_BITS; j++) {
+            int slot = i * BITCHUNK_BITS + j;
+
+            if (slot >= KSTACK_MAX) return -1;
+            if (!GET_BIT(kstack_map, slot)) {
+                SET_BIT(kstack_map, slot);
+                return slot;
+            }
+        }
+    }
+
+    return -1;
+}
+
+static void unmap_kstack(unsigned long base, unsigned long len)
+{
+    unsigned long addr;
+
+    for (addr = base; addr < base + len; addr += PG_SIZE) {
+        unsigned long phys_addr = kern_unmap_page(addr);
+        if (phys_addr) free_mem(phys_addr, PG_SIZE);
+    }
+}
+
+/* allocate a kernel stack and return its top */
+void* alloc_kstack()
+{
+    unsigned long base, addr;
+    int slot;
+
+    if (kstack_cached > 0) return kstack_cache[--kstack_cached];
+
+    if ((slot = alloc_kstack_slot()) < 0) return NULL;
+
+    base = KSTACK_AREA_START + (unsigned long)slot * KSTACK_SLOT_SIZE +
+           KSTACK_SLOT_SIZE - KSTACK_SIZE;
+    for (addr = base; addr < base + KSTACK_SIZE; addr += PG_SIZE) {
+        unsigned long phys_addr = alloc_pages(1);
+
+        if (!phys_addr) {
+            unmap_kstack(base, addr - base);
+            tlb_flush_kernel_range(base, addr - base);
+            UNSET_BIT(kstack_map, slot);
+            return NULL;
+        }
+
+        kern_map_page(phys_addr, addr);
+    }
+
+    return (void*)(base + KSTACK_SIZE);
+}
+
+void free_kstack(void* stack_top)
+{
+    unsigned long base = (unsigned long)stack_top - KSTACK_SIZE;
+    int slot = (base - KSTACK_AREA_START) / KSTACK_SLOT_SIZE;
+
+    if (kstack_cached < KSTACK_CACHE_MAX) {
+        kstack_cache[kstack_cached++] = stack_top;
+        return;
+    }
+
+    unmap_kstack(base, KSTACK_SIZE);
+    tlb_flush_kernel_range(base, KSTACK_SIZE);
+    UNSET_BIT(kstack_map, slot);
+}
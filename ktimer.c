@@ -0,0 +1,298 @@
+#include "bitmap.h"
+#include "cpulocals.h"
+#include "global.h"
+#include "ktimer.h"
+#include "proto.h"
+#include "rbtree.h"
+
+/* Software timers. Every hart keeps two queues of them.
+ *
+ * Timeouts that need not be precise go to a hierarchical timing wheel. Level
+ * 0 has WHEEL_SIZE slots of WHEEL_GRAN_NS and each level above is
+ * 2^WHEEL_CLK_SHIFT times coarser. A timer is put in the lowest level whose
+ * range covers it and stays there, nothing is cascaded down, so adding and
+ * removing one is O(1). It runs when its slot comes around, which may be up
+ * to one slot of its level (about 1/8 of the timeout) after it expires.
+ *
+ * Precise deadlines go to a tree ordered by the latest time each timer may
+ * run, expires + slack. The hardware timer is armed for the first of these
+ * and the interrupt runs every timer that has expired by then, so timers
+ * closer together than their slack share one interrupt.
+ *
+ * The wheel clock of a hart moves in run_timers(), on each timer interrupt.
+ * Timers are always added to the queues of the current hart and everything
+ * runs with the kernel lock held. */
+
+#define WHEEL_GRAN_NS 1000000UL /* 1ms at level 0 */
+#define WHEEL_CLK_SHIFT 3
+
+#define LVL_SHIFT(lvl) ((lvl)*WHEEL_CLK_SHIFT)
+#define SLOT_BIT(idx) ((idx) & (WHEEL_SIZE - 1))
+
+static uint64_t wheel_gran; /* ticks per level 0 slot */
+
+/* called by init_timer() once the timebase is known */
+void init_timers()
+{
+    int cpu, i;
+
+    wheel_gran = ns_to_ticks(WHEEL_GRAN_NS);
+
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        for (i = 0; i < WHEEL_LEVELS * WHEEL_SIZE; i++) {
+            INIT_LIST_HEAD(get_cpu_var_ptr(cpu, timer_wheel[i]));
+        }
+        for (i = 0; i < WHEEL_LEVELS; i++) {
+            get_cpu_var(cpu, wheel_pending[i]) = 0;
+        }
+        get_cpu_var(cpu, wheel_clk) = read_cycles() / wheel_gran;
+
+        get_cpu_var(cpu, hrtimer_tree) = RB_ROOT;
+        get_cpu_var(cpu, hrtimer_leftmost) = NULL;
+    }
+}
+
+/* the first pending slot of the wheel, in wheel clock units */
+static uint64_t wheel_next_clk(int cpu)
+{
+    uint64_t clk = get_cpu_var(cpu, wheel_clk);
+    uint64_t next = TIMER_NO_EVENT;
+    int lvl;
+
+    for (lvl = 0; lvl < WHEEL_LEVELS; lvl++) {
+        bitchunk_t map = get_cpu_var(cpu, wheel_pending[lvl]);
+        uint64_t idx = (clk >> LVL_SHIFT(lvl)) + 1;
+        int start = SLOT_BIT(idx);
+        uint64_t t;
+
+        if (!map) continue;
+
+        /* rotate the slot of idx to bit 0 */
+        if (start) map = (map >> start) | (map << (WHEEL_SIZE - start));
+
+        t = (idx + bitchunk_ffs(map)) << LVL_SHIFT(lvl);
+        if (t < next) next = t;
+    }
+
+    return next;
+}
+
+static void wheel_add(int cpu, struct timer* timer)
+{
+    uint64_t clk = get_cpu_var(cpu, wheel_clk);
+    /* the first wheel clock at or after the expiry */
+    uint64_t expires = (timer->expires + wheel_gran - 1) / wheel_gran;
+    uint64_t idx = 0;
+    int lvl;
+
+    if (expires <= clk) expires = clk + 1;
+
+    for (lvl = 0; lvl < WHEEL_LEVELS; lvl++) {
+        int shift = LVL_SHIFT(lvl);
+
+        idx = (expires + (1UL << shift) - 1) >> shift;
+        if (idx - (clk >> shift) < WHEEL_SIZE) break;
+    }
+
+    if (lvl == WHEEL_LEVELS) {
+        /* beyond the range of the wheel, run_timers() adds it again when the
+         * last slot comes around */
+        lvl = WHEEL_LEVELS - 1;
+        idx = (clk >> LVL_SHIFT(lvl)) + WHEEL_SIZE - 1;
+    }
+
+    timer->slot = lvl * WHEEL_SIZE + SLOT_BIT(idx);
+    list_add_tail(&timer->list,
+                  get_cpu_var_ptr(cpu, timer_wheel[timer->slot]));
+    get_cpu_var(cpu, wheel_pending[lvl]) |= 1UL << SLOT_BIT(idx);
+}
+
+/* bring the wheel clock up to now, or to just before the first pending slot,
+ * before adding a timer. With a stale clock new timers would go to needlessly
+ * coarse levels. */
+static void wheel_forward(int cpu, uint64_t now)
+{
+    uint64_t clk = now / wheel_gran;
+    uint64_t next = wheel_next_clk(cpu);
+
+    if (next != TIMER_NO_EVENT && clk >= next) clk = next - 1;
+    if (clk > get_cpu_var(cpu, wheel_clk)) get_cpu_var(cpu, wheel_clk) = clk;
+}
+
+static void hrtimer_enqueue(int cpu, struct timer* timer)
+{
+    struct rb_root* root = get_cpu_var_ptr(cpu, hrtimer_tree);
+    struct rb_node **link = &root->node, *parent = NULL;
+    uint64_t latest = timer->expires + timer->slack;
+    int leftmost = 1;
+
+    while (*link) {
+        struct timer* t;
+
+        parent = *link;
+        t = rb_entry(parent, struct timer, node);
+
+        if (latest < t->expires + t->slack)
+            link = &parent->left;
+        else {
+            link = &parent->right;
+            leftmost = 0;
+        }
+    }
+
+    rb_link_node(&timer->node, parent, link);
+    rb_insert_color(&timer->node, root);
+
+    if (leftmost) get_cpu_var(cpu, hrtimer_leftmost) = &timer->node;
+}
+
+static void hrtimer_dequeue(int cpu, struct timer* timer)
+{
+    if (get_cpu_var(cpu, hrtimer_leftmost) == &timer->node)
+        get_cpu_var(cpu, hrtimer_leftmost) = rb_next(&timer->node);
+
+    rb_erase(&timer->node, get_cpu_var_ptr(cpu, hrtimer_tree));
+    RB_CLEAR_NODE(&timer->node);
+}
+
+/* run timer->func at expires (in ticks) or up to one slot of its wheel level
+ * later, a pending timer is moved */
+void add_timer(struct timer* timer, uint64_t expires)
+{
+    int cpu = cpuid;
+
+    del_timer(timer);
+
+    timer->expires = expires;
+    timer->hres = 0;
+    timer->cpu = cpu;
+    timer->pending = 1;
+
+    wheel_forward(cpu, read_cycles());
+    wheel_add(cpu, timer);
+}
+
+/* run timer->func between expires and expires + slack (in ticks) */
+void add_hrtimer(struct timer* timer, uint64_t expires, uint64_t slack)
+{
+    int cpu = cpuid;
+
+    del_timer(timer);
+
+    timer->expires = expires;
+    timer->slack = slack;
+    timer->hres = 1;
+    timer->cpu = cpu;
+    timer->pending = 1;
+
+    hrtimer_enqueue(cpu, timer);
+}
+
+/* returns 1 if the timer was pending */
+int del_timer(struct timer* timer)
+{
+    int cpu = timer->cpu;
+
+    if (!timer->pending) return 0;
+    timer->pending = 0;
+
+    if (timer->hres) {
+        hrtimer_dequeue(cpu, timer);
+        return 1;
+    }
+
+    list_del(&timer->list);
+    if (list_empty(get_cpu_var_ptr(cpu, timer_wheel[timer->slot])))
+        get_cpu_var(cpu, wheel_pending[timer->slot / WHEEL_SIZE]) &=
+            ~(1UL << SLOT_BIT(timer->slot));
+
+    return 1;
+}
+
+/* move the timers of the wheel slots that the clock has passed to expired */
+static void wheel_collect(int cpu, uint64_t clk, struct list_head* expired)
+{
+    uint64_t old = get_cpu_var(cpu, wheel_clk);
+    int lvl;
+
+    if (clk <= old) return;
+
+    for (lvl = 0; lvl < WHEEL_LEVELS; lvl++) {
+        bitchunk_t* pending = get_cpu_var_ptr(cpu, wheel_pending[lvl]);
+        uint64_t from = (old >> LVL_SHIFT(lvl)) + 1;
+        uint64_t to = clk >> LVL_SHIFT(lvl);
+        uint64_t idx;
+
+        if (to < from) continue;
+        /* a whole round or more, every slot is due */
+        if (to - from >= WHEEL_SIZE) to = from + WHEEL_SIZE - 1;
+
+        for (idx = from; idx <= to && *pending; idx++) {
+            int bit = SLOT_BIT(idx);
+            struct list_head* slot;
+
+            if (!(*pending & (1UL << bit))) continue;
+
+            slot = get_cpu_var_ptr(cpu, timer_wheel[lvl * WHEEL_SIZE + bit]);
+            while (!list_empty(slot))
+                list_move_tail(slot->next, expired);
+            *pending &= ~(1UL << bit);
+        }
+    }
+
+    get_cpu_var(cpu, wheel_clk) = clk;
+}
+
+/* run the expired timers of this hart, called from the timer interrupt */
+void run_timers()
+{
+    int cpu = cpuid;
+    uint64_t now = read_cycles();
+    struct list_head expired;
+    struct rb_node* node;
+
+    INIT_LIST_HEAD(&expired);
+    wheel_collect(cpu, now / wheel_gran, &expired);
+
+    while (!list_empty(&expired)) {
+        struct timer* timer = list_first_entry(&expired, struct timer, list);
+
+        if (timer->expires > now) {
+            /* was beyond the range of the wheel */
+            list_del(&timer->list);
+            wheel_add(cpu, timer);
+            continue;
+        }
+
+        del_timer(timer);
+        timer->func(timer);
+    }
+
+    while ((node = get_cpu_var(cpu, hrtimer_leftmost)) != NULL) {
+        struct timer* timer = rb_entry(node, struct timer, node);
+
+        /* the ones after it run by the end of their slack */
+        if (timer->expires > now) break;
+
+        del_timer(timer);
+        timer->func(timer);
+    }
+}
+
+/* the time the timer interrupt is needed next for the timers of cpu */
+uint64_t timers_next_event(int cpu)
+{
+    struct rb_node* leftmost = get_cpu_var(cpu, hrtimer_leftmost);
+    uint64_t next = wheel_next_clk(cpu);
+
+    if (next != TIMER_NO_EVENT) next *= wheel_gran;
+
+    if (leftmost) {
+        struct timer* timer = rb_entry(leftmost, struct timer, node);
+
+        if (timer->expires + timer->slack < next)
+            next = timer->expires + timer->slack;
+    }
+
+    return next;
+}
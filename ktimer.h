@@ -0,0 +1,33 @@
+#ifndef _KTIMER_H_
+#define _KTIMER_H_
+
+#include "list.h"
+#include "rbtree.h"
+
+#include <stdint.h>
+
+#define TIMER_NO_EVENT ((uint64_t)-1)
+
+/* timing wheel of each hart, see ktimer.c */
+#define WHEEL_LEVELS 6
+#define WHEEL_SIZE 64 /* slots per level, the pending bits fit in a bitchunk */
+
+#define DEFAULT_TIMER_SLACK_NS 50000UL /* 50us */
+
+/* a software timer, it runs func once from the timer interrupt of the hart it
+ * was added on. Zero-initialized timers are not pending. */
+struct timer {
+    struct list_head list; /* wheel slot */
+    struct rb_node node __attribute__((aligned(8))); /* high-res queue */
+    uint64_t expires; /* in ticks */
+    uint64_t slack;   /* a high-resolution timer may run this much later */
+    void (*func)(struct timer* timer);
+    int pending;
+    int hres; /* on the high-resolution queue instead of the wheel */
+    int cpu;  /* hart it is queued on */
+    int slot; /* in the wheel */
+};
+
+#define timer_pending(t) ((t)->pending)
+
+#endif
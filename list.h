@@ -32,6 +32,8 @@ struct list_head {
 
 static inline int list_empty(struct list_head* list);
 static inline void list_add(struct list_head* new, struct list_head* head);
+static inline void list_add_tail(struct list_head* new,
+                                 struct list_head* head);
 static inline void list_del(struct list_head* node);
 
 #define prefetch(x) __builtin_prefetch(&x)
@@ -64,6 +66,12 @@ static inline void list_add(struct list_head* new, struct list_head* head)
     __list_add(new, head, head->next);
 }
 
+static inline void list_add_tail(struct list_head* new,
+                                 struct list_head* head)
+{
+    __list_add(new, head->prev, head);
+}
+
 static inline void list_del(struct list_head* node)
 {
     node->prev->next = node->next;
@@ -73,4 +81,17 @@ static inline void list_del(struct list_head* node)
     node->next = node;
 }
 
+static inline void list_move(struct list_head* node, struct list_head* head)
+{
+    list_del(node);
+    list_add(node, head);
+}
+
+static inline void list_move_tail(struct list_head* node,
+                                  struct list_head* head)
+{
+    list_del(node);
+    list_add_tail(node, head);
+}
+
 #endif
@@ -0,0 +1,104 @@
+#include "proto.h"
+#include "spinlock.h"
+
+#ifdef CONFIG_LOCKSTAT
+
+/* Lock statistics per lock class. The counters of a class are shared by all
+ * locks in it, which may be held on several harts at once, so they are
+ * updated with atomics. */
+
+static struct lock_class* lock_classes;
+static DEF_SPINLOCK(class_list_lock);
+
+uint64_t lockstat_clock() { return read_cycles(); }
+
+void lockstat_register_class(struct lock_class* class)
+{
+    spinlock_lock(&class_list_lock);
+
+    if (!class->registered) {
+        class->next = lock_classes;
+        lock_classes = class;
+        class->registered = 1;
+    }
+
+    spinlock_unlock(&class_list_lock);
+}
+
+static void update_max(uint64_t* max, uint64_t val)
+{
+    uint64_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+    while (val > old) {
+        if (__atomic_compare_exchange_n(max, &old, val, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED))
+            break;
+    }
+}
+
+/* wait_start is 0 if the lock was taken without waiting */
+void lockstat_acquired(struct lockstat_data* stat, uint64_t wait_start)
+{
+    struct lock_class* class = stat->class;
+    uint64_t now;
+
+    if (!class) return;
+
+    now = lockstat_clock();
+    stat->acquired_at = now;
+
+    __atomic_fetch_add(&class->acquisitions, 1, __ATOMIC_RELAXED);
+
+    if (wait_start) {
+        uint64_t wait = now - wait_start;
+
+        __atomic_fetch_add(&class->contentions, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&class->wait_time, wait, __ATOMIC_RELAXED);
+        update_max(&class->max_wait_time, wait);
+    }
+}
+
+void lockstat_released(struct lockstat_data* stat)
+{
+    struct lock_class* class = stat->class;
+    uint64_t hold;
+
+    if (!class) return;
+
+    hold = lockstat_clock() - stat->acquired_at;
+    __atomic_fetch_add(&class->hold_time, hold, __ATOMIC_RELAXED);
+    update_max(&class->max_hold_time, hold);
+}
+
+/* print the statistics of all classes, times are in nanoseconds */
+void lockstat_dump()
+{
+    struct lock_class* class;
+
+    printk("%-16s %10s %10s %10s %10s %10s %10s\n", "class", "acq", "contended",
+           "avg-wait", "max-wait", "avg-hold", "max-hold");
+
+    spinlock_lock(&class_list_lock);
+
+    for (class = lock_classes; class; class = class->next) {
+        uint64_t acq = class->acquisitions;
+        uint64_t con = class->contentions;
+
+        printk("%-16s %10lu %10lu %10lu %10lu %10lu %10lu\n", class->name, acq,
+               con, con ? ticks_to_ns(class->wait_time / con) : 0,
+               ticks_to_ns(class->max_wait_time),
+               acq ? ticks_to_ns(class->hold_time / acq) : 0,
+               ticks_to_ns(class->max_hold_time));
+    }
+
+    spinlock_unlock(&class_list_lock);
+}
+
+#else
+
+void lockstat_dump()
+{
+    printk("lockstat: not enabled, build with LOCKSTAT=1\n");
+}
+
+#endif
@@ -1,15 +1,27 @@
 #include "global.h"
 #include "proto.h"
+#include "sbi.h"
 #include "vm.h"
 
 void kernel_main(unsigned int hart_id, void* dtb_phys)
 {
     void* dtb = __va(dtb_phys);
 
+    /* the boot hart holds the kernel lock until it first leaves the kernel */
+    lock_kernel();
+
     init_memory(dtb);
+    /* needs va_pa_offset for the DBCN buffer */
+    init_sbi();
+    init_smp(dtb, hart_id);
+    init_ipi();
+    init_tlb();
+    init_timer(dtb);
     init_trap();
     init_proc();
 
+    smp_boot_aps();
+
     switch_to_user();
 
     /* unreachable */
@@ -1,9 +1,11 @@
 #include "const.h"
+#include "cpulocals.h"
 #include "fdt.h"
 #include "global.h"
 #include "proto.h"
 #include "vm.h"
 
+#include <errno.h>
 #include <stdint.h>
 
 #define MEMMAP_MAX 10
@@ -109,12 +111,56 @@ void init_memory(void* dtb)
     of_scan_fdt(fdt_scan_memory, NULL, dtb);
 
     slabs_init();
+    vmalloc_init();
 }
 
-void copy_from_user(void* dst, const void* src, size_t len)
+/* whether [addr, addr + len) lies entirely in user space */
+static inline int user_range_ok(const void* addr, size_t len)
 {
-    /* TODO: check if user address is valid */
-    enable_user_access();
-    memcpy(dst, src, len);
-    disable_user_access();
+    unsigned long start = (unsigned long)addr;
+
+    return start + len >= start && start + len <= USER_ADDR_END;
+}
+
+/* copy len bytes between the user space of the running process at uaddr and
+ * the kernel at kaddr. Every page is looked up first and accessed through the
+ * direct map, an unmapped user page gives -EFAULT instead of a fault in the
+ * kernel. A copy to user space that fails may have been partly done. */
+static int copy_user(void* uaddr, void* kaddr, size_t len, int to_user)
+{
+    struct proc* p = get_cpulocal_var(proc_ptr);
+    unsigned long addr = (unsigned long)uaddr;
+
+    if (!user_range_ok(uaddr, len)) return -EFAULT;
+
+    while (len > 0) {
+        size_t chunk = PG_SIZE - addr % PG_SIZE;
+        unsigned long phys = vm_lookup(p, addr);
+
+        if (!phys) return -EFAULT;
+        if (chunk > len) chunk = len;
+
+        if (to_user)
+            memcpy(__va(phys), kaddr, chunk);
+        else
+            memcpy(kaddr, __va(phys), chunk);
+
+        addr += chunk;
+        kaddr += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+/* returns -EFAULT if src is not mapped in user space */
+int copy_from_user(void* dst, const void* src, size_t len)
+{
+    return copy_user((void*)src, dst, len, 0);
+}
+
+/* returns -EFAULT if dst is not mapped in user space */
+int copy_to_user(void* dst, const void* src, size_t len)
+{
+    return copy_user(dst, (void*)src, len, 1);
 }
@@ -0,0 +1,189 @@
+#include "cpulocals.h"
+#include "global.h"
+#include "mutex.h"
+#include "proc.h"
+#include "proto.h"
+
+/* Sleeping locks. A process that finds a mutex taken first spins for a
+ * while if the owner is running on another hart, since then it is likely to
+ * release the mutex soon, and otherwise sleeps until the owner wakes it up.
+ * The kernel lock is dropped while spinning so that the owner can make
+ * progress.
+ *
+ * The owner of a mutex inherits the priority of the most important process
+ * waiting for it, so that a process of a real-time class is not held up
+ * indefinitely by lower priority processes preempting a less important owner.
+ * Inheritance is transitive along the chain of mutexes the owners wait for.
+ *
+ * Semaphores have no owner and never spin. */
+
+#define MUTEX_SPIN_NS 20000UL /* give up spinning after 20us */
+#define PI_CHAIN_MAX 8         /* owners boosted by one waiter */
+
+/* the waiters are kept in priority order, first come first served within a
+ * priority */
+static void waiter_insert(struct mutex* m, struct proc* p)
+{
+    struct proc* w;
+
+    list_for_each_entry(w, &m->waiters, wait_link)
+    {
+        if (p->priority < w->priority) break;
+    }
+
+    list_add_tail(&p->wait_link, &w->wait_link);
+}
+
+/* the priority p inherits from the waiters of the mutexes it holds, FAIR_Q
+ * (nothing) if there are none. Only the fixed priority queues can be
+ * inherited, a SCHED_DEADLINE waiter gives TASK_Q. */
+static int top_waiter_prio(struct proc* p)
+{
+    int prio = FAIR_Q;
+    struct mutex* m;
+
+    list_for_each_entry(m, &p->held_mutexes, held_link)
+    {
+        struct proc* w;
+
+        if (list_empty(&m->waiters)) continue;
+
+        w = list_first_entry(&m->waiters, struct proc, wait_link);
+        if (w->priority < prio) prio = w->priority;
+    }
+
+    return prio < TASK_Q ? TASK_Q : prio;
+}
+
+/* recompute what owner inherits and pass a change on to the owners of the
+ * mutexes it waits for */
+static void pi_update(struct proc* owner)
+{
+    int depth;
+
+    for (depth = 0; owner && depth < PI_CHAIN_MAX; depth++) {
+        int prio = top_waiter_prio(owner);
+        struct mutex* m = owner->blocked_on;
+
+        if (prio == owner->pi_priority) break;
+        sched_inherit_priority(owner, prio);
+
+        /* not waiting any more or already woken up */
+        if (!m || list_empty(&owner->wait_link)) break;
+
+        list_del(&owner->wait_link);
+        waiter_insert(m, owner);
+        owner = m->owner;
+    }
+}
+
+static inline int owner_running(struct proc* owner)
+{
+    struct proc* volatile* curr = get_cpu_var_ptr(owner->regs.cpu, proc_ptr);
+
+    return *curr == owner;
+}
+
+/* spin while owner holds m and runs on another hart, returns 1 if it has let
+ * go of m in the meantime */
+static int mutex_spin(struct mutex* m, struct proc* owner)
+{
+    uint64_t deadline = read_cycles() + ns_to_ticks(MUTEX_SPIN_NS);
+
+    unlock_kernel();
+
+    while (__atomic_load_n(&m->owner, __ATOMIC_RELAXED) == owner &&
+           owner_running(owner) && read_cycles() < deadline) {
+        /* a hart holding the kernel lock may wait for us */
+        ipi_poll();
+    }
+
+    lock_kernel();
+
+    return m->owner != owner;
+}
+
+static void mutex_acquire(struct mutex* m, struct proc* p)
+{
+    __atomic_store_n(&m->owner, p, __ATOMIC_RELAXED);
+    list_add(&m->held_link, &p->held_mutexes);
+
+    /* the remaining waiters boost the new owner */
+    if (!list_empty(&m->waiters)) pi_update(p);
+}
+
+void mutex_lock(struct mutex* m)
+{
+    struct proc* p = sleeping_proc();
+    struct proc* owner;
+
+    while ((owner = m->owner) != NULL) {
+        if (owner == p) panic("mutex_lock: %s takes a mutex twice", p->name);
+
+        if (owner_running(owner) && mutex_spin(m, owner)) continue;
+
+        PST_SET_FLAGS(p, PST_BLOCKED);
+        p->blocked_on = m;
+        waiter_insert(m, p);
+        pi_update(owner);
+
+        schedule_kernel(p);
+
+        /* taken off the list by mutex_unlock() */
+        list_del(&p->wait_link);
+        p->blocked_on = NULL;
+    }
+
+    mutex_acquire(m, p);
+}
+
+/* returns 1 if m has been taken */
+int mutex_trylock(struct mutex* m)
+{
+    if (m->owner) return 0;
+
+    mutex_acquire(m, sleeping_proc());
+    return 1;
+}
+
+/* release m and wake up its most important waiter, which has to compete for
+ * it with anyone else trying to take it in the meantime */
+void mutex_unlock(struct mutex* m)
+{
+    struct proc* p = m->owner;
+
+    __atomic_store_n(&m->owner, NULL, __ATOMIC_RELEASE);
+    list_del(&m->held_link);
+
+    if (!list_empty(&m->waiters)) {
+        struct proc* w =
+            list_first_entry(&m->waiters, struct proc, wait_link);
+
+        list_del(&w->wait_link);
+        PST_UNSET_FLAGS(w, PST_BLOCKED);
+    }
+
+    /* drop what was inherited through m */
+    pi_update(p);
+}
+
+void down(struct semaphore* sem)
+{
+    wait_event(&sem->wait, sem->count > 0);
+    sem->count--;
+}
+
+/* returns 1 if the semaphore has been taken */
+int down_trylock(struct semaphore* sem)
+{
+    if (sem->count <= 0) return 0;
+
+    sem->count--;
+    return 1;
+}
+
+void up(struct semaphore* sem)
+{
+    sem->count++;
+    wake_up(&sem->wait);
+}
@@ -0,0 +1,49 @@
+#ifndef _MUTEX_H_
+#define _MUTEX_H_
+
+#include "list.h"
+#include "waitqueue.h"
+
+#include <stddef.h>
+
+/* sleeping locks for kernel threads and system calls, see mutex.c */
+struct mutex {
+    struct proc* owner __attribute__((aligned(8)));
+    struct list_head waiters;   /* in priority order */
+    struct list_head held_link; /* in the held_mutexes list of the owner */
+};
+
+#define MUTEX_INIT(name)                                     \
+    {                                                        \
+        .owner = NULL, .waiters = LIST_INIT((name).waiters), \
+        .held_link = LIST_INIT((name).held_link)             \
+    }
+#define DEF_MUTEX(name) struct mutex name = MUTEX_INIT(name)
+
+static inline void mutex_init(struct mutex* m)
+{
+    m->owner = NULL;
+    INIT_LIST_HEAD(&m->waiters);
+    INIT_LIST_HEAD(&m->held_link);
+}
+
+#define mutex_is_locked(m) ((m)->owner != NULL)
+
+struct semaphore {
+    int count;
+    struct wait_queue_head wait;
+};
+
+#define SEMAPHORE_INIT(name, n)                            \
+    {                                                      \
+        .count = (n), .wait = WAIT_QUEUE_INIT((name).wait) \
+    }
+#define DEF_SEMAPHORE(name, n) struct semaphore name = SEMAPHORE_INIT(name, n)
+
+static inline void sema_init(struct semaphore* sem, int count)
+{
+    sem->count = count;
+    init_waitqueue_head(&sem->wait);
+}
+
+#endif
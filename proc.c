@@ -1,48 +1,303 @@
 #include "proc.h"
+#include "bitmap.h"
 #include "const.h"
+#include "cpulocals.h"
 #include "global.h"
 #include "proto.h"
 #include "vm.h"
 
+#include <errno.h>
+#include <string.h>
+
 #define INIT_ENTRY_POINT PG_SIZE
 
+/* Process descriptors are allocated from the slab and found by pid through a
+ * hash table, pids are handed out from a bitmap starting after the last one
+ * allocated so that a free pid is usually found in the first chunk looked at.
+ * None of this depends on the number of processes. */
+
+#define PID_HASH_SIZE 1024
+#define PID_HASH(pid) ((pid) & (PID_HASH_SIZE - 1))
+
+static bitchunk_t pid_map[BITCHUNKS(PID_MAX)];
+static int next_pid = INIT_PID;
+static struct list_head pid_hash[PID_HASH_SIZE];
+
+static void init_idle_proc(int cpu);
 static void spawn_init();
+static void idle();
 
 void init_proc()
 {
     int i;
-    for (i = 0; i < PROC_MAX; i++) {
-        struct proc* p = &proc_table[i];
 
-        p->state = PST_FREESLOT;
+    for (i = 0; i < PID_HASH_SIZE; i++) {
+        INIT_LIST_HEAD(&pid_hash[i]);
+    }
+    /* pid 0 is never used */
+    SET_BIT(pid_map, 0);
+
+    for (i = 0; i < ncpus; i++) {
+        init_idle_proc(i);
     }
 
+    init_sched();
+    init_workqueues();
+    init_futex();
+    /* before the workers so that it gets INIT_PID */
     spawn_init();
+    start_workers();
+
+#ifdef CONFIG_SELFTEST
+    start_selftests();
+#endif
 }
 
-void switch_to_user()
+/* returns -1 if all pids are in use */
+static int alloc_pid()
+{
+    int start = next_pid / BITCHUNK_BITS;
+    int i;
+
+    for (i = 0; i <= BITCHUNKS(PID_MAX); i++) {
+        int idx = (start + i) % BITCHUNKS(PID_MAX);
+        bitchunk_t chunk = pid_map[idx];
+        int pid;
+
+        /* do not go back to the pids below next_pid in the first chunk
+         * before the others have been tried */
+        if (i == 0) chunk |= (1UL << CHUNK_OFFSET(next_pid)) - 1;
+        if (chunk == ~0UL) continue;
+
+        pid = idx * BITCHUNK_BITS + bitchunk_ffs(~chunk);
+        if (pid >= PID_MAX) continue;
+
+        SET_BIT(pid_map, pid);
+        next_pid = pid + 1 < PID_MAX ? pid + 1 : INIT_PID;
+        return pid;
+    }
+
+    return -1;
+}
+
+struct proc* proc_lookup(int pid)
 {
     struct proc* p;
-    extern char KStackTop;
 
-    p = pick_proc();
+    list_for_each_entry(p, &pid_hash[PID_HASH(pid)], pid_link)
+    {
+        if (p->pid == pid) return p;
+    }
 
-    /* set kernel stack */
-    p->regs.kernel_sp = (reg_t)&KStackTop;
-    switch_address_space(p);
+    return NULL;
+}
+
+/* allocate a descriptor with a pid and a kernel stack, the process stays
+ * PST_NEW until the caller has set it up */
+static struct proc* alloc_proc()
+{
+    struct proc* p;
+    int pid;
+
+    SLABALLOC(p);
+    if (!p) return NULL;
+    memset(p, 0, sizeof(*p));
+
+    /* traps from the process run on its own kernel stack */
+    p->regs.kernel_sp = (reg_t)alloc_kstack();
+    if (!p->regs.kernel_sp) goto free_proc;
+
+    if ((pid = alloc_pid()) < 0) goto free_stack;
+
+    p->pid = pid;
+    p->state = PST_NEW;
+    INIT_LIST_HEAD(&p->children);
+    INIT_LIST_HEAD(&p->sibling);
+    INIT_LIST_HEAD(&p->wait_link);
+    INIT_LIST_HEAD(&p->held_mutexes);
+    list_add(&p->pid_link, &pid_hash[PID_HASH(pid)]);
+
+    return p;
+
+free_stack:
+    free_kstack((void*)p->regs.kernel_sp);
+free_proc:
+    SLABFREE(p);
+    return NULL;
+}
+
+static void free_proc(struct proc* p)
+{
+    list_del(&p->pid_link);
+    UNSET_BIT(pid_map, p->pid);
+
+    free_kstack((void*)p->regs.kernel_sp);
+    SLABFREE(p);
+}
+
+/* The idle task of a hart is never scheduled, it only provides the hart with
+ * a kernel stack and a tp value while it is not running any process. */
+static void init_idle_proc(int cpu)
+{
+    struct proc* p = get_cpu_var_ptr(cpu, idle_proc);
+
+    p->regs.cpu = cpu;
+    p->regs.kernel_sp = (reg_t)alloc_kstack();
+    if (!p->regs.kernel_sp) panic("unable to allocate idle stack");
+
+    p->vm.ptbr_phys = (reg_t)__pa(initial_pgd);
+    p->vm.ptbr_vir = (reg_t*)initial_pgd;
+
+    INIT_LIST_HEAD(&p->run_list);
+}
+
+/* called by switch_to_user (trap.S) to find the stack to switch to */
+struct proc* get_idle_proc() { return get_cpulocal_var_ptr(idle_proc); }
+
+/* runs on the idle stack of the hart, see switch_to_user in trap.S */
+void do_switch_to_user()
+{
+    struct proc* prev = get_cpulocal_var(proc_ptr);
+    struct proc* p;
+
+    if (prev) {
+        account_sys_time(prev);
+
+        get_cpulocal_var(proc_ptr) = NULL;
+        if (proc_is_runnable(prev)) requeue_proc(prev);
+    }
+
+    while (!(p = pick_proc())) {
+        idle();
+    }
+
+    /* if we return to the same process its last accounting point was set by
+     * account_sys_time() and its quantum deadline has not moved */
+    if (p != prev) p->last_cycles = read_cycles();
+    p->regs.cpu = cpuid;
+    get_cpulocal_var(proc_ptr) = p;
 
     restart_local_timer();
-    p->last_cycles = read_cycles();
+
+    /* kernel threads keep the kernel lock and run on whatever address space
+     * is loaded, the kernel half is the same in all of them */
+    if (p->flags & PF_KTHREAD) resume_kcontext(p);
+
+    switch_address_space(p);
+
+    /* went to sleep in a system call, finish it first */
+    if (p->flags & PF_KSLEEP) resume_kcontext(p);
+
+    unlock_kernel();
     restore_user_context(p);
 }
 
+/* called by the fast system call path (see trap.S) once the call is done,
+ * returns 1 with the kernel lock released if p can go back to user space
+ * right away, otherwise it leaves through do_switch_to_user(). The address
+ * space of p is still loaded and restart_local_timer() only reaches the SBI if
+ * the call has moved the next timer event. */
+int syscall_fast_return(struct proc* p)
+{
+    account_sys_time(p);
+
+    if (!proc_is_runnable(p) || sched_preempt_pending(p)) return 0;
+
+    restart_local_timer();
+    unlock_kernel();
+    return 1;
+}
+
+/* low priority housekeeping of an idle hart, done a step at a time so that a
+ * process that becomes runnable meanwhile is picked up quickly. Returns 1 if
+ * there was something to do. */
+static int idle_work() { return idle_zero_page() || vmalloc_purge_idle(); }
+
+static void idle()
+{
+    if (idle_work()) return;
+
+    /* nothing is runnable, no quantum to enforce */
+    set_idle_timer();
+
+    /* set before dropping the lock so that a hart making a process runnable
+     * afterwards sends us an IPI */
+    get_cpulocal_var(halt_start) = read_cycles();
+    get_cpulocal_var(cpu_is_idle) = 1;
+    unlock_kernel();
+
+    halt_cpu();
+
+    /* under the lock, sys_cpu_times() counts the time since halt_start while
+     * cpu_is_idle is set */
+    lock_kernel();
+    get_cpulocal_var(idle_time) +=
+        read_cycles() - get_cpulocal_var(halt_start);
+    get_cpulocal_var(cpu_is_idle) = 0;
+}
+
+/* create a kernel thread that runs fn(arg) on cpu. It runs in supervisor mode
+ * on its own kernel stack and is scheduled at TASK_Q like any other process,
+ * giving up the hart only when it calls schedule(). */
+struct proc* kthread_create(const char* name, void (*fn)(void*), void* arg,
+                            int cpu)
+{
+    extern char kthread_start;
+    struct proc* p = alloc_proc();
+
+    if (!p) return NULL;
+
+    p->flags = PF_KTHREAD;
+    memcpy(p->name, name, strnlen(name, PROC_NAME_MAX - 1));
+
+    /* resume_kcontext() enters it through kthread_start (trap.S) */
+    p->regs.kctx.ra = (reg_t)&kthread_start;
+    p->regs.kctx.sp = p->regs.kernel_sp;
+    p->regs.kctx.s[0] = (reg_t)fn;
+    p->regs.kctx.s[1] = (reg_t)arg;
+
+    sched_fork(p, NULL);
+    p->cpu_mask = 1UL << cpu;
+    p->regs.cpu = cpu;
+
+    PST_UNSET_FLAGS(p, PST_NEW);
+    return p;
+}
+
+void kthread_return(struct proc* p)
+{
+    panic("kernel thread %s returned", p->name);
+}
+
+/* give up the hart in kernel code, the running process p continues here once
+ * it is picked again. A process in a system call is resumed in its address
+ * space with the kernel lock held, on its own kernel stack. */
+void schedule_kernel(struct proc* p)
+{
+    p->flags |= PF_KSLEEP;
+    schedule();
+    p->flags &= ~PF_KSLEEP;
+}
+
+/* the shared section of the user image follows the data and is mapped over
+ * the same frames in every process, e.g. for futexes used across processes */
+static int map_user_shared(struct proc* p, unsigned long base)
+{
+    extern char _user_shared, _user_eshared;
+    unsigned long size =
+        roundup((unsigned long)(&_user_eshared - &_user_shared), PG_SIZE);
+
+    return vm_map(p, (unsigned long)__pa(&_user_shared), (void*)base,
+                  (void*)(base + size));
+}
+
 static void spawn_init()
 {
     /* setup everything for the INIT process */
     extern char _user_text, _user_etext, _user_data, _user_edata;
-    struct proc* p = &proc_table[0];
+    struct proc* p = alloc_proc();
 
-    p->state &= ~PST_FREESLOT;
+    if (!p || p->pid != INIT_PID) panic("unable to allocate INIT");
 
     /* reuse the initial page table */
     p->vm.ptbr_phys = (reg_t)__pa(initial_pgd);
@@ -61,11 +316,198 @@ static void spawn_init()
     p->regs.sepc = INIT_ENTRY_POINT;
     p->regs.sp = USER_STACK_TOP;
 
-    vm_map(p, user_text_start, (void*)INIT_ENTRY_POINT,
-           (void*)(INIT_ENTRY_POINT + user_text_size));
-    vm_map(p, user_data_start, (void*)(INIT_ENTRY_POINT + user_text_size),
-           (void*)(INIT_ENTRY_POINT + user_text_size + user_data_size));
-    /* allocate stack */
-    vm_map(p, 0, (void*)(USER_STACK_TOP - USER_STACK_SIZE),
-           (void*)USER_STACK_TOP);
+    if (vm_map(p, user_text_start, (void*)INIT_ENTRY_POINT,
+               (void*)(INIT_ENTRY_POINT + user_text_size)) ||
+        vm_map(p, user_data_start, (void*)(INIT_ENTRY_POINT + user_text_size),
+               (void*)(INIT_ENTRY_POINT + user_text_size + user_data_size)) ||
+        map_user_shared(p,
+                        INIT_ENTRY_POINT + user_text_size + user_data_size) ||
+        /* allocate stack */
+        vm_map(p, 0, (void*)(USER_STACK_TOP - USER_STACK_SIZE),
+               (void*)USER_STACK_TOP))
+        panic("unable to map INIT");
+
+    sched_fork(p, NULL);
+    PST_UNSET_FLAGS(p, PST_NEW);
+}
+
+/* create a child of parent that runs the user image at entry with arg in a0,
+ * the text and the shared section are shared while data and stack are private
+ * to the child. Returns a negative errno on failure. */
+int spawn_proc(struct proc* parent, reg_t entry, reg_t arg,
+               struct proc** child)
+{
+    extern char _user_text, _user_etext, _user_data, _user_edata;
+    unsigned long user_text_start = (unsigned long)__pa(&_user_text);
+    unsigned long user_text_size =
+        roundup((unsigned long)(&_user_etext - &_user_text), PG_SIZE);
+    unsigned long user_data_len = &_user_edata - &_user_data;
+    unsigned long user_data_base = INIT_ENTRY_POINT + user_text_size;
+    struct proc* p = alloc_proc();
+    int retval;
+
+    if (!p) return -EAGAIN;
+
+    if ((retval = vm_alloc_space(p)) != 0) goto failed;
+
+    retval = vm_map(p, user_text_start, (void*)INIT_ENTRY_POINT,
+                    (void*)user_data_base);
+    if (retval) goto failed;
+    retval = vm_map_copy(p, &_user_data, user_data_len, (void*)user_data_base,
+                         (void*)(user_data_base +
+                                 roundup(user_data_len, PG_SIZE)));
+    if (retval) goto failed;
+    retval =
+        map_user_shared(p, user_data_base + roundup(user_data_len, PG_SIZE));
+    if (retval) goto failed;
+    retval = vm_map(p, 0, (void*)(USER_STACK_TOP - USER_STACK_SIZE),
+                    (void*)USER_STACK_TOP);
+    if (retval) goto failed;
+
+    p->regs.sepc = entry;
+    p->regs.sp = USER_STACK_TOP;
+    p->regs.a0 = arg;
+
+    sched_fork(p, parent);
+    memcpy(p->name, parent->name, PROC_NAME_MAX);
+
+    p->parent = parent;
+    list_add_tail(&p->sibling, &parent->children);
+
+    *child = p;
+    PST_UNSET_FLAGS(p, PST_NEW);
+    return 0;
+
+failed:
+    vm_release(p);
+    free_proc(p);
+    return retval;
+}
+
+static int wait_matches(struct proc* parent, struct proc* child)
+{
+    return parent->wait_pid == -1 || parent->wait_pid == child->pid;
+}
+
+/* called on the hart the process is running on, the descriptor and kernel
+ * stack stay around until the parent has collected the exit status */
+void exit_proc(struct proc* p, int status)
+{
+    struct proc* init = proc_lookup(INIT_PID);
+    struct proc *child, *tmp;
+    int orphaned_zombie = 0;
+
+    if (p == init) panic("INIT exited");
+
+    p->exit_status = status;
+    proc_timeout_end(p);
+    sched_exit(p);
+    vm_release(p);
+
+    /* INIT adopts the children */
+    list_for_each_entry_safe(child, tmp, &p->children, sibling)
+    {
+        list_del(&child->sibling);
+        child->parent = init;
+        list_add_tail(&child->sibling, &init->children);
+
+        if (child->state & PST_ZOMBIE) orphaned_zombie = 1;
+    }
+
+    if (orphaned_zombie && (init->state & PST_WAITING))
+        PST_UNSET_FLAGS(init, PST_WAITING);
+
+    /* the parent restarts its wait and finds us */
+    if ((p->parent->state & PST_WAITING) && wait_matches(p->parent, p))
+        PST_UNSET_FLAGS(p->parent, PST_WAITING);
+
+    PST_SET_FLAGS(p, PST_ZOMBIE);
+}
+
+/* reap an exited child of p matching pid (-1 for any), returns EAGAIN and
+ * marks p PST_WAITING if there are matching children but none has exited.
+ * INIT waiting for any child always waits, it adopts orphans at any time. */
+int wait_proc(struct proc* p, int pid, int* child_pid, int* status)
+{
+    struct proc* child;
+    int found = 0;
+
+    if (pid != -1) {
+        child = proc_lookup(pid);
+        if (!child || child->parent != p) return ECHILD;
+        found = 1;
+
+        if (!(child->state & PST_ZOMBIE)) child = NULL;
+    } else {
+        list_for_each_entry(child, &p->children, sibling)
+        {
+            found = 1;
+            if (child->state & PST_ZOMBIE) break;
+        }
+
+        if (&child->sibling == &p->children) child = NULL;
+    }
+
+    if (!found && !(p->pid == INIT_PID && pid == -1)) return ECHILD;
+
+    if (!child) {
+        p->wait_pid = pid;
+        PST_SET_FLAGS(p, PST_WAITING);
+        return EAGAIN;
+    }
+
+    *child_pid = child->pid;
+    *status = child->exit_status;
+
+    list_del(&child->sibling);
+    free_proc(child);
+
+    return 0;
+}
+
+/* Blocking system calls are restarted once the process is woken up (see
+ * sys_wait()). A timeout given to such a call is armed the first time it
+ * blocks and stays armed across the restarts, when it fires the process is
+ * woken up with PF_TIMEDOUT set and the restarted call gives up. */
+
+#define PST_SLEEPING (PST_BLOCKED | PST_WAITING)
+
+static void proc_timeout_fire(struct timer* timer)
+{
+    struct proc* p = list_entry(timer, struct proc, timeout);
+
+    p->flags |= PF_TIMEDOUT;
+    PST_UNSET_FLAGS(p, p->state & PST_SLEEPING);
+}
+
+/* called by a call that is about to block p, returns ETIMEDOUT if its timeout
+ * has fired. A timeout of 0 never fires, a precise one goes to the
+ * high-resolution queue instead of the wheel. */
+int proc_timeout_begin(struct proc* p, uint64_t timeout_ns, int precise)
+{
+    uint64_t expires;
+
+    if (p->flags & PF_TIMEDOUT) {
+        p->flags &= ~PF_TIMEDOUT;
+        return ETIMEDOUT;
+    }
+
+    if (!timeout_ns || timer_pending(&p->timeout)) return 0;
+
+    expires = read_cycles() + ns_to_ticks(timeout_ns);
+    p->timeout.func = proc_timeout_fire;
+    if (precise)
+        add_hrtimer(&p->timeout, expires,
+                    ns_to_ticks(DEFAULT_TIMER_SLACK_NS));
+    else
+        add_timer(&p->timeout, expires);
+
+    return 0;
+}
+
+/* called when a call that may have blocked returns */
+void proc_timeout_end(struct proc* p)
+{
+    del_timer(&p->timeout);
+    p->flags &= ~PF_TIMEDOUT;
 }
@@ -1,27 +1,140 @@
 #ifndef _PROC_H_
 #define _PROC_H_
 
+#include "const.h"
+#include "ktimer.h"
+#include "list.h"
+#include "rbtree.h"
 #include "stackframe.h"
 
 #include <stdint.h>
 
-#define PROC_MAX 256
+#define PID_MAX 32768 /* pids are below this */
+#define INIT_PID 1
 #define PROC_NAME_MAX 16
 
+/* scheduling queues, lower number means higher priority */
+#define NR_SCHED_QUEUES 16
+#define TASK_Q 0
+#define MAX_USER_Q 1
+#define MIN_USER_Q (NR_SCHED_QUEUES - 1)
+#define USER_Q ((MIN_USER_Q - MAX_USER_Q) / 2 + MAX_USER_Q)
+/* priority of SCHED_DEADLINE processes, above all the queues */
+#define DL_Q (-1)
+/* priority of SCHED_FAIR processes, below all the queues. It is the bit of the
+ * fair tree in ready_map, see sched_fair.c. */
+#define FAIR_Q NR_SCHED_QUEUES
+/* weight of a nice 0 SCHED_FAIR process */
+#define NICE_0_WEIGHT 1024
+
+#define DEFAULT_QUANTUM_NS 10000000UL /* 10ms time slice */
+
+#define CPU_MASK_ALL (~0UL)
+
+struct mutex;
+
+/* identifies the word a futex waiter is queued on, see futex.c */
+struct futex_key {
+    struct vm_context* vm; /* NULL if the frame is shared */
+    unsigned long addr;    /* virtual address, physical if vm is NULL */
+};
+
 struct proc {
-    struct reg_context regs; /* must be at the beginning of proc struct */
+    /* must be at the beginning of proc struct, aligned so that the trap code
+     * can use sd/ld on it */
+    struct reg_context regs __attribute__((aligned(8)));
     struct vm_context vm;
 
     int counter;          /* remaining ticks */
-    int quantum;          /* time slice */
+    int quantum;          /* time slice in ticks */
     uint64_t last_cycles; /* cycles at the last context switch */
 
-    /* process state */
+    uint64_t user_time; /* ticks spent in user mode */
+    uint64_t sys_time;  /* ticks spent in the kernel on behalf of the proc */
+
+    int policy;                /* SCHED_PRIO or SCHED_FAIR */
+    int priority;              /* current scheduling queue */
+    int base_priority;         /* queue to return to after blocking */
+    int pi_priority;           /* inherited through mutexes, see mutex.c */
+    struct list_head run_list; /* link in the ready queue */
+    unsigned long cpu_mask;    /* harts the process may run on */
+
+    /* SCHED_FAIR */
+    int nice;
+    unsigned int weight;
+    uint64_t vruntime; /* weighted ticks, see sched_fair.c */
+    struct rb_node fair_node __attribute__((aligned(8)));
+
+    /* SCHED_DEADLINE, times are in ticks, see sched_dl.c */
+    struct {
+        uint64_t runtime; /* reservation */
+        uint64_t deadline;
+        uint64_t period;
+        unsigned long bw; /* runtime / period in fixed point */
+        int cpu;          /* hart the reservation is on */
+        unsigned long saved_cpu_mask;
+
+        uint64_t abs_deadline; /* current server deadline */
+        uint64_t remaining;    /* runtime left in the current period */
+        /* replenishment while throttled */
+        struct timer timer __attribute__((aligned(8)));
+    } dl;
+    struct rb_node dl_node __attribute__((aligned(8)));
+
+#define PF_EXPIRED 0x01 /* used up its quantum since it was last picked */
+#define PF_KTHREAD 0x02 /* kernel thread, see kthread_create() */
+#define PF_TIMEDOUT 0x04 /* the timeout of a blocking call has fired */
+#define PF_FUTEX 0x08    /* waiting on a futex, see futex_wait() */
+#define PF_KSLEEP 0x10   /* gave up the hart in a system call */
+    int flags;
+
+    /* process state, the process is runnable iff no flag is set */
 #define PST_NONE 0
-#define PST_FREESLOT 0x100 /* proc table entry is free */
+#define PST_BLOCKED 0x01 /* waiting for an event */
+#define PST_ZOMBIE 0x02  /* exited, waiting to be reaped by the parent */
+#define PST_WAITING 0x04 /* waiting for a child to exit */
+#define PST_THROTTLED 0x08 /* SCHED_DEADLINE runtime used up for this period */
+#define PST_NEW 0x100    /* being set up */
     int state;
 
+    int pid;
+    struct list_head pid_link; /* link in the pid hash */
+    struct proc* parent;
+    struct list_head children;
+    struct list_head sibling; /* link in the children list of the parent */
+    int wait_pid;             /* child waited for, -1 for any */
+    int exit_status;
+
+    /* of the blocking call, see proc_timeout_begin() */
+    struct timer timeout __attribute__((aligned(8)));
+
+    struct futex_key futex_key;
+    struct list_head futex_link; /* link in the futex hash bucket */
+
+    /* sleeping in the kernel, see waitqueue.c and mutex.c */
+    struct list_head wait_link;   /* link in a wait queue or mutex */
+    struct mutex* blocked_on;     /* mutex waited for */
+    struct list_head held_mutexes;
+
     char name[PROC_NAME_MAX];
 };
 
+#define proc_is_runnable(p) ((p)->state == 0)
+
+/* change the state flags of a process and keep it on the ready queue iff it
+ * is runnable */
+#define PST_SET_FLAGS(p, f)                                          \
+    do {                                                             \
+        int __was_runnable = proc_is_runnable(p);                    \
+        (p)->state |= (f);                                           \
+        if (__was_runnable && !proc_is_runnable(p)) dequeue_proc(p); \
+    } while (0)
+
+#define PST_UNSET_FLAGS(p, f)                                        \
+    do {                                                             \
+        int __was_runnable = proc_is_runnable(p);                    \
+        (p)->state &= ~(f);                                          \
+        if (!__was_runnable && proc_is_runnable(p)) enqueue_proc(p); \
+    } while (0)
+
 #endif
@@ -6,6 +6,11 @@
 #include <stddef.h>
 #include <stdint.h>
 
+struct timer;
+struct tlb_batch;
+struct vm_context;
+struct work;
+
 /* directy_tty.c */
 void disp_char(const char c);
 void direct_put_str(const char* str);
@@ -15,32 +20,203 @@ void panic(const char* fmt, ...);
 /* memory.c */
 void init_memory(void* dtb);
 void* alloc_page(unsigned long* phys_addr);
-void copy_from_user(void* dst, const void* src, size_t len);
+int copy_from_user(void* dst, const void* src, size_t len);
+int copy_to_user(void* dst, const void* src, size_t len);
 
 /* vm.c */
-void vm_map(struct proc* p, unsigned long phys_addr, void* vir_addr,
-            void* vir_end);
+int vm_map(struct proc* p, unsigned long phys_addr, void* vir_addr,
+           void* vir_end);
+int vm_map_copy(struct proc* p, const void* src, size_t len, void* vir_addr,
+                void* vir_end);
+int vm_alloc_space(struct proc* p);
+void vm_release(struct proc* p);
+int page_movable(unsigned long phys);
+int unmap_movable_page(unsigned long phys, struct tlb_batch* batch);
+void remap_movable_page(unsigned long phys);
+int migrate_page(unsigned long old_phys, unsigned long new_phys);
+unsigned long vm_lookup(struct proc* p, unsigned long vir_addr);
+void kern_map_page(unsigned long phys_addr, unsigned long vir_addr);
+void kern_alloc_pmd(unsigned long vir_addr);
+unsigned long kern_unmap_page(unsigned long vir_addr);
 
 /* proc.c */
 void init_proc();
-struct proc* pick_proc();
+struct proc* proc_lookup(int pid);
+int spawn_proc(struct proc* parent, reg_t entry, reg_t arg,
+               struct proc** child);
+void exit_proc(struct proc* p, int status);
+int wait_proc(struct proc* p, int pid, int* child_pid, int* status);
+int proc_timeout_begin(struct proc* p, uint64_t timeout_ns, int precise);
+void proc_timeout_end(struct proc* p);
+struct proc* kthread_create(const char* name, void (*fn)(void*), void* arg,
+                            int cpu);
+void kthread_return(struct proc* p);
+void schedule_kernel(struct proc* p);
 void switch_to_user();
+struct proc* get_idle_proc();
+void do_switch_to_user();
+int syscall_fast_return(struct proc* p);
+
+/* sched.c */
+void init_sched();
+void sched_fork(struct proc* p, struct proc* parent);
+void enqueue_proc(struct proc* p);
+void dequeue_proc(struct proc* p);
+void requeue_proc(struct proc* p);
+void proc_no_quantum(struct proc* p);
+int sched_set_affinity(struct proc* p, unsigned long cpu_mask);
+int sched_set_policy(struct proc* p, int policy, int param);
+int sched_set_deadline(struct proc* p, uint64_t runtime_ns,
+                       uint64_t deadline_ns, uint64_t period_ns);
+void sched_exit(struct proc* p);
+void sched_charge(struct proc* p, uint64_t delta);
+int sched_preempt_pending(struct proc* p);
+int sched_need_resched(struct proc* p);
+void sched_inherit_priority(struct proc* p, int prio);
+void balance_load_tick();
+struct proc* pick_proc();
+
+/* sched_fair.c */
+void init_fair_rq(int cpu);
+void fair_set_nice(struct proc* p, int nice);
+void enqueue_fair(struct proc* p, int cpu);
+void dequeue_fair(struct proc* p, int cpu);
+struct proc* pick_fair(int cpu);
+void fair_set_last(struct proc* p, int cpu);
+void fair_charge(struct proc* p, uint64_t delta);
+uint64_t fair_slice(struct proc* p);
+int fair_wakeup_preempt(struct proc* curr, struct proc* p);
+void fair_unplace(struct proc* p);
+void fair_place(struct proc* p, int cpu, int wakeup);
+
+/* sched_dl.c */
+void init_dl_rq(int cpu);
+void enqueue_dl(struct proc* p, int cpu);
+void dequeue_dl(struct proc* p, int cpu);
+struct proc* pick_dl(int cpu);
+int dl_preempt(struct proc* curr, struct proc* p);
+void dl_wakeup(struct proc* p);
+void dl_charge(struct proc* p, uint64_t delta);
+int dl_admit(struct proc* p, uint64_t runtime_ns, uint64_t deadline_ns,
+             uint64_t period_ns);
+void dl_release(struct proc* p);
+
+/* smp.c */
+void lock_kernel();
+void unlock_kernel();
+void init_smp(void* dtb, unsigned int boot_hart_id);
+void smp_boot_aps();
+void smp_boot_ap();
+
+/* ipi.c */
+void init_ipi();
+void handle_ipi();
+void ipi_poll();
+void smp_call_function_many(unsigned long cpu_mask, void (*func)(void*),
+                            void* arg, int wait);
+void smp_call_function_single(int cpu, void (*func)(void*), void* arg,
+                              int wait);
+void smp_call_function(void (*func)(void*), void* arg, int wait);
+void smp_send_reschedule(int cpu);
+
+/* lockstat.c */
+void lockstat_dump();
+
+/* selftest.c */
+void start_selftests();
 
 /* exc.c */
 void init_trap();
 
+/* irq.c */
+void halt_cpu();
+
+/* trap.S */
 void restore_user_context(struct proc* p);
+void resume_kcontext(struct proc* p);
+void schedule();
+
+/* tlb.c */
+void init_tlb();
+void tlb_release_vm(struct vm_context* vm);
 void switch_address_space(struct proc* p);
+void tlb_batch_init(struct tlb_batch* batch);
+void tlb_batch_add(struct tlb_batch* batch, struct vm_context* vm,
+                   unsigned long start, unsigned long size);
+void tlb_batch_flush(struct tlb_batch* batch);
+void tlb_flush_kernel_range(unsigned long start, unsigned long size);
 
 /* clock.c */
+void init_timer(void* dtb);
+uint64_t ticks_to_ns(uint64_t ticks);
+uint64_t ns_to_ticks(uint64_t ns);
 uint64_t read_cycles();
 void restart_local_timer();
+void stop_local_timer();
+void set_idle_timer();
 void timer_interrupt();
+void stop_context(struct proc* p);
+void account_sys_time(struct proc* p);
+
+/* ktimer.c */
+void init_timers();
+void add_timer(struct timer* timer, uint64_t expires);
+void add_hrtimer(struct timer* timer, uint64_t expires, uint64_t slack);
+int del_timer(struct timer* timer);
+void run_timers();
+uint64_t timers_next_event(int cpu);
 
 /* alloc.c */
 void mem_init(unsigned long mem_start, unsigned long free_mem_size);
 unsigned long alloc_pages(size_t nr_pages);
 int free_mem(unsigned long base, unsigned long len);
+unsigned long compact_mem(size_t nr_pages);
+void compact_mem_background();
+unsigned long alloc_zeroed_page();
+int idle_zero_page();
+
+/* kstack.c */
+void* alloc_kstack();
+void free_kstack(void* stack_top);
+void kstack_overflow(reg_t sepc, reg_t sbadaddr);
+
+/* workqueue.c */
+void init_workqueues();
+void start_workers();
+int queue_work(struct work* work);
+int queue_work_on(int cpu, struct work* work);
+
+/* futex.c */
+void init_futex();
+int futex_wait(struct proc* p, uint32_t* uaddr, uint32_t val,
+               uint64_t timeout);
+int futex_wake(struct proc* p, uint32_t* uaddr, int nr, int* woken);
+int futex_requeue(struct proc* p, uint32_t* uaddr, int nr_wake,
+                  uint32_t* uaddr2, int nr_requeue, uint32_t val, int* count);
+
+/* waitqueue.c */
+struct wait_queue_head;
+struct proc* sleeping_proc();
+void sleep_on(struct wait_queue_head* wq);
+void wake_up(struct wait_queue_head* wq);
+void wake_up_all(struct wait_queue_head* wq);
+
+/* mutex.c */
+struct mutex;
+struct semaphore;
+void mutex_lock(struct mutex* m);
+int mutex_trylock(struct mutex* m);
+void mutex_unlock(struct mutex* m);
+void down(struct semaphore* sem);
+int down_trylock(struct semaphore* sem);
+void up(struct semaphore* sem);
+
+/* vmalloc.c */
+void vmalloc_init();
+void* vmalloc(size_t size);
+void* vmap(const unsigned long* frames, size_t nr_pages);
+void vfree(void* addr);
+int vmalloc_purge_idle();
 
 /* slab.c */
 void slabs_init();
@@ -0,0 +1,284 @@
+#include "rbtree.h"
+
+static void rb_rotate_left(struct rb_node* node, struct rb_root* root)
+{
+    struct rb_node* right = node->right;
+
+    if ((node->right = right->left)) right->left->parent = node;
+    right->left = node;
+
+    if ((right->parent = node->parent)) {
+        if (node == node->parent->left)
+            node->parent->left = right;
+        else
+            node->parent->right = right;
+    } else {
+        root->node = right;
+    }
+    node->parent = right;
+}
+
+static void rb_rotate_right(struct rb_node* node, struct rb_root* root)
+{
+    struct rb_node* left = node->left;
+
+    if ((node->left = left->right)) left->right->parent = node;
+    left->right = node;
+
+    if ((left->parent = node->parent)) {
+        if (node == node->parent->right)
+            node->parent->right = left;
+        else
+            node->parent->left = left;
+    } else {
+        root->node = left;
+    }
+    node->parent = left;
+}
+
+static inline int rb_is_black(struct rb_node* node)
+{
+    return !node || node->color == RB_BLACK;
+}
+
+/* rebalance after node has been linked in */
+void rb_insert_color(struct rb_node* node, struct rb_root* root)
+{
+    struct rb_node *parent, *gparent, *uncle;
+
+    node->color = RB_RED;
+
+    while ((parent = node->parent) && parent->color == RB_RED) {
+        /* the root is black so a red parent is not the root */
+        gparent = parent->parent;
+
+        if (parent == gparent->left) {
+            uncle = gparent->right;
+            if (!rb_is_black(uncle)) {
+                uncle->color = parent->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+
+            if (node == parent->right) {
+                rb_rotate_left(parent, root);
+                node = parent;
+                parent = node->parent;
+            }
+
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_right(gparent, root);
+        } else {
+            uncle = gparent->left;
+            if (!rb_is_black(uncle)) {
+                uncle->color = parent->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+
+            if (node == parent->left) {
+                rb_rotate_right(parent, root);
+                node = parent;
+                parent = node->parent;
+            }
+
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_left(gparent, root);
+        }
+    }
+
+    root->node->color = RB_BLACK;
+}
+
+/* node (possibly NULL) under parent is short of one black node */
+static void rb_erase_color(struct rb_node* node, struct rb_node* parent,
+                           struct rb_root* root)
+{
+    struct rb_node* other;
+
+    while (rb_is_black(node) && node != root->node) {
+        if (parent->left == node) {
+            other = parent->right;
+            if (other->color == RB_RED) {
+                other->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_left(parent, root);
+                other = parent->right;
+            }
+
+            if (rb_is_black(other->left) && rb_is_black(other->right)) {
+                other->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+
+            if (rb_is_black(other->right)) {
+                other->left->color = RB_BLACK;
+                other->color = RB_RED;
+                rb_rotate_right(other, root);
+                other = parent->right;
+            }
+
+            other->color = parent->color;
+            parent->color = RB_BLACK;
+            other->right->color = RB_BLACK;
+            rb_rotate_left(parent, root);
+            node = root->node;
+            break;
+        } else {
+            other = parent->left;
+            if (other->color == RB_RED) {
+                other->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_right(parent, root);
+                other = parent->left;
+            }
+
+            if (rb_is_black(other->left) && rb_is_black(other->right)) {
+                other->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+
+            if (rb_is_black(other->left)) {
+                other->right->color = RB_BLACK;
+                other->color = RB_RED;
+                rb_rotate_left(other, root);
+                other = parent->left;
+            }
+
+            other->color = parent->color;
+            parent->color = RB_BLACK;
+            other->left->color = RB_BLACK;
+            rb_rotate_right(parent, root);
+            node = root->node;
+            break;
+        }
+    }
+
+    if (node) node->color = RB_BLACK;
+}
+
+void rb_erase(struct rb_node* node, struct rb_root* root)
+{
+    struct rb_node *child, *parent;
+    int color;
+
+    if (!node->left) {
+        child = node->right;
+    } else if (!node->right) {
+        child = node->left;
+    } else {
+        /* replace node with its successor, which has no left child */
+        struct rb_node *old = node, *left;
+
+        node = node->right;
+        while ((left = node->left))
+            node = left;
+
+        child = node->right;
+        parent = node->parent;
+        color = node->color;
+
+        if (child) child->parent = parent;
+        if (parent == old) {
+            parent->right = child;
+            parent = node;
+        } else {
+            parent->left = child;
+        }
+
+        node->parent = old->parent;
+        node->color = old->color;
+        node->right = old->right;
+        node->left = old->left;
+
+        if (old->parent) {
+            if (old->parent->left == old)
+                old->parent->left = node;
+            else
+                old->parent->right = node;
+        } else {
+            root->node = node;
+        }
+
+        old->left->parent = node;
+        if (old->right) old->right->parent = node;
+
+        goto rebalance;
+    }
+
+    parent = node->parent;
+    color = node->color;
+
+    if (child) child->parent = parent;
+    if (parent) {
+        if (parent->left == node)
+            parent->left = child;
+        else
+            parent->right = child;
+    } else {
+        root->node = child;
+    }
+
+rebalance:
+    if (color == RB_BLACK) rb_erase_color(child, parent, root);
+}
+
+struct rb_node* rb_first(struct rb_root* root)
+{
+    struct rb_node* node = root->node;
+
+    if (!node) return NULL;
+    while (node->left)
+        node = node->left;
+    return node;
+}
+
+struct rb_node* rb_last(struct rb_root* root)
+{
+    struct rb_node* node = root->node;
+
+    if (!node) return NULL;
+    while (node->right)
+        node = node->right;
+    return node;
+}
+
+struct rb_node* rb_next(struct rb_node* node)
+{
+    struct rb_node* parent;
+
+    if (node->right) {
+        node = node->right;
+        while (node->left)
+            node = node->left;
+        return node;
+    }
+
+    while ((parent = node->parent) && node == parent->right)
+        node = parent;
+    return parent;
+}
+
+struct rb_node* rb_prev(struct rb_node* node)
+{
+    struct rb_node* parent;
+
+    if (node->left) {
+        node = node->left;
+        while (node->right)
+            node = node->right;
+        return node;
+    }
+
+    while ((parent = node->parent) && node == parent->left)
+        node = parent;
+    return parent;
+}
@@ -0,0 +1,66 @@
+#ifndef _RBTREE_H_
+#define _RBTREE_H_
+
+#include "list.h"
+
+#include <stddef.h>
+
+/* Red-black tree. The tree does not know how to compare nodes, users walk
+ * down from the root to find the link to insert at, then call rb_link_node()
+ * and rb_insert_color() to rebalance:
+ *
+ *     struct rb_node **link = &root->node, *parent = NULL;
+ *
+ *     while (*link) {
+ *         parent = *link;
+ *         if (key < rb_entry(parent, struct foo, node)->key)
+ *             link = &parent->left;
+ *         else
+ *             link = &parent->right;
+ *     }
+ *
+ *     rb_link_node(&foo->node, parent, link);
+ *     rb_insert_color(&foo->node, root);
+ */
+
+#define RB_RED 0
+#define RB_BLACK 1
+
+/* the links are aligned since insertion takes their address, see the note in
+ * spinlock.h on -fpack-struct */
+struct rb_node {
+    struct rb_node* parent __attribute__((aligned(8)));
+    struct rb_node* left __attribute__((aligned(8)));
+    struct rb_node* right __attribute__((aligned(8)));
+    int color;
+};
+
+struct rb_root {
+    struct rb_node* node __attribute__((aligned(8)));
+};
+
+#define RB_ROOT \
+    (struct rb_root) { NULL }
+#define rb_entry(ptr, type, member) list_entry(ptr, type, member)
+
+/* nodes that are not in a tree point to themselves */
+#define RB_EMPTY_NODE(n) ((n)->parent == (n))
+#define RB_CLEAR_NODE(n) ((n)->parent = (n))
+
+static inline void rb_link_node(struct rb_node* node, struct rb_node* parent,
+                                struct rb_node** link)
+{
+    node->parent = parent;
+    node->left = node->right = NULL;
+    *link = node;
+}
+
+void rb_insert_color(struct rb_node* node, struct rb_root* root);
+void rb_erase(struct rb_node* node, struct rb_root* root);
+
+struct rb_node* rb_first(struct rb_root* root);
+struct rb_node* rb_last(struct rb_root* root);
+struct rb_node* rb_next(struct rb_node* node);
+struct rb_node* rb_prev(struct rb_node* node);
+
+#endif
@@ -43,9 +43,19 @@
 #define SCAUSEREG SBADADDRREG + REG_SIZE
 
 #define P_ORIGA0 SCAUSEREG + REG_SIZE
-#define P_CPU P_ORIGA0 + REG_SIZE
+
+/* struct kcontext, s0-s11 are at KCTX_S0 + n * REG_SIZE */
+#define KCTX_RA P_ORIGA0 + REG_SIZE
+#define KCTX_SP KCTX_RA + REG_SIZE
+#define KCTX_S0 KCTX_SP + REG_SIZE
+
+#define P_CPU KCTX_S0 + 12 * REG_SIZE
 
 #define P_TBR_PHYS P_CPU + REG_SIZE
 #define P_TBR_VIR P_TBR_PHYS + REG_SIZE
 
+/* frame pushed on the kernel stack for traps taken in kernel mode: ra, t0-t6,
+ * a0-a7, sstatus and sepc */
+#define KTRAP_FRAME_SIZE (18 * REG_SIZE)
+
 #endif
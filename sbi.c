@@ -0,0 +1,226 @@
+#include "global.h"
+#include "proto.h"
+#include "sbi.h"
+#include "spinlock.h"
+#include "vm.h"
+
+#include <string.h>
+
+/* SBI bindings. init_sbi() probes the firmware and picks the v0.2+ extension
+ * for each service it implements, until then (and with v0.1 firmware) the
+ * legacy calls are used. */
+
+static unsigned long sbi_spec_version; /* 0 for v0.1 firmware */
+static int has_hsm, has_dbcn;
+
+/* DBCN takes the physical address of the buffer, which is copied here first
+ * as the callers' buffers may live on a kernel stack outside the linear
+ * mapping */
+#define DBCN_BUF_SIZE 256
+static char dbcn_buf[DBCN_BUF_SIZE];
+static DEF_SPINLOCK(dbcn_lock);
+
+/*
+ * Legacy (v0.1) calls
+ */
+static void __sbi_set_timer_v01(uint64_t stime_value)
+{
+#if __riscv_xlen == 32
+    SBI_CALL_2(SBI_SET_TIMER, stime_value, stime_value >> 32);
+#else
+    SBI_CALL_1(SBI_SET_TIMER, stime_value);
+#endif
+}
+
+static void __sbi_send_ipi_v01(const unsigned long* hart_mask)
+{
+    SBI_CALL_1(SBI_SEND_IPI, hart_mask);
+}
+
+static int __sbi_rfence_v01(int fid, const unsigned long* hart_mask,
+                            unsigned long start, unsigned long size,
+                            unsigned long asid)
+{
+    switch (fid) {
+    case SBI_EXT_RFENCE_REMOTE_FENCE_I:
+        SBI_CALL_1(SBI_REMOTE_FENCE_I, hart_mask);
+        break;
+    case SBI_EXT_RFENCE_REMOTE_SFENCE_VMA:
+        SBI_CALL_3(SBI_REMOTE_SFENCE_VMA, hart_mask, start, size);
+        break;
+    case SBI_EXT_RFENCE_REMOTE_SFENCE_VMA_ASID:
+        SBI_CALL_4(SBI_REMOTE_SFENCE_VMA_ASID, hart_mask, start, size, asid);
+        break;
+    default:
+        return SBI_ERR_NOT_SUPPORTED;
+    }
+
+    return 0;
+}
+
+static void (*__sbi_set_timer)(uint64_t stime) = __sbi_set_timer_v01;
+static void (*__sbi_send_ipi)(const unsigned long* hart_mask) =
+    __sbi_send_ipi_v01;
+static int (*__sbi_rfence)(int fid, const unsigned long* hart_mask,
+                           unsigned long start, unsigned long size,
+                           unsigned long asid) = __sbi_rfence_v01;
+
+/*
+ * v0.2+ extensions, hart masks are passed by value with a base of 0 since
+ * hart ids are below CONFIG_SMP_MAX_HARTS
+ */
+static void __sbi_set_timer_v02(uint64_t stime_value)
+{
+    sbi_ecall(SBI_EXT_TIME, SBI_EXT_TIME_SET_TIMER, stime_value, 0, 0, 0, 0);
+}
+
+static void __sbi_send_ipi_v02(const unsigned long* hart_mask)
+{
+    sbi_ecall(SBI_EXT_IPI, SBI_EXT_IPI_SEND_IPI, *hart_mask, 0, 0, 0, 0);
+}
+
+static int __sbi_rfence_v02(int fid, const unsigned long* hart_mask,
+                            unsigned long start, unsigned long size,
+                            unsigned long asid)
+{
+    struct sbiret ret =
+        sbi_ecall(SBI_EXT_RFENCE, fid, *hart_mask, 0, start, size, asid);
+
+    return ret.error;
+}
+
+static unsigned long sbi_get_spec_version()
+{
+    struct sbiret ret =
+        sbi_ecall(SBI_EXT_BASE, SBI_EXT_BASE_GET_SPEC_VERSION, 0, 0, 0, 0, 0);
+
+    /* v0.1 firmware does not know the base extension */
+    return ret.error ? 0 : ret.value;
+}
+
+long sbi_probe_extension(long ext)
+{
+    struct sbiret ret;
+
+    if (!sbi_spec_version) return 0;
+
+    ret = sbi_ecall(SBI_EXT_BASE, SBI_EXT_BASE_PROBE_EXT, ext, 0, 0, 0, 0);
+    return ret.error ? 0 : ret.value;
+}
+
+void init_sbi()
+{
+    sbi_spec_version = sbi_get_spec_version();
+    if (!sbi_spec_version) {
+        printk("sbi: v0.1, using legacy calls\n");
+        return;
+    }
+
+    printk("sbi: v%lu.%lu", SBI_SPEC_VERSION_MAJOR(sbi_spec_version),
+           SBI_SPEC_VERSION_MINOR(sbi_spec_version));
+
+    if (sbi_probe_extension(SBI_EXT_TIME) > 0) {
+        __sbi_set_timer = __sbi_set_timer_v02;
+        printk(", TIME");
+    }
+    if (sbi_probe_extension(SBI_EXT_IPI) > 0) {
+        __sbi_send_ipi = __sbi_send_ipi_v02;
+        printk(", IPI");
+    }
+    if (sbi_probe_extension(SBI_EXT_RFENCE) > 0) {
+        __sbi_rfence = __sbi_rfence_v02;
+        printk(", RFENCE");
+    }
+    if (sbi_probe_extension(SBI_EXT_HSM) > 0) {
+        has_hsm = 1;
+        printk(", HSM");
+    }
+    if (sbi_probe_extension(SBI_EXT_DBCN) > 0) {
+        has_dbcn = 1;
+        printk(", DBCN");
+    }
+
+    printk("\n");
+}
+
+void sbi_console_putchar(int ch) { SBI_CALL_1(SBI_CONSOLE_PUTCHAR, ch); }
+
+/* write the whole buffer, with DBCN one call per DBCN_BUF_SIZE bytes */
+void sbi_console_write(const char* buf, size_t len)
+{
+    if (!has_dbcn) {
+        while (len--)
+            sbi_console_putchar(*buf++);
+        return;
+    }
+
+    spinlock_lock(&dbcn_lock);
+
+    while (len > 0) {
+        size_t chunk = len < DBCN_BUF_SIZE ? len : DBCN_BUF_SIZE;
+        unsigned long phys = (unsigned long)__pa(dbcn_buf);
+        size_t done = 0;
+
+        memcpy(dbcn_buf, buf, chunk);
+
+        /* the firmware may write less than asked for */
+        while (done < chunk) {
+            struct sbiret ret =
+                sbi_ecall(SBI_EXT_DBCN, SBI_EXT_DBCN_CONSOLE_WRITE,
+                          chunk - done, phys + done, 0, 0, 0);
+            if (ret.error) goto out;
+            done += ret.value;
+        }
+
+        buf += chunk;
+        len -= chunk;
+    }
+
+out:
+    spinlock_unlock(&dbcn_lock);
+}
+
+int sbi_console_getchar(void) { return SBI_CALL_0(SBI_CONSOLE_GETCHAR); }
+
+void sbi_set_timer(uint64_t stime_value) { __sbi_set_timer(stime_value); }
+
+void sbi_shutdown(void) { SBI_CALL_0(SBI_SHUTDOWN); }
+
+void sbi_clear_ipi(void) { SBI_CALL_0(SBI_CLEAR_IPI); }
+
+void sbi_send_ipi(const unsigned long* hart_mask)
+{
+    __sbi_send_ipi(hart_mask);
+}
+
+void sbi_remote_fence_i(const unsigned long* hart_mask)
+{
+    __sbi_rfence(SBI_EXT_RFENCE_REMOTE_FENCE_I, hart_mask, 0, 0, 0);
+}
+
+void sbi_remote_sfence_vma(const unsigned long* hart_mask, unsigned long start,
+                           unsigned long size)
+{
+    __sbi_rfence(SBI_EXT_RFENCE_REMOTE_SFENCE_VMA, hart_mask, start, size, 0);
+}
+
+void sbi_remote_sfence_vma_asid(const unsigned long* hart_mask,
+                                unsigned long start, unsigned long size,
+                                unsigned long asid)
+{
+    __sbi_rfence(SBI_EXT_RFENCE_REMOTE_SFENCE_VMA_ASID, hart_mask, start, size,
+                 asid);
+}
+
+/* returns SBI_ERR_NOT_SUPPORTED without HSM */
+int sbi_hart_start(unsigned long hart_id, unsigned long start_addr,
+                   unsigned long opaque)
+{
+    struct sbiret ret;
+
+    if (!has_hsm) return SBI_ERR_NOT_SUPPORTED;
+
+    ret = sbi_ecall(SBI_EXT_HSM, SBI_EXT_HSM_HART_START, hart_id, start_addr,
+                    opaque, 0, 0);
+    return ret.error;
+}
@@ -14,6 +14,7 @@
 #ifndef _SBI_H_
 #define _SBI_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define SBI_SET_TIMER 0
@@ -26,68 +27,107 @@
 #define SBI_REMOTE_SFENCE_VMA_ASID 7
 #define SBI_SHUTDOWN 8
 
-#define SBI_CALL(which, arg0, arg1, arg2)                     \
+/* SBI v0.2+ extensions, called with the extension id in a7 and the function
+ * id in a6 */
+#define SBI_EXT_BASE 0x10
+#define SBI_EXT_BASE_GET_SPEC_VERSION 0
+#define SBI_EXT_BASE_GET_IMP_ID 1
+#define SBI_EXT_BASE_GET_IMP_VERSION 2
+#define SBI_EXT_BASE_PROBE_EXT 3
+
+#define SBI_EXT_TIME 0x54494D45
+#define SBI_EXT_TIME_SET_TIMER 0
+
+#define SBI_EXT_IPI 0x735049
+#define SBI_EXT_IPI_SEND_IPI 0
+
+#define SBI_EXT_RFENCE 0x52464E43
+#define SBI_EXT_RFENCE_REMOTE_FENCE_I 0
+#define SBI_EXT_RFENCE_REMOTE_SFENCE_VMA 1
+#define SBI_EXT_RFENCE_REMOTE_SFENCE_VMA_ASID 2
+
+#define SBI_EXT_HSM 0x48534D
+#define SBI_EXT_HSM_HART_START 0
+
+#define SBI_EXT_DBCN 0x4442434E
+#define SBI_EXT_DBCN_CONSOLE_WRITE 0
+
+#define SBI_SPEC_VERSION_MAJOR(v) (((v) >> 24) & 0x7f)
+#define SBI_SPEC_VERSION_MINOR(v) ((v)&0xffffff)
+
+/* SBI v0.2+ error codes */
+#define SBI_SUCCESS 0
+#define SBI_ERR_FAILED -1
+#define SBI_ERR_NOT_SUPPORTED -2
+#define SBI_ERR_INVALID_PARAM -3
+
+struct sbiret {
+    long error;
+    long value;
+};
+
+#define SBI_CALL(which, arg0, arg1, arg2, arg3)                \
     ({                                                        \
         register uintptr_t a0 asm("a0") = (uintptr_t)(arg0);  \
         register uintptr_t a1 asm("a1") = (uintptr_t)(arg1);  \
         register uintptr_t a2 asm("a2") = (uintptr_t)(arg2);  \
+        register uintptr_t a3 asm("a3") = (uintptr_t)(arg3);  \
         register uintptr_t a7 asm("a7") = (uintptr_t)(which); \
         asm volatile("ecall"                                  \
                      : "+r"(a0)                               \
-                     : "r"(a1), "r"(a2), "r"(a7)              \
+                     : "r"(a1), "r"(a2), "r"(a3), "r"(a7)     \
                      : "memory");                             \
         a0;                                                   \
     })
 
-#define SBI_CALL_0(which) SBI_CALL(which, 0, 0, 0)
-#define SBI_CALL_1(which, arg0) SBI_CALL(which, arg0, 0, 0)
-#define SBI_CALL_2(which, arg0, arg1) SBI_CALL(which, arg0, arg1, 0)
-
-static inline void sbi_console_putchar(int ch)
-{
-    SBI_CALL_1(SBI_CONSOLE_PUTCHAR, ch);
-}
-static inline int sbi_console_getchar(void)
-{
-    return SBI_CALL_0(SBI_CONSOLE_GETCHAR);
-}
-
-static inline void sbi_set_timer(uint64_t stime_value)
-{
-#if __riscv_xlen == 32
-    SBI_CALL_2(SBI_SET_TIMER, stime_value, stime_value >> 32);
-#else
-    SBI_CALL_1(SBI_SET_TIMER, stime_value);
-#endif
-}
+#define SBI_CALL_0(which) SBI_CALL(which, 0, 0, 0, 0)
+#define SBI_CALL_1(which, arg0) SBI_CALL(which, arg0, 0, 0, 0)
+#define SBI_CALL_2(which, arg0, arg1) SBI_CALL(which, arg0, arg1, 0, 0)
+#define SBI_CALL_3(which, arg0, arg1, arg2) \
+    SBI_CALL(which, arg0, arg1, arg2, 0)
+#define SBI_CALL_4(which, arg0, arg1, arg2, arg3) \
+    SBI_CALL(which, arg0, arg1, arg2, arg3)
 
-static inline void sbi_shutdown(void) { SBI_CALL_0(SBI_SHUTDOWN); }
-
-static inline void sbi_clear_ipi(void) { SBI_CALL_0(SBI_CLEAR_IPI); }
-
-static inline void sbi_send_ipi(const unsigned long* hart_mask)
+static inline struct sbiret sbi_ecall(int ext, int fid, unsigned long arg0,
+                                      unsigned long arg1, unsigned long arg2,
+                                      unsigned long arg3, unsigned long arg4)
 {
-    SBI_CALL_1(SBI_SEND_IPI, hart_mask);
+    struct sbiret ret;
+    register uintptr_t a0 asm("a0") = (uintptr_t)(arg0);
+    register uintptr_t a1 asm("a1") = (uintptr_t)(arg1);
+    register uintptr_t a2 asm("a2") = (uintptr_t)(arg2);
+    register uintptr_t a3 asm("a3") = (uintptr_t)(arg3);
+    register uintptr_t a4 asm("a4") = (uintptr_t)(arg4);
+    register uintptr_t a6 asm("a6") = (uintptr_t)(fid);
+    register uintptr_t a7 asm("a7") = (uintptr_t)(ext);
+    asm volatile("ecall"
+                 : "+r"(a0), "+r"(a1)
+                 : "r"(a2), "r"(a3), "r"(a4), "r"(a6), "r"(a7)
+                 : "memory");
+    ret.error = a0;
+    ret.value = a1;
+    return ret;
 }
 
-static inline void sbi_remote_fence_i(const unsigned long* hart_mask)
-{
-    SBI_CALL_1(SBI_REMOTE_FENCE_I, hart_mask);
-}
-
-static inline void sbi_remote_sfence_vma(const unsigned long* hart_mask,
-                                         unsigned long start,
-                                         unsigned long size)
-{
-    SBI_CALL_1(SBI_REMOTE_SFENCE_VMA, hart_mask);
-}
+/* sbi.c, the calls go through the v0.2+ extensions if the firmware has them
+ * and fall back to the legacy calls otherwise */
+void init_sbi();
+long sbi_probe_extension(long ext);
 
-static inline void sbi_remote_sfence_vma_asid(const unsigned long* hart_mask,
-                                              unsigned long start,
-                                              unsigned long size,
-                                              unsigned long asid)
-{
-    SBI_CALL_1(SBI_REMOTE_SFENCE_VMA_ASID, hart_mask);
-}
+void sbi_console_putchar(int ch);
+void sbi_console_write(const char* buf, size_t len);
+int sbi_console_getchar(void);
+void sbi_set_timer(uint64_t stime_value);
+void sbi_shutdown(void);
+void sbi_clear_ipi(void);
+void sbi_send_ipi(const unsigned long* hart_mask);
+void sbi_remote_fence_i(const unsigned long* hart_mask);
+void sbi_remote_sfence_vma(const unsigned long* hart_mask, unsigned long start,
+                           unsigned long size);
+void sbi_remote_sfence_vma_asid(const unsigned long* hart_mask,
+                                unsigned long start, unsigned long size,
+                                unsigned long asid);
+int sbi_hart_start(unsigned long hart_id, unsigned long start_addr,
+                   unsigned long opaque);
 
 #endif // _ARCH_SBI_H_
@@ -1,5 +1,586 @@
+#include "bitmap.h"
+#include "cpulocals.h"
 #include "global.h"
+#include "list.h"
 #include "proc.h"
+#include "proto.h"
 
-/* choose ONE process to run */
-struct proc* pick_proc() { return &proc_table[0]; }
+#include <errno.h>
+
+/* Every hart has its own ready queues (see cpulocals.h), one per priority. A
+ * bit is set in ready_map iff the queue is not empty so that picking the next
+ * process is a find-first-set.
+ *
+ * Processes that are running on a hart are not on the ready queues, they are
+ * taken off by pick_proc() and put back by requeue_proc() when the hart
+ * switches away from them. regs.cpu is the hart whose queue a process is on or
+ * which it is running on.
+ *
+ * SCHED_FAIR processes are kept in a tree ordered by virtual runtime instead
+ * (see sched_fair.c), which is treated as one more queue below all the
+ * others: its bit in ready_map is FAIR_Q and so is their priority.
+ * SCHED_DEADLINE processes (see sched_dl.c) have their own tree which is
+ * looked at before the queues, their priority DL_Q is above all of them.
+ *
+ * A hart that runs out of work steals from the busiest peer, and busy harts
+ * periodically pull work from each other to even out the load. */
+
+#define BALANCE_INTERVAL_NS 100000000UL /* 100ms between load balancing */
+
+void init_sched()
+{
+    int cpu, i;
+
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        for (i = 0; i < NR_SCHED_QUEUES; i++) {
+            INIT_LIST_HEAD(get_cpu_var_ptr(cpu, run_queue[i]));
+        }
+        get_cpu_var(cpu, ready_map) = 0;
+        get_cpu_var(cpu, nr_ready) = 0;
+        get_cpu_var(cpu, last_balance) = 0;
+        init_fair_rq(cpu);
+        init_dl_rq(cpu);
+    }
+}
+
+/* set up the scheduling state of a new process, which inherits the policy of
+ * its parent (if any). Kernel threads run at TASK_Q, above all user
+ * processes. */
+void sched_fork(struct proc* p, struct proc* parent)
+{
+    INIT_LIST_HEAD(&p->run_list);
+    RB_CLEAR_NODE(&p->fair_node);
+    RB_CLEAR_NODE(&p->dl_node);
+    /* relative to min_vruntime of the hart it is first queued on */
+    p->vruntime = 0;
+
+    p->quantum = p->counter = ns_to_ticks(DEFAULT_QUANTUM_NS);
+    /* FAIR_Q is below everything, nothing inherited */
+    p->pi_priority = FAIR_Q;
+
+    if (p->flags & PF_KTHREAD) {
+        p->policy = SCHED_PRIO;
+        p->priority = p->base_priority = TASK_Q;
+        p->cpu_mask = CPU_MASK_ALL;
+        fair_set_nice(p, 0);
+    } else if (parent && parent->policy != SCHED_DEADLINE) {
+        /* reservations are not inherited, they go through admission */
+        p->policy = parent->policy;
+        p->priority = p->base_priority = parent->base_priority;
+        p->cpu_mask = parent->cpu_mask;
+        fair_set_nice(p, parent->nice);
+    } else {
+        p->policy = SCHED_FAIR;
+        p->priority = p->base_priority = FAIR_Q;
+        p->cpu_mask = CPU_MASK_ALL;
+        fair_set_nice(p, 0);
+    }
+}
+
+static void __enqueue_proc(struct proc* p, int cpu, int head)
+{
+    int q = p->priority;
+    struct list_head* queue;
+
+    if (q == DL_Q) {
+        enqueue_dl(p, cpu);
+        goto out;
+    }
+
+    queue = get_cpu_var_ptr(cpu, run_queue[q]);
+    if (q == FAIR_Q)
+        enqueue_fair(p, cpu);
+    else if (head)
+        list_add(&p->run_list, queue);
+    else
+        list_add_tail(&p->run_list, queue);
+
+    get_cpu_var(cpu, ready_map) |= 1UL << q;
+
+out:
+    get_cpu_var(cpu, nr_ready)++;
+    p->regs.cpu = cpu;
+}
+
+static void __dequeue_proc(struct proc* p)
+{
+    int q = p->priority;
+    int cpu = p->regs.cpu;
+
+    if (q == DL_Q) {
+        dequeue_dl(p, cpu);
+    } else if (q == FAIR_Q) {
+        dequeue_fair(p, cpu);
+        if (!get_cpu_var(cpu, nr_fair))
+            get_cpu_var(cpu, ready_map) &= ~(1UL << q);
+    } else {
+        list_del(&p->run_list);
+        if (list_empty(get_cpu_var_ptr(cpu, run_queue[q])))
+            get_cpu_var(cpu, ready_map) &= ~(1UL << q);
+    }
+    get_cpu_var(cpu, nr_ready)--;
+}
+
+/* the priority p returns to after blocking, its own or the one it has
+ * inherited */
+static inline int normal_priority(struct proc* p)
+{
+    return p->pi_priority < p->base_priority ? p->pi_priority
+                                             : p->base_priority;
+}
+
+static inline int proc_is_queued(struct proc* p)
+{
+    if (p->priority == DL_Q) return !RB_EMPTY_NODE(&p->dl_node);
+    if (p->priority == FAIR_Q) return !RB_EMPTY_NODE(&p->fair_node);
+    return !list_empty(&p->run_list);
+}
+
+static inline int proc_is_running(struct proc* p)
+{
+    return get_cpu_var(p->regs.cpu, proc_ptr) == p;
+}
+
+static inline int cpu_allowed(struct proc* p, int cpu)
+{
+    return get_cpu_var(cpu, cpu_online) && (p->cpu_mask & (1UL << cpu));
+}
+
+/* the load a process puts on a hart, its weight if it is in the fair class,
+ * otherwise as much as a nice 0 process */
+static inline unsigned long proc_load(struct proc* p)
+{
+    return p->priority == FAIR_Q ? p->weight : NICE_0_WEIGHT;
+}
+
+/* load of the processes waiting for or running on a hart */
+static unsigned long cpu_load(int cpu)
+{
+    struct proc* curr = get_cpu_var(cpu, proc_ptr);
+    unsigned long load = get_cpu_var(cpu, fair_weight);
+
+    load += (get_cpu_var(cpu, nr_ready) - get_cpu_var(cpu, nr_fair)) *
+            NICE_0_WEIGHT;
+    if (curr) load += proc_load(curr);
+
+    return load;
+}
+
+/* choose a hart for a process that has become runnable, an idle hart is
+ * preferred, then the hart the process ran on last as its cache may still be
+ * warm, then the least loaded one */
+static int select_cpu(struct proc* p)
+{
+    int prev = p->regs.cpu;
+    int cpu, best = -1;
+
+    if (cpu_allowed(p, prev) && get_cpu_var(prev, cpu_is_idle)) return prev;
+
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        if (!cpu_allowed(p, cpu)) continue;
+        if (get_cpu_var(cpu, cpu_is_idle)) return cpu;
+
+        if (best < 0 || cpu_load(cpu) < cpu_load(best)) best = cpu;
+    }
+
+    if (cpu_allowed(p, prev) || best < 0) return prev;
+    return best;
+}
+
+/* take one process from the ready queues of src that may run on dst and whose
+ * load is at most max_load, the one of the highest priority that is furthest
+ * from running is chosen, i.e. the most recently queued one. Use attach_proc()
+ * to queue it on dst. */
+static struct proc* detach_proc(int src, int dst, unsigned long max_load)
+{
+    bitchunk_t map = get_cpu_var(src, ready_map);
+    struct proc* p;
+
+    while (map) {
+        int q = bitchunk_ffs(map);
+        struct list_head* queue = get_cpu_var_ptr(src, run_queue[q]);
+
+        if (q == FAIR_Q) {
+            struct rb_node* node;
+
+            /* the one that is furthest from running */
+            for (node = rb_last(get_cpu_var_ptr(src, fair_tree)); node;
+                 node = rb_prev(node)) {
+                p = rb_entry(node, struct proc, fair_node);
+
+                if ((p->cpu_mask & (1UL << dst)) && proc_load(p) <= max_load) {
+                    __dequeue_proc(p);
+                    fair_unplace(p);
+                    return p;
+                }
+            }
+
+            break;
+        }
+
+        for (p = list_entry(queue->prev, struct proc, run_list);
+             &p->run_list != queue;
+             p = list_entry(p->run_list.prev, struct proc, run_list)) {
+            if ((p->cpu_mask & (1UL << dst)) && proc_load(p) <= max_load) {
+                __dequeue_proc(p);
+                return p;
+            }
+        }
+
+        map &= ~(1UL << q);
+    }
+
+    return NULL;
+}
+
+static void attach_proc(struct proc* p, int cpu)
+{
+    if (p->priority == FAIR_Q) fair_place(p, cpu, 0);
+    __enqueue_proc(p, cpu, 0);
+}
+
+/* the most loaded hart with ready processes that is not in skip */
+static int find_busiest_cpu(unsigned long skip)
+{
+    int cpu, busiest = -1;
+
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        if ((skip & (1UL << cpu)) || !get_cpu_var(cpu, nr_ready)) continue;
+
+        if (busiest < 0 || cpu_load(cpu) > cpu_load(busiest)) busiest = cpu;
+    }
+
+    return busiest;
+}
+
+/* called with empty local queues, move one process from the busiest peer that
+ * has one that may run here */
+static void steal_proc()
+{
+    unsigned long tried = 1UL << cpuid;
+    int busiest;
+    struct proc* p;
+
+    while ((busiest = find_busiest_cpu(tried)) >= 0) {
+        if ((p = detach_proc(busiest, cpuid, ~0UL)) != NULL) {
+            attach_proc(p, cpuid);
+            return;
+        }
+
+        tried |= 1UL << busiest;
+    }
+}
+
+/* pull processes from the busiest hart as long as that brings the load of the
+ * two closer, moving a load of w changes the difference by 2w */
+static void balance_load()
+{
+    int busiest = find_busiest_cpu(1UL << cpuid);
+    unsigned long src_load, dst_load;
+    struct proc* p;
+
+    if (busiest < 0) return;
+
+    src_load = cpu_load(busiest);
+    dst_load = cpu_load(cpuid);
+
+    while (src_load > dst_load &&
+           (p = detach_proc(busiest, cpuid, src_load - dst_load - 1)) != NULL) {
+        attach_proc(p, cpuid);
+        src_load -= proc_load(p);
+        dst_load += proc_load(p);
+    }
+}
+
+/* called on every timer interrupt of a hart */
+void balance_load_tick()
+{
+    uint64_t now = read_cycles();
+
+    if (now - get_cpulocal_var(last_balance) <
+        ns_to_ticks(BALANCE_INTERVAL_NS))
+        return;
+
+    get_cpulocal_var(last_balance) = now;
+    balance_load();
+}
+
+/* p has been queued on cpu, make that hart pick it up right away if it is idle
+ * or running something less important */
+static void check_preempt(struct proc* p, int cpu)
+{
+    struct proc* curr = get_cpu_var(cpu, proc_ptr);
+
+    /* this hart goes through pick_proc() before it leaves the kernel */
+    if (cpu == cpuid) return;
+
+    if (get_cpu_var(cpu, cpu_is_idle) ||
+        (curr && p->priority < curr->priority) ||
+        (curr && p->priority == FAIR_Q && curr->priority == FAIR_Q &&
+         fair_wakeup_preempt(curr, p)) ||
+        (curr && p->priority == DL_Q && curr->priority == DL_Q &&
+         dl_preempt(curr, p)))
+        smp_send_reschedule(cpu);
+}
+
+/* append a process that has become runnable to the tail of a ready queue */
+void enqueue_proc(struct proc* p)
+{
+    int cpu;
+
+    /* it will be requeued when its hart switches away from it */
+    if (proc_is_running(p)) {
+        if (p->priority == FAIR_Q) fair_place(p, p->regs.cpu, 0);
+        return;
+    }
+
+    cpu = select_cpu(p);
+    if (p->priority == FAIR_Q) fair_place(p, cpu, 1);
+    if (p->priority == DL_Q) dl_wakeup(p);
+    __enqueue_proc(p, cpu, 0);
+
+    check_preempt(p, cpu);
+}
+
+/* remove a process that is no longer runnable from its ready queue */
+void dequeue_proc(struct proc* p)
+{
+    if (proc_is_queued(p)) __dequeue_proc(p);
+    if (p->priority == FAIR_Q) fair_unplace(p);
+
+    /* a process that blocks before using up its quantum is not CPU-bound,
+     * give it back its original priority */
+    p->priority = normal_priority(p);
+    p->flags &= ~PF_EXPIRED;
+}
+
+/* put a process back on the ready queues after its hart has switched away
+ * from it, a preempted process keeps its place at the head of the queue */
+void requeue_proc(struct proc* p)
+{
+    int expired = p->flags & PF_EXPIRED;
+    int cpu = p->regs.cpu;
+
+    p->flags &= ~PF_EXPIRED;
+
+    /* the affinity mask was changed while it was running */
+    if (!cpu_allowed(p, cpu)) {
+        if (p->priority == FAIR_Q) fair_unplace(p);
+        cpu = select_cpu(p);
+        if (p->priority == FAIR_Q) fair_place(p, cpu, 0);
+        __enqueue_proc(p, cpu, 0);
+        check_preempt(p, cpu);
+        return;
+    }
+
+    __enqueue_proc(p, cpu, !expired);
+    if (p->priority == FAIR_Q && !expired) fair_set_last(p, cpu);
+}
+
+/* called with the ticks a running process has just been charged for */
+void sched_charge(struct proc* p, uint64_t delta)
+{
+    if (p->priority == FAIR_Q)
+        fair_charge(p, delta);
+    else if (p->priority == DL_Q)
+        dl_charge(p, delta);
+}
+
+/* whether pick_proc() would choose another process than p, which is running
+ * on this hart, if p went back to the ready queues */
+int sched_preempt_pending(struct proc* p)
+{
+    struct proc* dl = pick_dl(cpuid);
+    bitchunk_t map = get_cpulocal_var(ready_map);
+    struct rb_node* leftmost;
+
+    /* goes to the tail of its queue or to another hart */
+    if ((p->flags & PF_EXPIRED) || !cpu_allowed(p, cpuid)) return 1;
+
+    if (p->priority == DL_Q) return dl && dl_preempt(p, dl);
+    if (dl || (map & ((1UL << p->priority) - 1))) return 1;
+
+    /* see pick_fair(), p would be the last one to run */
+    leftmost = get_cpulocal_var(fair_leftmost);
+    return p->priority == FAIR_Q && leftmost &&
+           fair_wakeup_preempt(p, rb_entry(leftmost, struct proc, fair_node));
+}
+
+/* called by a running kernel thread between two pieces of work, whether it
+ * should call schedule() and let another process have the hart */
+int sched_need_resched(struct proc* p)
+{
+    account_sys_time(p);
+
+    if (get_cpulocal_var(dl_leftmost)) return 1;
+    if (get_cpulocal_var(ready_map) & ((1UL << p->priority) - 1)) return 1;
+
+    /* the others of its priority get their turn */
+    return (p->flags & PF_EXPIRED) && get_cpulocal_var(nr_ready);
+}
+
+/* called when a running process has used up its time slice, move it to a lower
+ * priority queue so that it cannot starve the others */
+void proc_no_quantum(struct proc* p)
+{
+    p->flags |= PF_EXPIRED;
+
+    /* the runtime is enforced by dl_charge() */
+    if (p->priority == DL_Q) return;
+
+    /* the tree takes care of fairness */
+    if (p->priority == FAIR_Q) {
+        p->counter = fair_slice(p);
+        return;
+    }
+
+    p->counter = p->quantum;
+
+    /* an inherited priority is kept until the mutex is released */
+    if (p->priority >= MAX_USER_Q && p->priority < MIN_USER_Q &&
+        p->priority != p->pi_priority)
+        p->priority++;
+}
+
+/* priority inheritance, p holds mutexes that processes of priority prio wait
+ * for (FAIR_Q for none). It runs at prio if that is above its own priority. */
+void sched_inherit_priority(struct proc* p, int prio)
+{
+    int queued = proc_is_queued(p);
+    int old = p->priority, new;
+
+    p->pi_priority = prio;
+    new = normal_priority(p);
+
+    if (new == old) return;
+
+    /* a sleeping process is not placed on any hart */
+    if (!proc_is_runnable(p)) {
+        p->priority = new;
+        return;
+    }
+
+    if (queued) __dequeue_proc(p);
+    if (old == FAIR_Q) fair_unplace(p);
+
+    p->priority = new;
+
+    if (new == FAIR_Q) fair_place(p, p->regs.cpu, 0);
+    if (queued) {
+        __enqueue_proc(p, p->regs.cpu, 0);
+        check_preempt(p, p->regs.cpu);
+    }
+}
+
+/* change the harts a process may run on, it is moved at the next switch if its
+ * current hart is no longer allowed */
+int sched_set_affinity(struct proc* p, unsigned long cpu_mask)
+{
+    unsigned long online = 0;
+    int cpu;
+
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        if (get_cpu_var(cpu, cpu_online)) online |= 1UL << cpu;
+    }
+
+    if (!(cpu_mask & online)) return EINVAL;
+    /* pinned by admission control */
+    if (p->policy == SCHED_DEADLINE) return EBUSY;
+
+    p->cpu_mask = cpu_mask;
+
+    if (proc_is_queued(p) && !cpu_allowed(p, p->regs.cpu)) {
+        __dequeue_proc(p);
+        if (p->priority == FAIR_Q) fair_unplace(p);
+        enqueue_proc(p);
+    }
+
+    return 0;
+}
+
+/* leave SCHED_DEADLINE, p is running. A throttled process must not be
+ * replenished after that, the timer may outlive it. */
+static void sched_leave_dl(struct proc* p)
+{
+    del_timer(&p->dl.timer);
+    PST_UNSET_FLAGS(p, PST_THROTTLED);
+    dl_release(p);
+    p->cpu_mask = p->dl.saved_cpu_mask;
+}
+
+/* change the scheduling policy of the running process p */
+int sched_set_policy(struct proc* p, int policy, int param)
+{
+    switch (policy) {
+    case SCHED_PRIO:
+        if (param < MAX_USER_Q || param > MIN_USER_Q) return EINVAL;
+
+        if (p->policy == SCHED_DEADLINE) sched_leave_dl(p);
+        p->priority = p->base_priority = param;
+        p->counter = p->quantum;
+        break;
+    case SCHED_FAIR:
+        if (param < NICE_MIN || param > NICE_MAX) return EINVAL;
+
+        if (p->policy == SCHED_DEADLINE) sched_leave_dl(p);
+        if (p->policy != SCHED_FAIR) {
+            p->priority = p->base_priority = FAIR_Q;
+            p->vruntime = get_cpu_var(p->regs.cpu, min_vruntime);
+        }
+        fair_set_nice(p, param);
+        p->counter = fair_slice(p);
+        break;
+    default:
+        return EINVAL;
+    }
+
+    p->policy = policy;
+    p->flags &= ~PF_EXPIRED;
+    return 0;
+}
+
+/* make the running process p SCHED_DEADLINE or change its reservation, it
+ * moves to the hart admission control has chosen at the next switch */
+int sched_set_deadline(struct proc* p, uint64_t runtime_ns,
+                       uint64_t deadline_ns, uint64_t period_ns)
+{
+    int retval = dl_admit(p, runtime_ns, deadline_ns, period_ns);
+
+    if (retval) return retval;
+
+    p->policy = SCHED_DEADLINE;
+    p->priority = p->base_priority = DL_Q;
+    p->flags &= ~PF_EXPIRED;
+    return 0;
+}
+
+/* called when p exits */
+void sched_exit(struct proc* p)
+{
+    if (p->policy == SCHED_DEADLINE) sched_leave_dl(p);
+}
+
+/* choose ONE process to run on this hart and take it off the ready queues */
+struct proc* pick_proc()
+{
+    struct proc* p;
+    int q;
+
+    if ((p = pick_dl(cpuid)) != NULL) {
+        __dequeue_proc(p);
+        return p;
+    }
+
+    if (!get_cpulocal_var(ready_map)) steal_proc();
+    if (!get_cpulocal_var(ready_map)) return NULL;
+
+    q = bitchunk_ffs(get_cpulocal_var(ready_map));
+    if (q == FAIR_Q)
+        p = pick_fair(cpuid);
+    else
+        p = list_first_entry(get_cpulocal_var_ptr(run_queue[q]), struct proc,
+                             run_list);
+    __dequeue_proc(p);
+
+    return p;
+}
@@ -0,0 +1,218 @@
+#include "cpulocals.h"
+#include "global.h"
+#include "proc.h"
+#include "proto.h"
+#include "rbtree.h"
+
+#include <errno.h>
+
+/* Deadline class. A SCHED_DEADLINE process asks for runtime ticks of CPU time
+ * within deadline ticks after the start of every period. Ready processes are
+ * kept per hart in a tree ordered by absolute deadline and the earliest one
+ * runs ahead of everything else (EDF).
+ *
+ * Each process is served by a constant bandwidth server (CBS): the time it
+ * runs is charged to its remaining runtime and once that is used up it is
+ * throttled until its next period starts, so a process that overruns cannot
+ * take time from the others. A process waking up after a long sleep gets a
+ * fresh deadline if keeping the old one would let it exceed its bandwidth.
+ *
+ * Processes are partitioned: admission control places each one on a hart
+ * whose total bandwidth stays within CONFIG_DL_BANDWIDTH percent and pins it
+ * there, EDF on a single hart then meets every deadline. */
+
+#define BW_SHIFT 20
+#define BW_UNIT (1UL << BW_SHIFT)
+
+#define DL_PERIOD_MAX_NS 10000000000UL /* 10s */
+
+#define deadline_before(a, b) ((int64_t)((a) - (b)) < 0)
+
+static unsigned long dl_bw_limit;
+
+void init_dl_rq(int cpu)
+{
+    dl_bw_limit = CONFIG_DL_BANDWIDTH * BW_UNIT / 100;
+
+    get_cpu_var(cpu, dl_tree) = RB_ROOT;
+    get_cpu_var(cpu, dl_leftmost) = NULL;
+    get_cpu_var(cpu, nr_dl) = 0;
+    get_cpu_var(cpu, dl_bw) = 0;
+}
+
+static inline unsigned long to_bw(uint64_t runtime, uint64_t period)
+{
+    return (runtime << BW_SHIFT) / period;
+}
+
+void enqueue_dl(struct proc* p, int cpu)
+{
+    struct rb_root* root = get_cpu_var_ptr(cpu, dl_tree);
+    struct rb_node **link = &root->node, *parent = NULL;
+    int leftmost = 1;
+
+    while (*link) {
+        parent = *link;
+
+        if (deadline_before(p->dl.abs_deadline,
+                            rb_entry(parent, struct proc, dl_node)
+                                ->dl.abs_deadline))
+            link = &parent->left;
+        else {
+            link = &parent->right;
+            leftmost = 0;
+        }
+    }
+
+    rb_link_node(&p->dl_node, parent, link);
+    rb_insert_color(&p->dl_node, root);
+
+    if (leftmost) get_cpu_var(cpu, dl_leftmost) = &p->dl_node;
+    get_cpu_var(cpu, nr_dl)++;
+}
+
+void dequeue_dl(struct proc* p, int cpu)
+{
+    if (get_cpu_var(cpu, dl_leftmost) == &p->dl_node)
+        get_cpu_var(cpu, dl_leftmost) = rb_next(&p->dl_node);
+
+    rb_erase(&p->dl_node, get_cpu_var_ptr(cpu, dl_tree));
+    RB_CLEAR_NODE(&p->dl_node);
+
+    get_cpu_var(cpu, nr_dl)--;
+}
+
+/* the process with the earliest deadline, it stays in the tree */
+struct proc* pick_dl(int cpu)
+{
+    struct rb_node* leftmost = get_cpu_var(cpu, dl_leftmost);
+
+    return leftmost ? rb_entry(leftmost, struct proc, dl_node) : NULL;
+}
+
+int dl_preempt(struct proc* curr, struct proc* p)
+{
+    return deadline_before(p->dl.abs_deadline, curr->dl.abs_deadline);
+}
+
+/* start a new server period at now */
+static void dl_new_period(struct proc* p, uint64_t now)
+{
+    p->dl.abs_deadline = now + p->dl.deadline;
+    p->dl.remaining = p->dl.runtime;
+    p->counter = p->dl.remaining;
+}
+
+/* called when p becomes runnable, keep the current deadline only if the
+ * remaining runtime fits in the time left before it at the reserved
+ * bandwidth, i.e. remaining / (abs_deadline - now) <= runtime / period */
+void dl_wakeup(struct proc* p)
+{
+    uint64_t now = read_cycles();
+
+    if (!deadline_before(now, p->dl.abs_deadline) ||
+        p->dl.remaining * p->dl.period >
+            p->dl.runtime * (p->dl.abs_deadline - now))
+        dl_new_period(p, now);
+}
+
+/* the period of a throttled process has ended, give it its budget back */
+static void dl_replenish(struct timer* timer)
+{
+    struct proc* p = list_entry(timer, struct proc, dl.timer);
+
+    p->dl.abs_deadline += p->dl.period;
+    p->dl.remaining = p->dl.runtime;
+    p->counter = p->dl.remaining;
+    /* the quantum that ran out with the runtime is refilled as well */
+    p->flags &= ~PF_EXPIRED;
+
+    PST_UNSET_FLAGS(p, PST_THROTTLED);
+}
+
+/* charge delta ticks to the running process p, throttle it once it has used
+ * up its runtime */
+void dl_charge(struct proc* p, uint64_t delta)
+{
+    if (delta < p->dl.remaining) {
+        p->dl.remaining -= delta;
+        return;
+    }
+
+    p->dl.remaining = 0;
+
+    /* the budget comes back when the current period ends, the timer goes to
+     * the hart p is running on which is the one of its reservation */
+    p->dl.timer.func = dl_replenish;
+    add_hrtimer(&p->dl.timer,
+                p->dl.abs_deadline - p->dl.deadline + p->dl.period, 0);
+
+    PST_SET_FLAGS(p, PST_THROTTLED);
+}
+
+/* admission control, reserve runtime / period on a hart p may run on and pin p
+ * there */
+int dl_admit(struct proc* p, uint64_t runtime_ns, uint64_t deadline_ns,
+             uint64_t period_ns)
+{
+    uint64_t runtime = ns_to_ticks(runtime_ns);
+    uint64_t deadline = ns_to_ticks(deadline_ns);
+    uint64_t period = ns_to_ticks(period_ns);
+    unsigned long allowed = p->cpu_mask;
+    unsigned long bw, old_bw = 0;
+    int cpu, target = -1;
+
+    if (!runtime || runtime > deadline || deadline > period ||
+        period_ns > DL_PERIOD_MAX_NS)
+        return EINVAL;
+
+    bw = to_bw(runtime, period);
+
+    /* the reservation being changed does not count */
+    if (p->policy == SCHED_DEADLINE) {
+        old_bw = p->dl.bw;
+        allowed = p->dl.saved_cpu_mask;
+    }
+
+    /* first fit, starting with the hart p is on */
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        int c = (p->regs.cpu + cpu) % ncpus;
+        unsigned long used = get_cpu_var(c, dl_bw);
+
+        if (!get_cpu_var(c, cpu_online) || !(allowed & (1UL << c)))
+            continue;
+
+        if (p->policy == SCHED_DEADLINE && c == p->dl.cpu) used -= old_bw;
+
+        if (used + bw <= dl_bw_limit) {
+            target = c;
+            break;
+        }
+    }
+
+    if (target < 0) return EBUSY;
+
+    if (p->policy == SCHED_DEADLINE)
+        dl_release(p);
+    else
+        p->dl.saved_cpu_mask = p->cpu_mask;
+    get_cpu_var(target, dl_bw) += bw;
+
+    p->dl.runtime = runtime;
+    p->dl.deadline = deadline;
+    p->dl.period = period;
+    p->dl.bw = bw;
+    p->dl.cpu = target;
+    p->cpu_mask = 1UL << target;
+
+    dl_new_period(p, read_cycles());
+    return 0;
+}
+
+/* give back the bandwidth of a process leaving the class, the caller restores
+ * dl.saved_cpu_mask if it does not come back */
+void dl_release(struct proc* p)
+{
+    get_cpu_var(p->dl.cpu, dl_bw) -= p->dl.bw;
+    p->dl.bw = 0;
+}
@@ -0,0 +1,204 @@
+#include "cpulocals.h"
+#include "global.h"
+#include "proc.h"
+#include "proto.h"
+#include "rbtree.h"
+
+/* Fair share class. Every process accumulates virtual runtime, the time it
+ * has run scaled by NICE_0_WEIGHT / weight, and each hart keeps its ready
+ * processes in a tree ordered by vruntime so that the one that has received
+ * the least service relative to its weight runs next.
+ *
+ * Time slices divide the target latency among the runnable processes in
+ * proportion to their weights, but never go below the minimum granularity.
+ *
+ * The vruntime of a process is only meaningful relative to the min_vruntime of
+ * its hart. While a process sleeps or moves between harts it holds the
+ * difference to min_vruntime (see fair_unplace() and fair_place()), a sleeper
+ * gets at most half the target latency of credit on wakeup so that it runs
+ * soon but cannot monopolize the hart. */
+
+#define SCHED_LATENCY_NS 12000000UL          /* 12ms target latency */
+#define SCHED_MIN_GRANULARITY_NS 1500000UL   /* 1.5ms minimum slice */
+#define SCHED_WAKEUP_GRANULARITY_NS 2000000UL /* 2ms */
+
+/* each nice level is worth about 10% of CPU time */
+static const unsigned int nice_to_weight[NICE_MAX - NICE_MIN + 1] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */ 9548,  7620,  6100,  4904,  3906,
+    /*  -5 */ 3121,  2501,  1991,  1586,  1277,
+    /*   0 */ 1024,  820,   655,   526,   423,
+    /*   5 */ 335,   272,   215,   172,   137,
+    /*  10 */ 110,   87,    70,    56,    45,
+    /*  15 */ 36,    29,    23,    18,    15,
+};
+
+#define vruntime_before(a, b) ((int64_t)((a) - (b)) < 0)
+
+void init_fair_rq(int cpu)
+{
+    get_cpu_var(cpu, fair_tree) = RB_ROOT;
+    get_cpu_var(cpu, fair_leftmost) = NULL;
+    get_cpu_var(cpu, fair_last) = NULL;
+    get_cpu_var(cpu, min_vruntime) = 0;
+    get_cpu_var(cpu, fair_weight) = 0;
+    get_cpu_var(cpu, nr_fair) = 0;
+}
+
+void fair_set_nice(struct proc* p, int nice)
+{
+    p->nice = nice;
+    p->weight = nice_to_weight[nice - NICE_MIN];
+}
+
+/* the running process if it is scheduled by this class, not one that runs at
+ * an inherited priority */
+static inline struct proc* fair_curr(int cpu)
+{
+    struct proc* curr = get_cpu_var(cpu, proc_ptr);
+
+    return (curr && curr->priority == FAIR_Q) ? curr : NULL;
+}
+
+/* min_vruntime follows the smallest vruntime on the hart but never goes back */
+static void update_min_vruntime(int cpu)
+{
+    struct rb_node* leftmost = get_cpu_var(cpu, fair_leftmost);
+    struct proc* curr = fair_curr(cpu);
+    uint64_t vruntime = get_cpu_var(cpu, min_vruntime);
+
+    if (curr) vruntime = curr->vruntime;
+
+    if (leftmost) {
+        struct proc* p = rb_entry(leftmost, struct proc, fair_node);
+
+        if (!curr || vruntime_before(p->vruntime, vruntime))
+            vruntime = p->vruntime;
+    }
+
+    if (vruntime_before(get_cpu_var(cpu, min_vruntime), vruntime))
+        get_cpu_var(cpu, min_vruntime) = vruntime;
+}
+
+void enqueue_fair(struct proc* p, int cpu)
+{
+    struct rb_root* root = get_cpu_var_ptr(cpu, fair_tree);
+    struct rb_node **link = &root->node, *parent = NULL;
+    int leftmost = 1;
+
+    while (*link) {
+        parent = *link;
+
+        /* equal keys go to the right so that they run in FIFO order */
+        if (vruntime_before(p->vruntime,
+                            rb_entry(parent, struct proc, fair_node)->vruntime))
+            link = &parent->left;
+        else {
+            link = &parent->right;
+            leftmost = 0;
+        }
+    }
+
+    rb_link_node(&p->fair_node, parent, link);
+    rb_insert_color(&p->fair_node, root);
+
+    if (leftmost) get_cpu_var(cpu, fair_leftmost) = &p->fair_node;
+
+    get_cpu_var(cpu, fair_weight) += p->weight;
+    get_cpu_var(cpu, nr_fair)++;
+}
+
+void dequeue_fair(struct proc* p, int cpu)
+{
+    if (get_cpu_var(cpu, fair_leftmost) == &p->fair_node)
+        get_cpu_var(cpu, fair_leftmost) = rb_next(&p->fair_node);
+    if (get_cpu_var(cpu, fair_last) == p) get_cpu_var(cpu, fair_last) = NULL;
+
+    rb_erase(&p->fair_node, get_cpu_var_ptr(cpu, fair_tree));
+    RB_CLEAR_NODE(&p->fair_node);
+
+    get_cpu_var(cpu, fair_weight) -= p->weight;
+    get_cpu_var(cpu, nr_fair)--;
+
+    update_min_vruntime(cpu);
+}
+
+/* the process to run next, it stays in the tree. A process preempted before
+ * its slice was over keeps running unless it is ahead of the leftmost one by
+ * more than the wakeup granularity. */
+struct proc* pick_fair(int cpu)
+{
+    struct rb_node* leftmost = get_cpu_var(cpu, fair_leftmost);
+    struct proc* last = get_cpu_var(cpu, fair_last);
+    struct proc* p;
+
+    if (!leftmost) return NULL;
+    p = rb_entry(leftmost, struct proc, fair_node);
+
+    get_cpu_var(cpu, fair_last) = NULL;
+    if (last && last != p &&
+        (int64_t)(last->vruntime - p->vruntime) <
+            (int64_t)ns_to_ticks(SCHED_WAKEUP_GRANULARITY_NS))
+        return last;
+
+    return p;
+}
+
+/* p has been preempted before the end of its slice */
+void fair_set_last(struct proc* p, int cpu) { get_cpu_var(cpu, fair_last) = p; }
+
+/* charge delta ticks of running time to p, which is running on its hart */
+void fair_charge(struct proc* p, uint64_t delta)
+{
+    if (p->weight == NICE_0_WEIGHT)
+        p->vruntime += delta;
+    else
+        p->vruntime += delta * NICE_0_WEIGHT / p->weight;
+
+    update_min_vruntime(p->regs.cpu);
+}
+
+/* length of the next slice of p, which is running on its hart */
+uint64_t fair_slice(struct proc* p)
+{
+    int cpu = p->regs.cpu;
+    unsigned long nr = get_cpu_var(cpu, nr_fair) + 1;
+    unsigned long weight = get_cpu_var(cpu, fair_weight) + p->weight;
+    uint64_t period = ns_to_ticks(SCHED_LATENCY_NS);
+    uint64_t min_slice = ns_to_ticks(SCHED_MIN_GRANULARITY_NS);
+    uint64_t slice;
+
+    if (nr * min_slice > period) period = nr * min_slice;
+
+    slice = period * p->weight / weight;
+    return slice < min_slice ? min_slice : slice;
+}
+
+/* should p, which has just been queued on the hart curr runs on, preempt
+ * it */
+int fair_wakeup_preempt(struct proc* curr, struct proc* p)
+{
+    return (int64_t)(curr->vruntime - p->vruntime) >
+           (int64_t)ns_to_ticks(SCHED_WAKEUP_GRANULARITY_NS);
+}
+
+/* make the vruntime of p relative to its hart before it stops being runnable
+ * or moves to another hart */
+void fair_unplace(struct proc* p)
+{
+    p->vruntime -= get_cpu_var(p->regs.cpu, min_vruntime);
+}
+
+/* make a relative vruntime absolute on cpu, a process that has been sleeping
+ * gets a limited credit */
+void fair_place(struct proc* p, int cpu, int wakeup)
+{
+    if (wakeup) {
+        int64_t credit = ns_to_ticks(SCHED_LATENCY_NS) / 2;
+
+        if ((int64_t)p->vruntime < -credit) p->vruntime = -credit;
+    }
+
+    p->vruntime += get_cpu_var(cpu, min_vruntime);
+}
@@ -0,0 +1,447 @@
+#include "cpulocals.h"
+#include "global.h"
+#include "ktimer.h"
+#include "mutex.h"
+#include "proc.h"
+#include "proto.h"
+#include "vm.h"
+#include "waitqueue.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef CONFIG_SELFTEST
+
+/* Kernel self-tests, run at boot by a kernel thread when the kernel is built
+ * with make SELFTEST=1. Each one prints whether it has passed. Kernel threads
+ * cannot exit, the ones a test creates sleep forever once it is over. */
+
+int sprintf(char* buf, const char* fmt, ...);
+
+static DEF_WAIT_QUEUE(parked);
+
+static void park()
+{
+    for (;;)
+        sleep_on(&parked);
+}
+
+/* locks: a thread on every online hart drops the kernel lock and takes an MCS
+ * lock and a reader-writer lock over and over at the same time as the others.
+ * The MCS lock protects a counter that is incremented without atomics. A
+ * quarter of the rwlock acquisitions are writers that increment two words one
+ * after the other, the readers must never see them differ, and the mix makes
+ * the writers wait for readers with RW_WAITING set. */
+
+#define LOCK_TEST_ITERATIONS 10000
+
+static DEF_MCSLOCK(test_mcslock);
+static DEF_RWLOCK(test_rwlock);
+static unsigned long mcs_count;
+static unsigned long rw_a, rw_b;
+static unsigned int rw_torn;
+
+static int lock_nr_threads;
+static int lock_started;
+static int lock_done;
+static DEF_WAIT_QUEUE(lock_wait);
+
+static void lock_thread(void* arg)
+{
+    struct mcs_node node;
+    int i;
+
+    unlock_kernel();
+
+    /* start together, a hart holding the kernel lock may wait for us */
+    __atomic_add_fetch(&lock_started, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&lock_started, __ATOMIC_RELAXED) < lock_nr_threads)
+        ipi_poll();
+
+    for (i = 0; i < LOCK_TEST_ITERATIONS; i++) {
+        mcslock_lock(&test_mcslock, &node);
+        mcs_count++;
+        mcslock_unlock(&test_mcslock, &node);
+
+        if (i % 4 == 0) {
+            write_lock(&test_rwlock);
+            __atomic_store_n(&rw_a, rw_a + 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&rw_b, rw_b + 1, __ATOMIC_RELAXED);
+            write_unlock(&test_rwlock);
+        } else {
+            read_lock(&test_rwlock);
+            if (__atomic_load_n(&rw_a, __ATOMIC_RELAXED) !=
+                __atomic_load_n(&rw_b, __ATOMIC_RELAXED))
+                __atomic_add_fetch(&rw_torn, 1, __ATOMIC_RELAXED);
+            read_unlock(&test_rwlock);
+        }
+
+        ipi_poll();
+    }
+
+    lock_kernel();
+    if (++lock_done == lock_nr_threads) wake_up(&lock_wait);
+
+    park();
+}
+
+static int lock_test()
+{
+    char name[PROC_NAME_MAX];
+    unsigned long writes;
+    int cpu, nr = 0;
+
+    /* none of them runs before we sleep, we hold the kernel lock */
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        if (!get_cpu_var(cpu, cpu_online)) continue;
+
+        sprintf(name, "locktest/%d", cpu);
+        if (kthread_create(name, lock_thread, NULL, cpu)) nr++;
+    }
+
+    if (!nr) return 0;
+    lock_nr_threads = nr;
+
+    wait_event(&lock_wait, lock_done == lock_nr_threads);
+
+    writes = (unsigned long)nr * ((LOCK_TEST_ITERATIONS + 3) / 4);
+    printk("selftest: locks: %d harts, count %lu, writes %lu, torn reads %u\n",
+           nr, mcs_count, rw_a, rw_torn);
+
+    return mcs_count == (unsigned long)nr * LOCK_TEST_ITERATIONS &&
+           rw_a == writes && rw_b == writes && !rw_torn;
+}
+
+/* The tests below need user memory. A kernel thread never loads a page table
+ * of its own (see schedule()), but it can be given an address space and read
+ * it through vm_lookup() like the kernel does for a user process. */
+
+#define TEST_UADDR 0x10000000UL
+
+/* give p an address space with nr_pages mapped at TEST_UADDR to the frames
+ * from phys on, or to fresh movable ones if phys is 0 */
+static int map_test_pages(struct proc* p, unsigned long phys, int nr_pages)
+{
+    int retval;
+
+    if ((retval = vm_alloc_space(p)) != 0) return retval;
+
+    retval = vm_map(p, phys, (void*)TEST_UADDR,
+                    (void*)(TEST_UADDR + nr_pages * PG_SIZE));
+    if (retval) vm_release(p);
+
+    return retval;
+}
+
+/* futex: threads wait on a condition variable word in a frame that they all
+ * map, the words are keyed by its physical address. A requeue wakes one of
+ * them and moves the others to the mutex word, after that nobody is left on
+ * the first word and a wake of the second releases them. */
+
+#define FUTEX_WAITERS 3
+
+static unsigned long futex_phys;
+static int futex_waiting, futex_woken, futex_errors;
+static DEF_WAIT_QUEUE(futex_test_wq);
+
+static void futex_waiter(void* arg)
+{
+    struct proc* self = sleeping_proc();
+    uint32_t* cond = (uint32_t*)TEST_UADDR;
+    int retval;
+
+    retval = map_test_pages(self, futex_phys, 1);
+    futex_waiting++;
+    wake_up(&futex_test_wq);
+
+    if (!retval) {
+        /* restarted like the system call once we are woken up */
+        while (!(retval = futex_wait(self, cond, 0, 0)) &&
+               (self->flags & PF_FUTEX))
+            schedule_kernel(self);
+
+        vm_release(self);
+    }
+
+    if (retval) futex_errors++;
+    futex_woken++;
+    wake_up(&futex_test_wq);
+
+    park();
+}
+
+static int futex_test()
+{
+    struct proc* self = sleeping_proc();
+    uint32_t* cond = (uint32_t*)TEST_UADDR;
+    uint32_t* mutex = cond + 1;
+    int stale, requeued, emptied, released;
+    int i, nr = 0, count = 0, woken = 0;
+
+    if (!(futex_phys = alloc_pages(1))) return 0;
+    memset(__va(futex_phys), 0, PG_SIZE);
+
+    if (map_test_pages(self, futex_phys, 1)) {
+        free_mem(futex_phys, PG_SIZE);
+        return 0;
+    }
+
+    for (i = 0; i < FUTEX_WAITERS; i++) {
+        if (!kthread_create("futex_waiter", futex_waiter, NULL, cpuid)) break;
+        nr++;
+    }
+
+    wait_event(&futex_test_wq, futex_waiting == nr);
+
+    /* the word has changed since the caller looked at it */
+    stale = futex_requeue(self, cond, 1, mutex, nr, 1, &count) == EAGAIN;
+
+    requeued = !futex_requeue(self, cond, 1, mutex, nr, 0, &count) &&
+               count == nr;
+    if (requeued) wait_event(&futex_test_wq, futex_woken == 1);
+
+    emptied = !futex_wake(self, cond, nr, &woken) && woken == 0;
+    released = !futex_wake(self, mutex, nr, &woken) && woken == nr - 1;
+
+    /* whatever has gone wrong, all of them have been woken up by now */
+    wait_event(&futex_test_wq, futex_woken == nr);
+
+    vm_release(self);
+    free_mem(futex_phys, PG_SIZE);
+
+    return nr == FUTEX_WAITERS && stale && requeued && emptied && released &&
+           !futex_errors;
+}
+
+/* timers: wheel timers added out of order, on levels 0 to 2 of the wheel, have
+ * to run in the order they expire and none of them before it. A timer deleted
+ * while pending must not run at all. */
+
+static const unsigned int timer_test_ms[] = {300, 2, 1500, 20, 90, 5};
+#define TIMER_TEST_NR ((int)(sizeof(timer_test_ms) / sizeof(timer_test_ms[0])))
+#define TIMER_TEST_DELETED_MS 10 /* before the last one */
+
+/* the last one is deleted */
+static struct timer test_timers[TIMER_TEST_NR + 1];
+static uint64_t timer_ran_at[TIMER_TEST_NR + 1];
+static int timer_order[TIMER_TEST_NR];
+static int timers_run;
+static DEF_WAIT_QUEUE(timer_test_wq);
+
+static void test_timer_func(struct timer* timer)
+{
+    int idx = timer - test_timers;
+
+    timer_ran_at[idx] = read_cycles();
+    if (timers_run < TIMER_TEST_NR) timer_order[timers_run] = idx;
+
+    if (++timers_run == TIMER_TEST_NR) wake_up(&timer_test_wq);
+}
+
+static int timer_test()
+{
+    uint64_t now = read_cycles();
+    struct timer* prev = NULL;
+    int i, passed = 1;
+
+    for (i = 0; i < TIMER_TEST_NR; i++) {
+        test_timers[i].func = test_timer_func;
+        add_timer(&test_timers[i],
+                  now + ns_to_ticks(timer_test_ms[i] * 1000000UL));
+    }
+
+    test_timers[i].func = test_timer_func;
+    add_timer(&test_timers[i],
+              now + ns_to_ticks(TIMER_TEST_DELETED_MS * 1000000UL));
+    if (!del_timer(&test_timers[i])) passed = 0;
+
+    wait_event(&timer_test_wq, timers_run >= TIMER_TEST_NR);
+
+    for (i = 0; i < TIMER_TEST_NR; i++) {
+        struct timer* timer = &test_timers[timer_order[i]];
+
+        if (timer_order[i] == TIMER_TEST_NR) return 0;
+        if (timer_ran_at[timer_order[i]] < timer->expires) passed = 0;
+        if (prev && timer->expires < prev->expires) passed = 0;
+
+        prev = timer;
+    }
+
+    return passed;
+}
+
+/* compaction: the contents of the movable frames mapped into an address space
+ * have to survive migrate_page() and compact_mem(), and the mappings have to
+ * follow them. None of them may be left in the block compact_mem() returns. */
+
+#define COMPACT_TEST_PAGES 32
+#define COMPACT_TEST_BLOCK 256 /* pages */
+
+static unsigned long test_page_phys(struct proc* p, int i)
+{
+    return vm_lookup(p, TEST_UADDR + i * PG_SIZE);
+}
+
+static void fill_test_pages(struct proc* p)
+{
+    int i, j;
+
+    for (i = 0; i < COMPACT_TEST_PAGES; i++) {
+        uint64_t* words = __va(test_page_phys(p, i));
+
+        for (j = 0; j < PG_SIZE / sizeof(uint64_t); j++)
+            words[j] = ((uint64_t)i << 32) | j;
+    }
+}
+
+/* returns 1 if every page is mapped to a movable frame with its contents */
+static int check_test_pages(struct proc* p)
+{
+    int i, j;
+
+    for (i = 0; i < COMPACT_TEST_PAGES; i++) {
+        unsigned long phys = test_page_phys(p, i);
+        uint64_t* words;
+
+        if (!phys || !page_movable(phys)) return 0;
+        words = __va(phys);
+
+        for (j = 0; j < PG_SIZE / sizeof(uint64_t); j++) {
+            if (words[j] != (((uint64_t)i << 32) | j)) return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int compact_test()
+{
+    struct proc* self = sleeping_proc();
+    unsigned long old_phys[COMPACT_TEST_PAGES];
+    unsigned long new_phys[COMPACT_TEST_PAGES];
+    unsigned long base, block_end;
+    struct tlb_batch batch;
+    int i, moved = 0, passed = 1;
+
+    if (map_test_pages(self, 0, COMPACT_TEST_PAGES)) return 0;
+    fill_test_pages(self);
+
+    /* move every frame by hand the way migrate_window() does */
+    tlb_batch_init(&batch);
+    for (i = 0; i < COMPACT_TEST_PAGES; i++) {
+        old_phys[i] = test_page_phys(self, i);
+        if (unmap_movable_page(old_phys[i], &batch)) passed = 0;
+    }
+    tlb_batch_flush(&batch);
+
+    for (i = 0; i < COMPACT_TEST_PAGES; i++) {
+        if (!(new_phys[i] = alloc_pages(1)) ||
+            migrate_page(old_phys[i], new_phys[i])) {
+            if (new_phys[i]) free_mem(new_phys[i], PG_SIZE);
+            remap_movable_page(old_phys[i]);
+            new_phys[i] = old_phys[i];
+            passed = 0;
+        }
+    }
+
+    for (i = 0; i < COMPACT_TEST_PAGES; i++) {
+        if (test_page_phys(self, i) != new_phys[i]) passed = 0;
+        if (new_phys[i] != old_phys[i]) free_mem(old_phys[i], PG_SIZE);
+    }
+
+    if (!check_test_pages(self)) passed = 0;
+
+    /* it is fine if no block can be built, the frames must stay intact */
+    if ((base = compact_mem(COMPACT_TEST_BLOCK)) != 0) {
+        block_end = base + COMPACT_TEST_BLOCK * PG_SIZE;
+
+        for (i = 0; i < COMPACT_TEST_PAGES; i++) {
+            unsigned long phys = test_page_phys(self, i);
+
+            if (phys >= base && phys < block_end) passed = 0;
+            if (phys != new_phys[i]) moved++;
+        }
+
+        free_mem(base, COMPACT_TEST_BLOCK * PG_SIZE);
+    }
+
+    if (!check_test_pages(self)) passed = 0;
+
+    printk("selftest: compaction: %s, %d of %d pages moved\n",
+           base ? "block found" : "no block", moved, COMPACT_TEST_PAGES);
+
+    vm_release(self);
+    return passed;
+}
+
+/* pi: a thread at the lowest user priority holds a mutex that a thread at
+ * TASK_Q waits for. The owner has to run at TASK_Q until it releases the
+ * mutex and at its own priority again afterwards. Both threads are on the
+ * same hart so that the waiter finds the owner preempted and sleeps instead of
+ * spinning. It runs last, the thread keeps the low priority. */
+
+#define PI_LOW_PRIO MIN_USER_Q /* not lowered further when CPU-bound */
+
+static DEF_MUTEX(pi_mutex);
+static int pi_waiter_done;
+
+static void pi_waiter(void* arg)
+{
+    mutex_lock(&pi_mutex);
+    pi_waiter_done = 1;
+    mutex_unlock(&pi_mutex);
+
+    park();
+}
+
+/* returns 1 if the test has passed */
+static int pi_test()
+{
+    struct proc* self = sleeping_proc();
+    int boosted, restored;
+
+    if (sched_set_policy(self, SCHED_PRIO, PI_LOW_PRIO)) return 0;
+
+    mutex_lock(&pi_mutex);
+
+    if (!kthread_create("pi_waiter", pi_waiter, NULL, cpuid)) {
+        mutex_unlock(&pi_mutex);
+        return 0;
+    }
+
+    /* the waiter runs first and sleeps on the mutex */
+    schedule();
+    boosted = self->priority == TASK_Q;
+
+    mutex_unlock(&pi_mutex);
+    restored = self->priority == PI_LOW_PRIO;
+
+    /* and takes it before we run again */
+    schedule();
+
+    return boosted && restored && pi_waiter_done;
+}
+
+static void report(const char* name, int passed)
+{
+    printk("selftest: %s %s\n", name, passed ? "passed" : "FAILED");
+}
+
+static void selftest_thread(void* arg)
+{
+    report("locks", lock_test());
+    report("futex requeue", futex_test());
+    report("timer wheel", timer_test());
+    report("compaction", compact_test());
+    report("priority inheritance", pi_test());
+
+    park();
+}
+
+void start_selftests()
+{
+    if (!kthread_create("selftest", selftest_thread, NULL, cpuid))
+        panic("unable to create the self-test thread");
+}
+
+#endif
@@ -0,0 +1,196 @@
+#include "cpulocals.h"
+#include "global.h"
+#include "proc.h"
+#include "proto.h"
+#include "vm.h"
+
+#include "sim.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* What the scheduler core (sched*.c, proc.c, ktimer.c) expects from the
+ * hardware and the rest of the kernel, mocked for the simulator. All harts
+ * run on one host thread: sim_cpu says which one is in the kernel and the
+ * kernel lock is a no-op. Leaving the kernel, i.e. restore_user_context() or
+ * halt_cpu(), jumps back to the event loop in sim.c. */
+
+unsigned int sim_cpu;
+uint64_t sim_now;
+jmp_buf sim_kernel_exit;
+
+struct CPULOCAL_STRUCT CPULOCAL_STRUCT[CONFIG_SMP_MAX_CPUS];
+
+/* symbols of the kernel image, the user image is never looked at */
+char _user_text, _user_etext, _user_data, _user_edata, _user_shared,
+    _user_eshared;
+char kthread_start;
+pde_t initial_pgd[NUM_DIR_ENTRIES];
+
+static char kstack[KSTACK_SIZE];
+
+void sim_init_harts(int nr_harts)
+{
+    int cpu;
+
+    ncpus = nr_harts;
+
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        get_cpu_var(cpu, hart_id) = cpu;
+        get_cpu_var(cpu, cpu_online) = 1;
+        get_cpu_var(cpu, next_timer_event) = TIMER_NO_EVENT;
+    }
+}
+
+void panic(const char* fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    fprintf(stderr, "sim: kernel panic on CPU %d: ", sim_cpu);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+
+    exit(1);
+}
+
+int printk(const char* fmt, ...)
+{
+    va_list args;
+    int retval;
+
+    va_start(args, fmt);
+    retval = vprintf(fmt, args);
+    va_end(args);
+
+    return retval;
+}
+
+/*
+ * Timer, see timer.c
+ */
+uint64_t read_cycles() { return sim_now; }
+
+uint64_t ns_to_ticks(uint64_t ns) { return ns / SIM_NS_PER_TICK; }
+
+uint64_t ticks_to_ns(uint64_t ticks) { return ticks * SIM_NS_PER_TICK; }
+
+/* the event loop fires the timer of a hart at next_timer_event */
+static void set_timer_event(uint64_t deadline)
+{
+    get_cpulocal_var(next_timer_event) = deadline;
+}
+
+void restart_local_timer()
+{
+    struct proc* p = get_cpulocal_var(proc_ptr);
+    uint64_t deadline = p->last_cycles + p->counter;
+    uint64_t next = timers_next_event(cpuid);
+
+    set_timer_event(next < deadline ? next : deadline);
+}
+
+void stop_local_timer() { set_timer_event(TIMER_NO_EVENT); }
+
+void set_idle_timer() { set_timer_event(timers_next_event(cpuid)); }
+
+void timer_interrupt()
+{
+    stop_local_timer();
+
+    run_timers();
+    balance_load_tick();
+}
+
+/* returns the ticks charged */
+static uint64_t charge_cycles(struct proc* p)
+{
+    uint64_t cycles = read_cycles();
+    uint64_t delta = cycles - p->last_cycles;
+
+    p->last_cycles = cycles;
+    sched_charge(p, delta);
+
+    if (delta < p->counter) {
+        p->counter -= delta;
+    } else {
+        p->counter = 0;
+        proc_no_quantum(p);
+    }
+
+    return delta;
+}
+
+void stop_context(struct proc* p) { p->user_time += charge_cycles(p); }
+
+void account_sys_time(struct proc* p) { p->sys_time += charge_cycles(p); }
+
+/*
+ * Harts
+ */
+void lock_kernel() {}
+
+void unlock_kernel() {}
+
+void smp_send_reschedule(int cpu)
+{
+    if (cpu == cpuid) return;
+    sim_send_ipi(cpu);
+}
+
+void halt_cpu()
+{
+    sim_halt();
+    longjmp(sim_kernel_exit, SIM_HALTED);
+}
+
+void restore_user_context(struct proc* p)
+{
+    sim_resume(p);
+    longjmp(sim_kernel_exit, SIM_RESUMED);
+}
+
+void switch_address_space(struct proc* p) {}
+
+void resume_kcontext(struct proc* p) { panic("no kernel threads here"); }
+
+void schedule() { panic("no kernel threads here"); }
+
+void init_workqueues() {}
+
+void start_workers() {}
+
+void init_futex() {}
+
+/*
+ * Memory, processes get no address space at all
+ */
+void* alloc_kstack() { return kstack + KSTACK_SIZE; }
+
+void free_kstack(void* stack_top) {}
+
+void* slaballoc(size_t bytes) { return calloc(1, bytes); }
+
+void slabfree(void* mem, size_t bytes) { free(mem); }
+
+int vm_alloc_space(struct proc* p) { return 0; }
+
+int vm_map(struct proc* p, unsigned long phys_addr, void* vir_addr,
+           void* vir_end)
+{
+    return 0;
+}
+
+int vm_map_copy(struct proc* p, const void* src, size_t len, void* vir_addr,
+                void* vir_end)
+{
+    return 0;
+}
+
+void vm_release(struct proc* p) {}
+
+int idle_zero_page() { return 0; }
+
+int vmalloc_purge_idle() { return 0; }
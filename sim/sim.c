@@ -0,0 +1,909 @@
+#include "cpulocals.h"
+#include "global.h"
+#include "proc.h"
+#include "proto.h"
+
+#include "sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Discrete-event simulator for the scheduler. The scheduler core is linked
+ * unmodified against mocked harts and timers (mock.c) and driven by a
+ * synthetic workload: every event, a burst of a task coming to an end, a timer
+ * interrupt or an IPI, enters the kernel on its hart the way a trap would and
+ * leaves through do_switch_to_user(). Kernel code takes no simulated time.
+ *
+ * Build with make sim and run obj/sched-sim <trace>. A trace looks like
+ *
+ *     harts 4             # number of harts, at most CONFIG_SMP_MAX_CPUS
+ *     duration 2s         # stop here, by default when all tasks have exited
+ *     ipi-latency 2us     # from sending an IPI until the hart takes it
+ *     seed 42             # for the random durations
+ *
+ *     task hog fair 5 count 4      # fair 5 | prio 3 | deadline 2ms 5ms 10ms
+ *         run 10ms
+ *         repeat 100               # the ops above, 0 for ever
+ *     task ui prio 3 start 1ms cpus 0x3
+ *         block                    # until woken by a wake op
+ *         run 200us-1ms            # uniformly distributed
+ *         sleep 5ms
+ *         wake hog.0
+ *         repeat 0
+ *
+ * Times take a ns, us, ms or s suffix (us by default). The copies of a task
+ * with a count are named <name>.<i>. A wake that finds its target running
+ * is remembered, the next block returns right away.
+ *
+ * The report has the latency from a task becoming runnable to it running
+ * (after a wake op, after its sleep should have ended and after being
+ * preempted), the utilization of the harts, migrations, and the fairness
+ * among the CPU-bound SCHED_FAIR tasks as Jain's index of their CPU time
+ * divided by their weight. */
+
+#define MAX_TASKS 1024
+#define MAX_OPS 64
+#define TASK_NAME_MAX 32
+
+enum {
+    OP_SETSCHED, /* first op of every task, applies the policy of the trace */
+    OP_RUN,
+    OP_SLEEP,
+    OP_BLOCK,
+    OP_WAKE,
+    OP_EXIT, /* last op of every task */
+};
+
+struct op {
+    int type;
+    uint64_t min, max; /* duration in ticks */
+    int target;        /* task woken up */
+    char target_name[TASK_NAME_MAX];
+};
+
+/* kinds of latency samples */
+enum {
+    LAT_WAKEUP,
+    LAT_SLEEP,
+    LAT_PREEMPT,
+    NR_LAT,
+};
+
+static const char* lat_names[NR_LAT] = {"wakeup", "sleep", "preempt"};
+
+struct task {
+    char name[TASK_NAME_MAX];
+    int policy;
+    int param;
+    uint64_t dl_runtime, dl_deadline, dl_period; /* in ns */
+    unsigned long cpu_mask;
+    uint64_t start;
+    int repeat; /* 0 for ever */
+    int cpu_bound;
+    struct op ops[MAX_OPS];
+    int nr_ops;
+
+    struct proc* proc;
+    int spawned;
+    int done;
+    int pc;      /* current op */
+    int iter;    /* of the repeated ops */
+    int started; /* the current op has begun */
+    int blocked; /* in a block op */
+    int tokens;  /* wakeups not consumed by a block op yet */
+    uint64_t rem;      /* ticks left of the current burst */
+    uint64_t until;    /* end of the current sleep */
+    uint64_t ready_at; /* runnable since, SIM_NEVER if running or blocked */
+    int ready_kind;
+    int last_cpu;
+
+    uint64_t cpu_time;
+    unsigned int weight;
+    unsigned long migrations;
+    unsigned long runs;
+    uint64_t max_latency;
+};
+
+static struct task tasks[MAX_TASKS];
+static int nr_tasks;
+static struct task init_task;
+static struct task* pid_task[PID_MAX];
+static struct task* spawn_order[MAX_TASKS];
+static int next_spawn;
+
+struct hart {
+    int halted;
+    uint64_t halted_at;
+    uint64_t user_event; /* the running task traps */
+    uint64_t ipi_at;
+    unsigned long switches;
+};
+
+static struct hart harts[CONFIG_SMP_MAX_CPUS];
+
+static int nr_harts = 1;
+static uint64_t duration = SIM_NEVER;
+static uint64_t ipi_latency;
+static uint64_t rand_state = 1;
+
+struct samples {
+    uint64_t* v;
+    size_t n, cap;
+};
+
+static struct samples latency[NR_LAT];
+
+/* kernel entries */
+enum {
+    EV_USER,
+    EV_TIMER,
+    EV_IPI,
+    EV_SPAWN,
+    EV_BOOT,
+};
+
+static uint64_t rand_next()
+{
+    /* xorshift64* */
+    rand_state ^= rand_state >> 12;
+    rand_state ^= rand_state << 25;
+    rand_state ^= rand_state >> 27;
+    return rand_state * 0x2545f4914f6cdd1dUL;
+}
+
+static uint64_t draw(struct op* op)
+{
+    if (op->max <= op->min) return op->min;
+    return op->min + rand_next() % (op->max - op->min + 1);
+}
+
+static void add_sample(int kind, uint64_t value)
+{
+    struct samples* s = &latency[kind];
+
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->v = realloc(s->v, s->cap * sizeof(*s->v));
+        if (!s->v) {
+            fprintf(stderr, "sim: out of memory\n");
+            exit(1);
+        }
+    }
+
+    s->v[s->n++] = value;
+}
+
+static struct task* task_of(struct proc* p) { return pid_task[p->pid]; }
+
+/*
+ * Trace parsing
+ */
+static int lineno;
+
+static void parse_error(const char* msg, const char* arg)
+{
+    fprintf(stderr, "sim: line %d: %s%s%s\n", lineno, msg, arg ? ": " : "",
+            arg ? arg : "");
+    exit(1);
+}
+
+static uint64_t parse_ns(const char* str)
+{
+    char* end;
+    double val = strtod(str, &end);
+
+    if (end == str || val < 0) parse_error("bad time", str);
+
+    if (!*end || !strcmp(end, "us")) return val * 1000;
+    if (!strcmp(end, "ns")) return val;
+    if (!strcmp(end, "ms")) return val * 1000000;
+    if (!strcmp(end, "s")) return val * 1000000000;
+
+    parse_error("bad time unit", str);
+    return 0;
+}
+
+static uint64_t parse_time(const char* str)
+{
+    return ns_to_ticks(parse_ns(str));
+}
+
+/* time or min-max */
+static void parse_range(const char* str, struct op* op)
+{
+    char buf[64];
+    char* dash;
+
+    snprintf(buf, sizeof(buf), "%s", str);
+    if ((dash = strchr(buf, '-')) != NULL) {
+        *dash = '\0';
+        op->min = parse_time(buf);
+        op->max = parse_time(dash + 1);
+        if (op->max < op->min) parse_error("empty range", str);
+    } else {
+        op->min = op->max = parse_time(buf);
+    }
+}
+
+static long parse_int(const char* str)
+{
+    char* end;
+    long val;
+
+    if (!str) parse_error("missing number", NULL);
+    val = strtol(str, &end, 0);
+    if (end == str || *end) parse_error("bad number", str);
+
+    return val;
+}
+
+static struct op* add_op(struct task* t, int type)
+{
+    struct op* op;
+
+    if (t->nr_ops == MAX_OPS - 1) parse_error("too many ops", t->name);
+
+    op = &t->ops[t->nr_ops++];
+    memset(op, 0, sizeof(*op));
+    op->type = type;
+    return op;
+}
+
+static struct task* new_task()
+{
+    struct task* t;
+
+    if (nr_tasks == MAX_TASKS) parse_error("too many tasks", NULL);
+
+    t = &tasks[nr_tasks++];
+    memset(t, 0, sizeof(*t));
+    t->policy = SCHED_FAIR;
+    t->cpu_mask = CPU_MASK_ALL;
+    t->repeat = 1;
+    t->cpu_bound = 1;
+    add_op(t, OP_SETSCHED);
+
+    return t;
+}
+
+/* end the ops of t and make count - 1 more copies of it */
+static void finish_task(struct task* t, int count)
+{
+    char name[TASK_NAME_MAX];
+    int i, has_wait = 0;
+
+    for (i = 1; i < t->nr_ops; i++) {
+        if (t->ops[i].type != OP_WAKE) has_wait = 1;
+    }
+    if (t->repeat != 1 && !has_wait)
+        parse_error("repeated ops must take time", t->name);
+
+    add_op(t, OP_EXIT);
+
+    if (count <= 1) return;
+
+    snprintf(name, sizeof(name), "%s", t->name);
+    for (i = 0; i < count; i++) {
+        struct task* copy = i ? new_task() : t;
+
+        if (i) memcpy(copy, t, sizeof(*t));
+        snprintf(copy->name, sizeof(copy->name), "%.16s.%d", name, i);
+    }
+}
+
+static void parse_task(struct task* t, char** args, int* count)
+{
+    int i = 0;
+
+    snprintf(t->name, sizeof(t->name), "%s", args[i++]);
+    *count = 1;
+
+    while (args[i]) {
+        const char* key = args[i++];
+
+        if (!strcmp(key, "fair")) {
+            t->policy = SCHED_FAIR;
+            t->param = parse_int(args[i++]);
+        } else if (!strcmp(key, "prio")) {
+            t->policy = SCHED_PRIO;
+            t->param = parse_int(args[i++]);
+        } else if (!strcmp(key, "deadline")) {
+            if (!args[i] || !args[i + 1] || !args[i + 2])
+                parse_error("deadline needs runtime, deadline and period",
+                            NULL);
+            t->policy = SCHED_DEADLINE;
+            t->dl_runtime = parse_ns(args[i++]);
+            t->dl_deadline = parse_ns(args[i++]);
+            t->dl_period = parse_ns(args[i++]);
+        } else if (!strcmp(key, "start")) {
+            if (!args[i]) parse_error("missing time", key);
+            t->start = parse_time(args[i++]);
+        } else if (!strcmp(key, "cpus")) {
+            t->cpu_mask = parse_int(args[i++]);
+        } else if (!strcmp(key, "count")) {
+            *count = parse_int(args[i++]);
+        } else {
+            parse_error("unknown task attribute", key);
+        }
+    }
+}
+
+static void parse_trace(FILE* file)
+{
+    char line[256];
+    struct task* t = NULL;
+    int count = 1;
+
+    while (fgets(line, sizeof(line), file)) {
+        char* args[16];
+        char* cmd;
+        int nr_args = 0;
+        char* comment = strchr(line, '#');
+
+        lineno++;
+        if (comment) *comment = '\0';
+
+        for (cmd = strtok(line, " \t\r\n"); cmd && nr_args < 15;
+             cmd = strtok(NULL, " \t\r\n"))
+            args[nr_args++] = cmd;
+        args[nr_args] = NULL;
+
+        if (!nr_args) continue;
+        cmd = args[0];
+
+        if (!strcmp(cmd, "task")) {
+            if (!args[1]) parse_error("missing task name", NULL);
+            if (t) finish_task(t, count);
+            t = new_task();
+            parse_task(t, &args[1], &count);
+            continue;
+        }
+
+        if (!t) {
+            if (!args[1]) parse_error("missing value", cmd);
+
+            if (!strcmp(cmd, "harts"))
+                nr_harts = parse_int(args[1]);
+            else if (!strcmp(cmd, "duration"))
+                duration = parse_time(args[1]);
+            else if (!strcmp(cmd, "ipi-latency"))
+                ipi_latency = parse_time(args[1]);
+            else if (!strcmp(cmd, "seed"))
+                rand_state = parse_int(args[1]) | 1;
+            else
+                parse_error("unknown setting", cmd);
+            continue;
+        }
+
+        if (t->repeat != 1) parse_error("ops after repeat", cmd);
+
+        if (!strcmp(cmd, "run") || !strcmp(cmd, "sleep")) {
+            struct op* op = add_op(t, cmd[0] == 'r' ? OP_RUN : OP_SLEEP);
+
+            if (!args[1]) parse_error("missing time", cmd);
+            parse_range(args[1], op);
+            if (op->type == OP_SLEEP) t->cpu_bound = 0;
+        } else if (!strcmp(cmd, "block")) {
+            add_op(t, OP_BLOCK);
+            t->cpu_bound = 0;
+        } else if (!strcmp(cmd, "wake")) {
+            struct op* op = add_op(t, OP_WAKE);
+
+            if (!args[1]) parse_error("missing task name", cmd);
+            snprintf(op->target_name, sizeof(op->target_name), "%s", args[1]);
+        } else if (!strcmp(cmd, "repeat")) {
+            t->repeat = parse_int(args[1]);
+            if (t->repeat < 0) parse_error("bad repeat count", args[1]);
+        } else {
+            parse_error("unknown op", cmd);
+        }
+    }
+
+    if (t) finish_task(t, count);
+    if (!nr_tasks) parse_error("no tasks", NULL);
+    if (nr_harts < 1 || nr_harts > CONFIG_SMP_MAX_CPUS)
+        parse_error("bad number of harts", NULL);
+}
+
+static void resolve_targets()
+{
+    int i, j, k;
+
+    for (i = 0; i < nr_tasks; i++) {
+        for (j = 0; j < tasks[i].nr_ops; j++) {
+            struct op* op = &tasks[i].ops[j];
+
+            if (op->type != OP_WAKE) continue;
+
+            for (k = 0; k < nr_tasks; k++) {
+                if (!strcmp(tasks[k].name, op->target_name)) break;
+            }
+            if (k == nr_tasks) {
+                fprintf(stderr, "sim: %s wakes unknown task %s\n",
+                        tasks[i].name, op->target_name);
+                exit(1);
+            }
+            op->target = k;
+        }
+    }
+}
+
+static int start_cmp(const void* a, const void* b)
+{
+    const struct task* ta = *(const struct task**)a;
+    const struct task* tb = *(const struct task**)b;
+
+    if (ta->start != tb->start) return ta->start < tb->start ? -1 : 1;
+    return ta < tb ? -1 : 1;
+}
+
+/*
+ * Tasks, what they do is done at the traps the way the system calls do it
+ */
+static void next_op(struct task* t)
+{
+    t->started = 0;
+
+    if (++t->pc == t->nr_ops - 1) {
+        /* back to the first op after OP_SETSCHED */
+        if (!t->repeat || ++t->iter < t->repeat) t->pc = 1;
+    }
+}
+
+static void task_exit(struct task* t)
+{
+    struct proc* p = t->proc;
+
+    t->cpu_time = p->user_time + p->sys_time;
+    t->weight = p->weight;
+    t->done = 1;
+    t->proc = NULL;
+
+    exit_proc(p, 0);
+}
+
+static void set_sched(struct task* t)
+{
+    struct proc* p = t->proc;
+    int retval = 0;
+
+    if (t->cpu_mask != CPU_MASK_ALL)
+        retval = sched_set_affinity(p, t->cpu_mask);
+
+    if (!retval) {
+        if (t->policy == SCHED_DEADLINE)
+            retval = sched_set_deadline(p, t->dl_runtime, t->dl_deadline,
+                                        t->dl_period);
+        else
+            retval = sched_set_policy(p, t->policy, t->param);
+    }
+
+    if (!retval) return;
+
+    /* report what it runs with, the policy inherited from INIT */
+    fprintf(stderr, "sim: %s: cannot set its policy (%d)\n", t->name,
+            retval);
+    t->policy = p->policy;
+    t->param = p->policy == SCHED_FAIR ? p->nice : p->base_priority;
+}
+
+/* the running task p traps, do its ops until it runs or blocks */
+static void task_trap(struct proc* p)
+{
+    struct task* t = task_of(p);
+
+    for (;;) {
+        struct op* op = &t->ops[t->pc];
+        struct task* target;
+
+        switch (op->type) {
+        case OP_SETSCHED:
+            set_sched(t);
+            break;
+        case OP_RUN:
+            if (!t->started) {
+                t->started = 1;
+                t->rem = draw(op);
+            }
+            if (t->rem) return;
+            break;
+        case OP_SLEEP:
+            /* as sys_nanosleep(), restarted until the timeout fires */
+            if (!t->started) {
+                uint64_t ticks = draw(op);
+
+                t->started = 1;
+                t->rem = ticks;
+                t->until = sim_now + ticks;
+            }
+            if (!t->rem || proc_timeout_begin(p, ticks_to_ns(t->rem), 1))
+                break;
+
+            t->ready_at = t->until;
+            t->ready_kind = LAT_SLEEP;
+            PST_SET_FLAGS(p, PST_BLOCKED);
+            return;
+        case OP_BLOCK:
+            if (t->tokens) {
+                t->tokens--;
+                break;
+            }
+
+            t->blocked = 1;
+            PST_SET_FLAGS(p, PST_BLOCKED);
+            return;
+        case OP_WAKE:
+            target = &tasks[op->target];
+
+            if (target->blocked) {
+                target->blocked = 0;
+                target->ready_at = sim_now;
+                target->ready_kind = LAT_WAKEUP;
+                PST_UNSET_FLAGS(target->proc, PST_BLOCKED);
+            }
+            if (!target->done) target->tokens++;
+            break;
+        case OP_EXIT:
+            task_exit(t);
+            return;
+        }
+
+        next_op(t);
+    }
+}
+
+static void spawn_tasks()
+{
+    struct proc* init = proc_lookup(INIT_PID);
+
+    while (next_spawn < nr_tasks &&
+           spawn_order[next_spawn]->start <= sim_now) {
+        struct task* t = spawn_order[next_spawn++];
+        struct proc* p;
+        int retval = spawn_proc(init, 0, 0, &p);
+
+        if (retval) {
+            fprintf(stderr, "sim: cannot spawn %s (%d)\n", t->name, retval);
+            exit(1);
+        }
+
+        t->proc = p;
+        pid_task[p->pid] = t;
+        t->spawned = 1;
+    }
+}
+
+/*
+ * Hooks of the mocked hardware
+ */
+void sim_send_ipi(int cpu)
+{
+    uint64_t when = sim_now + ipi_latency;
+
+    if (when < harts[cpu].ipi_at) harts[cpu].ipi_at = when;
+}
+
+/* the hart goes back to p in user mode */
+void sim_resume(struct proc* p)
+{
+    struct hart* h = &harts[cpuid];
+    struct task* t = task_of(p);
+
+    if (t->ready_at != SIM_NEVER) {
+        uint64_t delay = sim_now > t->ready_at ? sim_now - t->ready_at : 0;
+
+        if (t != &init_task) add_sample(t->ready_kind, delay);
+        if (delay > t->max_latency) t->max_latency = delay;
+        t->ready_at = SIM_NEVER;
+    }
+
+    if (t->last_cpu >= 0 && t->last_cpu != cpuid) t->migrations++;
+    t->last_cpu = cpuid;
+    t->runs++;
+
+    /* a restarted call or the next op traps right away */
+    h->user_event = sim_now;
+    if (t->ops[t->pc].type == OP_RUN && t->started) h->user_event += t->rem;
+}
+
+void sim_halt()
+{
+    struct hart* h = &harts[cpuid];
+
+    h->halted = 1;
+    h->halted_at = sim_now;
+    h->user_event = SIM_NEVER;
+}
+
+/*
+ * Event loop
+ */
+static void enter_kernel(int cpu, int cause)
+{
+    struct hart* h = &harts[cpu];
+    struct proc* prev;
+    struct proc* curr;
+
+    sim_cpu = cpu;
+    prev = get_cpulocal_var(proc_ptr);
+
+    if (h->halted) {
+        /* what idle() does once halt_cpu() returns */
+        get_cpulocal_var(idle_time) += sim_now - h->halted_at;
+        get_cpulocal_var(cpu_is_idle) = 0;
+        h->halted = 0;
+    } else if (prev) {
+        struct task* t = task_of(prev);
+
+        stop_context(prev);
+        if (t->ops[t->pc].type == OP_RUN && t->started) {
+            uint64_t ran = sim_now - (h->user_event - t->rem);
+            t->rem -= ran < t->rem ? ran : t->rem;
+        }
+    }
+    h->user_event = SIM_NEVER;
+
+    switch (cause) {
+    case EV_USER:
+        task_trap(prev);
+        break;
+    case EV_TIMER:
+        timer_interrupt();
+        break;
+    case EV_IPI:
+        h->ipi_at = SIM_NEVER;
+        break;
+    case EV_SPAWN:
+        spawn_tasks();
+        break;
+    }
+
+    if (!setjmp(sim_kernel_exit)) do_switch_to_user();
+
+    curr = get_cpulocal_var(proc_ptr);
+    if (curr && curr != prev) h->switches++;
+
+    /* preempted, it waits on a ready queue */
+    if (prev && prev != curr && proc_is_runnable(prev)) {
+        struct task* t = task_of(prev);
+
+        t->ready_at = sim_now;
+        t->ready_kind = LAT_PREEMPT;
+    }
+}
+
+static int all_done()
+{
+    int i;
+
+    if (next_spawn < nr_tasks) return 0;
+    for (i = 0; i < nr_tasks; i++) {
+        if (!tasks[i].done) return 0;
+    }
+
+    return 1;
+}
+
+/* the first event, returns 0 if nothing will happen any more */
+static int next_event(uint64_t* when, int* cpu, int* cause)
+{
+    uint64_t best = SIM_NEVER;
+    int c;
+
+    for (c = 0; c < nr_harts; c++) {
+        uint64_t ev[] = {harts[c].user_event,
+                         get_cpu_var(c, next_timer_event), harts[c].ipi_at};
+        int i;
+
+        for (i = 0; i < 3; i++) {
+            if (ev[i] < best) {
+                best = ev[i];
+                *cpu = c;
+                *cause = EV_USER + i;
+            }
+        }
+    }
+
+    if (next_spawn < nr_tasks && spawn_order[next_spawn]->start < best) {
+        best = spawn_order[next_spawn]->start;
+        *cpu = 0;
+        *cause = EV_SPAWN;
+    }
+
+    *when = best;
+    return best != SIM_NEVER;
+}
+
+static void run()
+{
+    struct proc* init;
+    uint64_t when;
+    int i, cpu, cause;
+
+    sim_init_harts(nr_harts);
+    init_timers();
+    init_proc();
+
+    /* INIT only sleeps */
+    init = proc_lookup(INIT_PID);
+    init_task.ops[0].type = OP_BLOCK;
+    init_task.nr_ops = 1;
+    init_task.ready_at = SIM_NEVER;
+    init_task.last_cpu = -1;
+    init_task.proc = init;
+    pid_task[init->pid] = &init_task;
+
+    for (i = 0; i < nr_tasks; i++) {
+        tasks[i].ready_at = SIM_NEVER;
+        tasks[i].last_cpu = -1;
+        spawn_order[i] = &tasks[i];
+    }
+    qsort(spawn_order, nr_tasks, sizeof(spawn_order[0]), start_cmp);
+
+    for (cpu = 0; cpu < nr_harts; cpu++) {
+        harts[cpu].user_event = SIM_NEVER;
+        harts[cpu].ipi_at = SIM_NEVER;
+        sim_now = 0;
+        enter_kernel(cpu, EV_BOOT);
+    }
+
+    while (!all_done()) {
+        if (!next_event(&when, &cpu, &cause)) {
+            fprintf(stderr, "sim: stalled, some tasks never wake up\n");
+            break;
+        }
+        if (when >= duration) {
+            sim_now = duration;
+            break;
+        }
+
+        if (when > sim_now) sim_now = when;
+        enter_kernel(cpu, cause);
+    }
+
+    /* charge the tasks still running */
+    for (cpu = 0; cpu < nr_harts; cpu++) {
+        struct proc* p = get_cpu_var(cpu, proc_ptr);
+
+        sim_cpu = cpu;
+        if (p && !harts[cpu].halted) stop_context(p);
+        if (harts[cpu].halted) {
+            get_cpu_var(cpu, idle_time) += sim_now - harts[cpu].halted_at;
+            harts[cpu].halted_at = sim_now;
+        }
+    }
+
+    for (i = 0; i < nr_tasks; i++) {
+        struct task* t = &tasks[i];
+
+        if (t->done || !t->proc) continue;
+        t->cpu_time = t->proc->user_time + t->proc->sys_time;
+        t->weight = t->proc->weight;
+    }
+}
+
+/*
+ * Report
+ */
+static int u64_cmp(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* nearest rank */
+static uint64_t percentile(struct samples* s, double q)
+{
+    size_t rank = q * s->n;
+
+    if (rank * 1.0 < q * s->n) rank++;
+    if (rank) rank--;
+    return s->v[rank < s->n ? rank : s->n - 1];
+}
+
+static double to_us(uint64_t ticks) { return ticks_to_ns(ticks) / 1000.0; }
+
+static double to_ms(uint64_t ticks) { return ticks_to_ns(ticks) / 1000000.0; }
+
+static const char* policy_name(struct task* t)
+{
+    static char buf[16];
+
+    switch (t->policy) {
+    case SCHED_PRIO:
+        snprintf(buf, sizeof(buf), "prio %d", t->param);
+        break;
+    case SCHED_DEADLINE:
+        snprintf(buf, sizeof(buf), "deadline");
+        break;
+    default:
+        snprintf(buf, sizeof(buf), "fair %d", t->param);
+        break;
+    }
+
+    return buf;
+}
+
+static void report(const char* trace)
+{
+    double sum = 0, sum_sq = 0;
+    unsigned long migrations = 0;
+    int i, nr_fair = 0;
+
+    printf("%s: %d harts, %.3f ms simulated\n\n", trace, nr_harts,
+           to_ms(sim_now));
+
+    printf("hart  util  switches\n");
+    for (i = 0; i < nr_harts; i++) {
+        uint64_t idle = get_cpu_var(i, idle_time);
+
+        printf("%4d %5.1f%% %9lu\n", i,
+               sim_now ? 100.0 * (sim_now - idle) / sim_now : 0.0,
+               harts[i].switches);
+    }
+
+    printf("\nlatency (us)   count       p50       p90       p99     "
+           "p99.9       max\n");
+    for (i = 0; i < NR_LAT; i++) {
+        struct samples* s = &latency[i];
+
+        if (!s->n) continue;
+        qsort(s->v, s->n, sizeof(*s->v), u64_cmp);
+        printf("%-10s %9zu %9.1f %9.1f %9.1f %9.1f %9.1f\n", lat_names[i],
+               s->n, to_us(percentile(s, 0.5)), to_us(percentile(s, 0.9)),
+               to_us(percentile(s, 0.99)), to_us(percentile(s, 0.999)),
+               to_us(s->v[s->n - 1]));
+    }
+
+    printf("\ntask                 policy      cpu (ms)   share   runs  "
+           "migr  max lat (us)\n");
+    for (i = 0; i < nr_tasks; i++) {
+        struct task* t = &tasks[i];
+
+        printf("%-20s %-10s %9.3f %6.1f%% %6lu %5lu %13.1f\n", t->name,
+               policy_name(t), to_ms(t->cpu_time),
+               sim_now ? 100.0 * t->cpu_time / sim_now : 0.0, t->runs,
+               t->migrations, to_us(t->max_latency));
+        migrations += t->migrations;
+
+        if (t->policy == SCHED_FAIR && t->cpu_bound && t->weight) {
+            double x = (double)t->cpu_time / t->weight;
+
+            sum += x;
+            sum_sq += x * x;
+            nr_fair++;
+        }
+    }
+
+    printf("\nmigrations: %lu\n", migrations);
+    if (nr_fair > 1 && sum_sq > 0)
+        printf("fairness: %.4f (Jain, %d CPU-bound SCHED_FAIR tasks, cpu "
+               "time / weight)\n",
+               sum * sum / (nr_fair * sum_sq), nr_fair);
+}
+
+int main(int argc, char** argv)
+{
+    FILE* file;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <trace>\n", argv[0]);
+        return 1;
+    }
+
+    if (!(file = fopen(argv[1], "r"))) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    parse_trace(file);
+    fclose(file);
+    resolve_targets();
+
+    run();
+    report(argv[1]);
+
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include <setjmp.h>
+#include <stdint.h>
+
+struct proc;
+
+#define SIM_NEVER ((uint64_t)-1)
+
+/* 10MHz like spike, one tick is 100ns */
+#define SIM_TIMEBASE_FREQ 10000000UL
+#define SIM_NS_PER_TICK (1000000000UL / SIM_TIMEBASE_FREQ)
+
+/* how do_switch_to_user() left the kernel, see mock.c */
+#define SIM_RESUMED 1 /* through restore_user_context() */
+#define SIM_HALTED 2  /* through halt_cpu() */
+
+extern uint64_t sim_now; /* in ticks */
+extern jmp_buf sim_kernel_exit;
+
+/* mock.c */
+void sim_init_harts(int nr_harts);
+
+/* sim.c, called by the mocked hardware */
+void sim_send_ipi(int cpu);
+void sim_resume(struct proc* p);
+void sim_halt();
+
+#endif
@@ -7,18 +7,23 @@
 
 #include <string.h>
 
-#define OBJ_ALIGN 4
+/* Objects of each size class are carved out of single pages. The slabs of a
+ * class with free objects are kept in front of the full ones so that an
+ * allocation only ever looks at the first slab, and an object finds its slab
+ * from its page address when it is freed. */
+
+#define OBJ_ALIGN 8
 
 #define SLABSIZE 200
 #define MINSIZE 8
-#define MAXSIZE ((SLABSIZE - 1 + MINSIZE) / OBJ_ALIGN * OBJ_ALIGN)
+#define MAXSIZE ((SLABSIZE - 1) * OBJ_ALIGN + MINSIZE)
 
 struct slabdata;
 
 struct slabheader {
     struct list_head list;
     bitchunk_t used_mask[BITCHUNKS(PG_SIZE / MINSIZE)];
-    unsigned short freeguess;
+    unsigned short freeguess; /* first chunk of used_mask that may be free */
     unsigned short used;
     unsigned long phys;
     struct slabdata* data;
@@ -33,7 +38,8 @@ struct slabdata {
 
 static struct list_head slabs[SLABSIZE];
 
-#define SLAB_INDEX(bytes) (roundup(bytes, OBJ_ALIGN) - (MINSIZE / OBJ_ALIGN))
+#define SLAB_INDEX(bytes) \
+    ((roundup(bytes, OBJ_ALIGN) - MINSIZE) / OBJ_ALIGN)
 
 void slabs_init()
 {
@@ -46,8 +52,10 @@ void slabs_init()
 static struct slabdata* alloc_slabdata()
 {
     unsigned long phys = alloc_pages(1);
-    struct slabdata* sd = (struct slabdata*)__va(phys);
-    if (!sd) return NULL;
+    struct slabdata* sd;
+
+    if (!phys) return NULL;
+    sd = (struct slabdata*)__va(phys);
 
     memset(&sd->header.used_mask, 0, sizeof(sd->header.used_mask));
     sd->header.used = 0;
@@ -67,64 +75,45 @@ void* slaballoc(size_t bytes)
     }
 
     struct list_head* slab = &slabs[SLAB_INDEX(bytes)];
-    struct slabdata* sd = NULL;
+    struct slabdata* sd;
     struct slabheader* header;
+    int max_objs, i;
 
     bytes = roundup(bytes, OBJ_ALIGN);
+    max_objs = DATABYTES / bytes;
 
-    if (list_empty(slab)) {
+    /* only the first slab can have free objects */
+    if (list_empty(slab) ||
+        list_first_entry(slab, struct slabheader, list)->used == max_objs) {
         sd = alloc_slabdata();
         if (!sd) return NULL;
 
         list_add(&sd->header.list, slab);
     }
-    printk("alloc sd: %p\n", sd);
 
-    int i;
-    int max_objs = DATABYTES / bytes;
-    list_for_each_entry(header, slab, list)
-    {
-        if (header->used == max_objs) continue;
-
-        for (i = header->freeguess; i < max_objs; i++) {
-            if (!GET_BIT(header->used_mask, i)) {
-                sd = header->data;
-                SET_BIT(header->used_mask, i);
-                header->freeguess = i + 1;
-                header->used++;
-
-                return (void*)&sd->data[i * bytes];
-            }
-        }
-
-        for (i = 0; i < header->freeguess; i++) {
-            if (!GET_BIT(header->used_mask, i)) {
-                sd = header->data;
-                SET_BIT(header->used_mask, i);
-                header->freeguess = i + 1;
-                header->used++;
-
-                return (void*)&sd->data[i * bytes];
-            }
-        }
-    }
+    header = list_first_entry(slab, struct slabheader, list);
+    sd = header->data;
 
-    sd = alloc_slabdata();
-    if (!sd) return NULL;
+    for (i = header->freeguess; i < BITCHUNKS(max_objs); i++) {
+        bitchunk_t chunk = header->used_mask[i];
+        int obj;
 
-    header = &sd->header;
-    list_add(&header->list, slab);
+        if (chunk == ~0UL) continue;
+
+        obj = i * BITCHUNK_BITS + bitchunk_ffs(~chunk);
+        if (obj >= max_objs) break;
+
+        SET_BIT(header->used_mask, obj);
+        header->freeguess = i;
+        header->used++;
 
-    for (i = 0; i < max_objs; i++) {
-        if (!GET_BIT(header->used_mask, i)) {
-            SET_BIT(header->used_mask, i);
-            header->freeguess = i + 1;
-            header->used++;
+        /* move full slabs out of the way */
+        if (header->used == max_objs) list_move_tail(&header->list, slab);
 
-            return (void*)&sd->data[i * bytes];
-        }
+        return (void*)&sd->data[obj * bytes];
     }
 
+    panic("mm: slaballoc: inconsistent slab");
     return NULL;
 }
 
@@ -137,22 +126,21 @@ void slabfree(void* mem, size_t bytes)
     struct list_head* slab = &slabs[SLAB_INDEX(bytes)];
     struct slabdata* sd;
     struct slabheader* header;
+    int max_objs, i;
 
     bytes = roundup(bytes, OBJ_ALIGN);
+    max_objs = DATABYTES / bytes;
 
-    if (list_empty(slab)) return;
+    /* slabs are single pages */
+    sd = (struct slabdata*)((unsigned long)mem & ~(PG_SIZE - 1UL));
+    header = &sd->header;
 
-    list_for_each_entry(header, slab, list)
-    {
-        if (header->used == 0) continue;
-        sd = header->data;
+    i = (mem - (void*)&sd->data) / bytes;
+    if (!GET_BIT(header->used_mask, i)) return;
 
-        if ((mem >= (void*)&sd->data) && (mem < (void*)&sd->data + DATABYTES)) {
-            int i = (mem - (void*)&sd->data) / bytes;
-            UNSET_BIT(header->used_mask, i);
-            header->used--;
-            header->freeguess = i;
-            return;
-        }
-    }
+    UNSET_BIT(header->used_mask, i);
+    if (i / BITCHUNK_BITS < header->freeguess)
+        header->freeguess = i / BITCHUNK_BITS;
+
+    if (header->used-- == max_objs) list_move(&header->list, slab);
 }
@@ -0,0 +1,138 @@
+#include "const.h"
+#include "cpulocals.h"
+#include "csr.h"
+#include "fdt.h"
+#include "global.h"
+#include "proto.h"
+#include "sbi.h"
+#include "spinlock.h"
+#include "vm.h"
+
+#include <string.h>
+
+#define AP_BOOT_TIMEOUT_NS 1000000000UL /* wait 1s for a hart to come up */
+
+struct CPULOCAL_STRUCT CPULOCAL_STRUCT[CONFIG_SMP_MAX_CPUS]
+    __attribute__((aligned(CPULOCALS_ALIGN)));
+
+/* Secondary harts are either started through SBI HSM or, with firmware that
+ * releases all harts into the kernel, wait in head.S until their entries
+ * here are filled. Both paths read them before paging is enabled. */
+unsigned long __cpu_up_stack_pointer[CONFIG_SMP_MAX_HARTS];
+unsigned long __cpu_up_task_pointer[CONFIG_SMP_MAX_HARTS];
+
+/* Only one hart runs in the kernel at a time. It takes the lock on kernel
+ * entry and drops it when returning to userspace or going idle. Every hart
+ * contends for it so it is a ticket lock to keep the harts in FIFO order. */
+static DEF_TICKETLOCK(big_kernel_lock);
+
+#ifdef CONFIG_LOCKSTAT
+static DEF_LOCK_CLASS(kernel_lock);
+#endif
+
+/* a hart holding the lock may be waiting for us to run a remote call */
+void lock_kernel() { ticketlock_lock_relax(&big_kernel_lock, ipi_poll); }
+
+void unlock_kernel() { ticketlock_unlock(&big_kernel_lock); }
+
+static int fdt_cpu_usable(void* dtb, int offset)
+{
+    const char* type = fdt_getprop(dtb, offset, "device_type", NULL);
+    const char* status = fdt_getprop(dtb, offset, "status", NULL);
+    const char* mmu = fdt_getprop(dtb, offset, "mmu-type", NULL);
+
+    if (!type || strcmp(type, "cpu") != 0) return 0;
+    if (status && strcmp(status, "okay") != 0 && strcmp(status, "ok") != 0)
+        return 0;
+    /* e.g. monitor cores without supervisor mode */
+    if (!mmu || strcmp(mmu, "riscv,none") == 0) return 0;
+
+    return 1;
+}
+
+/* enumerate the harts in /cpus, the boot hart becomes CPU 0 */
+void init_smp(void* dtb, unsigned int boot_hart_id)
+{
+    int cpus, offset;
+
+    lock_set_class(&big_kernel_lock, &kernel_lock);
+
+    ncpus = 1;
+    get_cpu_var(0, hart_id) = boot_hart_id;
+    get_cpu_var(0, cpu_online) = 1;
+
+    if ((cpus = fdt_path_offset(dtb, "/cpus")) < 0) return;
+
+    fdt_for_each_subnode(offset, dtb, cpus)
+    {
+        const uint32_t* reg;
+        unsigned long hart;
+        int len;
+
+        if (!fdt_cpu_usable(dtb, offset)) continue;
+
+        reg = fdt_getprop(dtb, offset, "reg", &len);
+        if (!reg || len < sizeof(uint32_t)) continue;
+
+        hart = of_read_number(reg, len / sizeof(uint32_t));
+        if (hart == boot_hart_id) continue;
+
+        if (hart >= CONFIG_SMP_MAX_HARTS) {
+            printk("smp: hart %lu out of range, ignored\n", hart);
+            continue;
+        }
+
+        if (ncpus == CONFIG_SMP_MAX_CPUS) {
+            printk("smp: too many harts, only using %d\n", ncpus);
+            break;
+        }
+
+        get_cpu_var(ncpus, hart_id) = hart;
+        ncpus++;
+    }
+
+    printk("smp: %d hart(s) found, booting on hart %d\n", ncpus, boot_hart_id);
+}
+
+/* start all the other harts and wait until they are online */
+void smp_boot_aps()
+{
+    extern char secondary_start_sbi;
+    int cpu;
+
+    for (cpu = 1; cpu < ncpus; cpu++) {
+        struct proc* idle = get_cpu_var_ptr(cpu, idle_proc);
+        unsigned int hart = get_cpu_var(cpu, hart_id);
+        uint64_t deadline;
+
+        __cpu_up_task_pointer[hart] = (unsigned long)idle;
+        /* the task pointer must be visible before the stack pointer */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        __cpu_up_stack_pointer[hart] = idle->regs.kernel_sp;
+
+        /* fails without HSM or if the hart has been released by the firmware
+         * and is already parked in head.S, waiting for the pointers above */
+        sbi_hart_start(hart, (unsigned long)__pa(&secondary_start_sbi), 0);
+
+        deadline = read_cycles() + ns_to_ticks(AP_BOOT_TIMEOUT_NS);
+        while (!get_cpu_var(cpu, cpu_online) && read_cycles() < deadline)
+            ;
+
+        if (!get_cpu_var(cpu, cpu_online))
+            printk("smp: hart %d did not come up\n", hart);
+    }
+}
+
+/* C entry of the secondary harts, paging is on and tp points to the idle task
+ * of the hart */
+void smp_boot_ap()
+{
+    init_trap();
+
+    get_cpulocal_var(cpu_online) = 1;
+
+    lock_kernel();
+    printk("smp: CPU %d (hart %d) online\n", cpuid, get_cpulocal_var(hart_id));
+
+    switch_to_user();
+}
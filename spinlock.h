@@ -0,0 +1,331 @@
+#ifndef _SPINLOCK_H_
+#define _SPINLOCK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Busy-waiting locks built on the A extension:
+ *  - spinlock_t: test-and-test-and-set, cheapest when uncontended
+ *  - ticketlock_t: FIFO order between the waiters
+ *  - mcslock_t: queued lock, each waiter spins on its own node so heavily
+ *    contended locks do not bounce a single cache line between harts
+ *  - rwlock_t: many readers or one writer
+ *
+ * Lock words are explicitly aligned since everything is built with
+ * -fpack-struct and AMOs fault on misaligned addresses, locks embedded in
+ * other structures need an aligned attribute on the member as well.
+ *
+ * With CONFIG_LOCKSTAT (make LOCKSTAT=1) every lock can be given a lock class
+ * that records acquisitions, contention and hold time, see lockstat.c. */
+
+#ifdef CONFIG_LOCKSTAT
+
+struct lock_class {
+    const char* name;
+    struct lock_class* next;
+    int registered;
+
+    /* cycle counts, updated atomically */
+    uint64_t acquisitions __attribute__((aligned(8)));
+    uint64_t contentions;
+    uint64_t wait_time;
+    uint64_t max_wait_time;
+    uint64_t hold_time;
+    uint64_t max_hold_time;
+};
+
+#define DEF_LOCK_CLASS(name) struct lock_class name = {#name}
+
+struct lockstat_data {
+    struct lock_class* class;
+    uint64_t acquired_at;
+};
+
+#define LOCKSTAT_MEMBER struct lockstat_data stat;
+
+uint64_t lockstat_clock();
+void lockstat_register_class(struct lock_class* class);
+void lockstat_acquired(struct lockstat_data* stat, uint64_t wait_start);
+void lockstat_released(struct lockstat_data* stat);
+
+#define LOCKSTAT_DECLARE_WAIT uint64_t __wait_start = 0
+#define lockstat_wait_begin() (__wait_start = lockstat_clock())
+#define lockstat_acquire(l) lockstat_acquired(&(l)->stat, __wait_start)
+#define lockstat_release(l) lockstat_released(&(l)->stat)
+
+/* account all acquisitions of l to class */
+#define lock_set_class(l, cls)        \
+    do {                              \
+        lockstat_register_class(cls); \
+        (l)->stat.class = (cls);      \
+    } while (0)
+
+#else
+
+#define LOCKSTAT_MEMBER
+#define LOCKSTAT_DECLARE_WAIT
+#define lockstat_wait_begin()
+#define lockstat_acquire(l)
+#define lockstat_release(l)
+#define lock_set_class(l, cls)
+
+#endif
+
+/*
+ * Spinlock
+ */
+typedef struct {
+    volatile unsigned int lock __attribute__((aligned(4)));
+    LOCKSTAT_MEMBER
+} spinlock_t;
+
+#define DEF_SPINLOCK(name) spinlock_t name = {0}
+
+static inline void spinlock_init(spinlock_t* l) { l->lock = 0; }
+
+static inline int __spinlock_trylock(spinlock_t* l)
+{
+    return !__atomic_exchange_n(&l->lock, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline int spinlock_trylock(spinlock_t* l)
+{
+    LOCKSTAT_DECLARE_WAIT;
+
+    if (!__spinlock_trylock(l)) return 0;
+
+    lockstat_acquire(l);
+    return 1;
+}
+
+static inline void spinlock_lock(spinlock_t* l)
+{
+    LOCKSTAT_DECLARE_WAIT;
+
+    if (!__spinlock_trylock(l)) {
+        lockstat_wait_begin();
+
+        do {
+            /* wait with plain loads so that the line is not bounced around */
+            while (l->lock)
+                ;
+        } while (!__spinlock_trylock(l));
+    }
+
+    lockstat_acquire(l);
+}
+
+static inline void spinlock_unlock(spinlock_t* l)
+{
+    lockstat_release(l);
+    __atomic_store_n(&l->lock, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Ticket lock
+ */
+typedef struct {
+    unsigned int next __attribute__((aligned(4))); /* next ticket to hand out */
+    unsigned int owner __attribute__((aligned(4))); /* ticket being served */
+    LOCKSTAT_MEMBER
+} ticketlock_t;
+
+#define DEF_TICKETLOCK(name) ticketlock_t name = {0, 0}
+
+static inline void ticketlock_init(ticketlock_t* l) { l->next = l->owner = 0; }
+
+/* relax (if not NULL) is called while waiting for our turn */
+static inline void ticketlock_lock_relax(ticketlock_t* l, void (*relax)(void))
+{
+    LOCKSTAT_DECLARE_WAIT;
+    unsigned int ticket = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&l->owner, __ATOMIC_ACQUIRE) != ticket) {
+        lockstat_wait_begin();
+
+        while (__atomic_load_n(&l->owner, __ATOMIC_ACQUIRE) != ticket) {
+            if (relax) relax();
+        }
+    }
+
+    lockstat_acquire(l);
+}
+
+static inline void ticketlock_lock(ticketlock_t* l)
+{
+    ticketlock_lock_relax(l, NULL);
+}
+
+static inline int ticketlock_trylock(ticketlock_t* l)
+{
+    LOCKSTAT_DECLARE_WAIT;
+    unsigned int owner = __atomic_load_n(&l->owner, __ATOMIC_RELAXED);
+    unsigned int next = owner;
+
+    /* only take a ticket if it would be served right away */
+    if (!__atomic_compare_exchange_n(&l->next, &next, owner + 1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+
+    lockstat_acquire(l);
+    return 1;
+}
+
+static inline void ticketlock_unlock(ticketlock_t* l)
+{
+    lockstat_release(l);
+
+    /* only the holder writes owner */
+    __atomic_store_n(&l->owner, l->owner + 1, __ATOMIC_RELEASE);
+}
+
+static inline int ticketlock_is_contended(ticketlock_t* l)
+{
+    return __atomic_load_n(&l->next, __ATOMIC_RELAXED) -
+               __atomic_load_n(&l->owner, __ATOMIC_RELAXED) >
+           1;
+}
+
+/*
+ * MCS lock, the caller provides a queue node that must stay valid until the
+ * lock is released
+ */
+struct mcs_node {
+    struct mcs_node* next __attribute__((aligned(8)));
+    unsigned int locked __attribute__((aligned(4)));
+};
+
+typedef struct {
+    struct mcs_node* tail __attribute__((aligned(8)));
+    LOCKSTAT_MEMBER
+} mcslock_t;
+
+#define DEF_MCSLOCK(name) mcslock_t name = {NULL}
+
+static inline void mcslock_init(mcslock_t* l) { l->tail = NULL; }
+
+static inline void mcslock_lock(mcslock_t* l, struct mcs_node* node)
+{
+    LOCKSTAT_DECLARE_WAIT;
+    struct mcs_node* prev;
+
+    node->next = NULL;
+    node->locked = 1;
+
+    prev = __atomic_exchange_n(&l->tail, node, __ATOMIC_ACQ_REL);
+    if (prev) {
+        lockstat_wait_begin();
+
+        /* link in behind the previous waiter and spin on our own node */
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+            ;
+    }
+
+    lockstat_acquire(l);
+}
+
+static inline void mcslock_unlock(mcslock_t* l, struct mcs_node* node)
+{
+    struct mcs_node* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+    lockstat_release(l);
+
+    if (!next) {
+        struct mcs_node* expected = node;
+
+        /* no one is waiting */
+        if (__atomic_compare_exchange_n(&l->tail, &expected, NULL, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return;
+
+        /* a waiter has swapped the tail but not linked in yet */
+        while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+            ;
+    }
+
+    __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Reader-writer lock, cnt is the number of readers or RW_WRITER if a writer
+ * holds the lock. Readers are held off while a writer is waiting so that
+ * writers do not starve.
+ */
+#define RW_WRITER 0x80000000U
+#define RW_WAITING 0x40000000U
+
+typedef struct {
+    unsigned int cnt __attribute__((aligned(4)));
+    LOCKSTAT_MEMBER
+} rwlock_t;
+
+#define DEF_RWLOCK(name) rwlock_t name = {0}
+
+static inline void rwlock_init(rwlock_t* l) { l->cnt = 0; }
+
+static inline void read_lock(rwlock_t* l)
+{
+    LOCKSTAT_DECLARE_WAIT;
+    unsigned int cnt = __atomic_load_n(&l->cnt, __ATOMIC_RELAXED);
+    int waited = 0;
+
+    for (;;) {
+        if (!(cnt & (RW_WRITER | RW_WAITING)) &&
+            __atomic_compare_exchange_n(&l->cnt, &cnt, cnt + 1, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+
+        if (!waited) {
+            lockstat_wait_begin();
+            waited = 1;
+        }
+        cnt = __atomic_load_n(&l->cnt, __ATOMIC_RELAXED);
+    }
+
+    lockstat_acquire(l);
+}
+
+static inline void read_unlock(rwlock_t* l)
+{
+    /* hold time is only tracked for writers */
+    __atomic_fetch_sub(&l->cnt, 1, __ATOMIC_RELEASE);
+}
+
+static inline void write_lock(rwlock_t* l)
+{
+    LOCKSTAT_DECLARE_WAIT;
+    unsigned int cnt = 0;
+
+    if (__atomic_compare_exchange_n(&l->cnt, &cnt, RW_WRITER, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        goto out;
+
+    lockstat_wait_begin();
+
+    for (;;) {
+        cnt = __atomic_load_n(&l->cnt, __ATOMIC_RELAXED);
+
+        /* wait for the readers to drain, RW_WAITING is the only bit left
+         * then */
+        if ((cnt & ~RW_WAITING) == 0) {
+            if (__atomic_compare_exchange_n(&l->cnt, &cnt, RW_WRITER, 1,
+                                            __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (!(cnt & RW_WAITING)) {
+            __atomic_fetch_or(&l->cnt, RW_WAITING, __ATOMIC_RELAXED);
+        }
+    }
+
+out:
+    lockstat_acquire(l);
+}
+
+static inline void write_unlock(rwlock_t* l)
+{
+    lockstat_release(l);
+    __atomic_store_n(&l->cnt, 0, __ATOMIC_RELEASE);
+}
+
+#endif
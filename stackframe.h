@@ -3,6 +3,14 @@
 
 typedef unsigned long reg_t;
 
+/* registers of a kernel thread that has given up the hart, the rest are
+ * caller-saved, see schedule in trap.S */
+struct kcontext {
+    reg_t ra;
+    reg_t sp;
+    reg_t s[12];
+};
+
 struct reg_context {
     /* save user registers in the frame upon context switch */
     reg_t sepc;
@@ -45,6 +53,8 @@ struct reg_context {
 
     reg_t orig_a0;
 
+    struct kcontext kctx;
+
     /* Current CPU */
     unsigned int cpu;
 };
@@ -52,6 +62,10 @@ struct reg_context {
 struct vm_context {
     reg_t ptbr_phys;
     reg_t* ptbr_vir;
+
+    unsigned long asid;      /* see tlb.c */
+    unsigned long asid_gen;  /* ASID generation asid belongs to */
+    unsigned long cpu_mask;  /* harts that may cache entries of this space */
 };
 
 #endif
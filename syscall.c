@@ -1,20 +1,196 @@
 #include "const.h"
+#include "cpulocals.h"
+#include "global.h"
 #include "proc.h"
 #include "proto.h"
 
 #include <errno.h>
 
-int sys_nop() { return ENOSYS; }
+/* system calls return a negative errno on failure */
+
+int sys_nop() { return -ENOSYS; }
 
 static int sys_write_console(struct proc* p, const char* str, int len)
 {
     char buf[256];
-    copy_from_user(buf, str, len);
+    int retval;
+
+    if (len < 0 || len >= sizeof(buf)) return -EINVAL;
+    if ((retval = copy_from_user(buf, str, len)) != 0) return retval;
     buf[len] = '\0';
     direct_put_str(buf);
     return 0;
 }
 
+static int sys_times(struct proc* p, struct proc_times* buf)
+{
+    struct proc_times times;
+
+    /* include the time of this trap so far */
+    account_sys_time(p);
+
+    times.user_time = ticks_to_ns(p->user_time);
+    times.sys_time = ticks_to_ns(p->sys_time);
+    return copy_to_user(buf, &times, sizeof(times));
+}
+
+static int sys_set_affinity(struct proc* p, unsigned long cpu_mask)
+{
+    return -sched_set_affinity(p, cpu_mask);
+}
+
+static int sys_lockstat(struct proc* p)
+{
+    lockstat_dump();
+    return 0;
+}
+
+/* returns the pid of the child */
+static int sys_spawn(struct proc* p, reg_t entry, reg_t arg)
+{
+    struct proc* child;
+    int retval;
+
+    if ((retval = spawn_proc(p, entry, arg, &child)) != 0) return retval;
+
+    return child->pid;
+}
+
+static int sys_exit(struct proc* p, int status)
+{
+    exit_proc(p, status);
+    return 0;
+}
+
+/* wait for the child pid (-1 for any child) to exit and return its pid, give
+ * up after timeout nanoseconds unless it is 0 */
+static int sys_wait(struct proc* p, int pid, int* status, uint64_t timeout)
+{
+    int child_pid, child_status;
+    int retval = wait_proc(p, pid, &child_pid, &child_status);
+
+    if (retval == EAGAIN) {
+        if (proc_timeout_begin(p, timeout, 0)) {
+            PST_UNSET_FLAGS(p, PST_WAITING);
+            return -ETIMEDOUT;
+        }
+
+        /* blocked, the call is restarted once a child has exited */
+        p->regs.sepc -= 4;
+        return p->regs.orig_a0;
+    }
+
+    proc_timeout_end(p);
+    if (retval) return -retval;
+
+    if (status &&
+        (retval = copy_to_user(status, &child_status, sizeof(child_status))))
+        return retval;
+    return child_pid;
+}
+
+static int sys_set_sched(struct proc* p, int policy, int param)
+{
+    return -sched_set_policy(p, policy, param);
+}
+
+/* times are in nanoseconds */
+static int sys_set_deadline(struct proc* p, uint64_t runtime,
+                            uint64_t deadline, uint64_t period)
+{
+    return -sched_set_deadline(p, runtime, deadline, period);
+}
+
+static int sys_nanosleep(struct proc* p, uint64_t ns)
+{
+    if (!ns || proc_timeout_begin(p, ns, 1)) return 0;
+
+    /* restarted when the timeout wakes us up */
+    PST_SET_FLAGS(p, PST_BLOCKED);
+    p->regs.sepc -= 4;
+    return p->regs.orig_a0;
+}
+
+static int sys_cpu_times(struct proc* p, int cpu, struct cpu_times* buf)
+{
+    struct cpu_times times;
+    uint64_t idle;
+
+    if (cpu < 0 || cpu >= ncpus) return -EINVAL;
+
+    idle = get_cpu_var(cpu, idle_time);
+    times.cycles = read_cycles();
+
+    /* a halted hart only adds to idle_time when it wakes up */
+    if (get_cpu_var(cpu, cpu_is_idle))
+        idle += times.cycles - get_cpu_var(cpu, halt_start);
+
+    times.idle_time = ticks_to_ns(idle);
+    times.clock = ticks_to_ns(times.cycles);
+    return copy_to_user(buf, &times, sizeof(times));
+}
+
+/* the caller goes to the tail of its queue when it leaves the kernel */
+static int sys_yield(struct proc* p)
+{
+    p->flags |= PF_EXPIRED;
+    return 0;
+}
+
+/* wait on uaddr as long as it contains val, for at most timeout nanoseconds
+ * unless it is 0 */
+static int sys_futex_wait(struct proc* p, uint32_t* uaddr, uint32_t val,
+                          uint64_t timeout)
+{
+    int retval = futex_wait(p, uaddr, val, timeout);
+
+    if (retval) return -retval;
+
+    if (p->flags & PF_FUTEX) {
+        /* blocked, restarted once woken up */
+        p->regs.sepc -= 4;
+        return p->regs.orig_a0;
+    }
+
+    return 0;
+}
+
+/* returns the number of processes woken up */
+static int sys_futex_wake(struct proc* p, uint32_t* uaddr, int nr)
+{
+    int woken, retval;
+
+    if ((retval = futex_wake(p, uaddr, nr, &woken)) != 0) return -retval;
+
+    return woken;
+}
+
+/* returns the number of processes woken up or requeued */
+static int sys_futex_requeue(struct proc* p, uint32_t* uaddr, int nr_wake,
+                             uint32_t* uaddr2, int nr_requeue, uint32_t val)
+{
+    int count, retval;
+
+    retval = futex_requeue(p, uaddr, nr_wake, uaddr2, nr_requeue, val, &count);
+    if (retval) return -retval;
+
+    return count;
+}
+
 void* syscall_table[NR_SYSCALLS] = {
     [SYS_WRITE_CONSOLE] = sys_write_console,
+    [SYS_TIMES] = sys_times,
+    [SYS_SET_AFFINITY] = sys_set_affinity,
+    [SYS_LOCKSTAT] = sys_lockstat,
+    [SYS_SPAWN] = sys_spawn,
+    [SYS_EXIT] = sys_exit,
+    [SYS_WAIT] = sys_wait,
+    [SYS_SET_SCHED] = sys_set_sched,
+    [SYS_SET_DEADLINE] = sys_set_deadline,
+    [SYS_NANOSLEEP] = sys_nanosleep,
+    [SYS_FUTEX_WAIT] = sys_futex_wait,
+    [SYS_FUTEX_WAKE] = sys_futex_wake,
+    [SYS_FUTEX_REQUEUE] = sys_futex_requeue,
+    [SYS_CPU_TIMES] = sys_cpu_times,
+    [SYS_YIELD] = sys_yield,
 };
@@ -1,10 +1,108 @@
+#include "cpulocals.h"
 #include "csr.h"
+#include "fdt.h"
+#include "global.h"
+#include "ktimer.h"
 #include "proc.h"
+#include "proto.h"
 #include "sbi.h"
 
 #include <stdint.h>
 
-/* TODO: need to calibrate timer!!!!! */
+#define NSEC_PER_SEC 1000000000UL
+#define DEFAULT_TIMEBASE_FREQ 10000000UL /* used if the FDT does not tell */
+
+/* conversions are exact multiply-shifts for intervals up to this long */
+#define TIMER_CONVERT_MAXSEC 600
+
+static uint64_t timebase_freq;
+static uint32_t tick_ns_mult, tick_ns_shift;
+static uint32_t ns_tick_mult, ns_tick_shift;
+
+/* compute mult and shift such that (x * mult) >> shift ~= x * to / from
+ * without overflowing for x up to maxsec * from */
+static void calc_mult_shift(uint32_t* mult, uint32_t* shift, uint64_t from,
+                            uint64_t to, uint32_t maxsec)
+{
+    uint64_t tmp;
+    uint32_t sft, sftacc = 32;
+
+    /* bits left for the multiplier after the largest input */
+    tmp = ((uint64_t)maxsec * from) >> 32;
+    while (tmp) {
+        tmp >>= 1;
+        sftacc--;
+    }
+
+    /* pick the largest shift that keeps mult within sftacc bits */
+    for (sft = 32; sft > 0; sft--) {
+        tmp = (uint64_t)to << sft;
+        tmp += from / 2;
+        tmp /= from;
+        if ((tmp >> sftacc) == 0) break;
+    }
+
+    *mult = tmp;
+    *shift = sft;
+}
+
+void init_timer(void* dtb)
+{
+    int offset = fdt_path_offset(dtb, "/cpus");
+    const uint32_t* prop = NULL;
+    int len, cpu;
+
+    if (offset >= 0)
+        prop = fdt_getprop(dtb, offset, "timebase-frequency", &len);
+
+    if (prop && len >= sizeof(uint32_t)) {
+        timebase_freq = of_read_number(prop, len / sizeof(uint32_t));
+    } else {
+        printk("timer: no timebase-frequency in /cpus, assuming %lu Hz\n",
+               DEFAULT_TIMEBASE_FREQ);
+        timebase_freq = DEFAULT_TIMEBASE_FREQ;
+    }
+
+    calc_mult_shift(&tick_ns_mult, &tick_ns_shift, timebase_freq, NSEC_PER_SEC,
+                    TIMER_CONVERT_MAXSEC);
+    calc_mult_shift(&ns_tick_mult, &ns_tick_shift, NSEC_PER_SEC, timebase_freq,
+                    TIMER_CONVERT_MAXSEC);
+
+    init_timers();
+
+    printk("timer: timebase frequency %lu Hz\n", timebase_freq);
+
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        /* deadline the timer of the hart is currently programmed for */
+        get_cpu_var(cpu, next_timer_event) = TIMER_NO_EVENT;
+
+        /* the hart can write stimecmp directly instead of asking the
+         * firmware */
+        offset = of_find_cpu_node(dtb, get_cpu_var(cpu, hart_id));
+        if (offset >= 0 && of_cpu_has_isa_ext(dtb, offset, "sstc")) {
+            get_cpu_var(cpu, has_sstc) = 1;
+            printk("timer: using Sstc stimecmp on CPU %d\n", cpu);
+        }
+    }
+}
+
+uint64_t ticks_to_ns(uint64_t ticks)
+{
+    if (ticks < TIMER_CONVERT_MAXSEC * timebase_freq)
+        return (ticks * tick_ns_mult) >> tick_ns_shift;
+
+    return (ticks / timebase_freq) * NSEC_PER_SEC +
+           (((ticks % timebase_freq) * tick_ns_mult) >> tick_ns_shift);
+}
+
+uint64_t ns_to_ticks(uint64_t ns)
+{
+    if (ns < TIMER_CONVERT_MAXSEC * NSEC_PER_SEC)
+        return (ns * ns_tick_mult) >> ns_tick_shift;
+
+    return (ns / NSEC_PER_SEC) * timebase_freq +
+           (((ns % NSEC_PER_SEC) * ns_tick_mult) >> ns_tick_shift);
+}
 
 uint64_t read_cycles()
 {
@@ -15,17 +113,85 @@ uint64_t read_cycles()
     return n;
 }
 
-void restart_local_timer()
+/* program the timer for a one-shot event at deadline, the SBI call is skipped
+ * if the timer is already armed for it */
+static void set_timer_event(uint64_t deadline)
 {
+    if (deadline == get_cpulocal_var(next_timer_event)) return;
+
+    get_cpulocal_var(next_timer_event) = deadline;
+    if (get_cpulocal_var(has_sstc))
+        csr_write(0x14d, deadline); /* stimecmp, unknown to older assemblers */
+    else
+        sbi_set_timer(deadline);
     csr_set(sie, SIE_STIE);
-    uint64_t cycles = read_cycles();
-    sbi_set_timer(cycles + 1000);
 }
 
-void timer_interrupt() { csr_clear(sie, SIE_STIE); }
+/* arm the timer for the end of the current process' quantum or the next
+ * software timer, whichever comes first. last_cycles is the last accounting
+ * point so the deadline stays the same across traps as long as the process
+ * keeps running. */
+void restart_local_timer()
+{
+    struct proc* p = get_cpulocal_var(proc_ptr);
+    uint64_t deadline = p->last_cycles + p->counter;
+    uint64_t next = timers_next_event(cpuid);
+
+    set_timer_event(next < deadline ? next : deadline);
+}
+
+/* stop the tick while the hart is idle */
+void stop_local_timer()
+{
+    csr_clear(sie, SIE_STIE);
+    get_cpulocal_var(next_timer_event) = TIMER_NO_EVENT;
+}
+
+/* the timer of an idle hart is only needed for the software timers */
+void set_idle_timer()
+{
+    uint64_t next = timers_next_event(cpuid);
+
+    if (next == TIMER_NO_EVENT)
+        stop_local_timer();
+    else
+        set_timer_event(next);
+}
+
+void timer_interrupt()
+{
+    /* the event has fired, the timer needs to be reprogrammed for the next
+     * one */
+    stop_local_timer();
+
+    run_timers();
+    compact_mem_background();
+    balance_load_tick();
+}
 
-void stop_context(struct proc* p)
+/* charge the cycles since the last accounting point to p, returns them */
+static uint64_t charge_cycles(struct proc* p)
 {
     uint64_t cycles = read_cycles();
     uint64_t delta = cycles - p->last_cycles;
+
+    p->last_cycles = cycles;
+    sched_charge(p, delta);
+
+    if (delta < p->counter) {
+        p->counter -= delta;
+    } else {
+        p->counter = 0;
+        proc_no_quantum(p);
+    }
+
+    return delta;
 }
+
+/* called upon trap entry, the time since the process was resumed was spent in
+ * user mode */
+void stop_context(struct proc* p) { p->user_time += charge_cycles(p); }
+
+/* called before leaving the kernel, the time since the trap was spent in the
+ * kernel on behalf of the process */
+void account_sys_time(struct proc* p) { p->sys_time += charge_cycles(p); }
@@ -0,0 +1,278 @@
+#include "bitmap.h"
+#include "cpulocals.h"
+#include "csr.h"
+#include "global.h"
+#include "proc.h"
+#include "proto.h"
+#include "sbi.h"
+#include "vm.h"
+
+#include <string.h>
+
+/* TLB management.
+ *
+ * Every address space gets an ASID if the harts implement them, so switching
+ * between processes does not flush the TLB. ASIDs are handed out in
+ * generations: when they run out, a new generation starts and every hart
+ * flushes its whole TLB before it switches to an address space of the new
+ * generation.
+ *
+ * Each address space records the harts it has been active on, which are the
+ * only harts that can hold its translations. Invalidations are collected in a
+ * tlb_batch and sent only to those harts, a single range goes through the SBI
+ * remote fence and several ranges through one IPI. */
+
+#define ASID_MAX_BITS 16
+#define NR_ASIDS_MAX (1UL << ASID_MAX_BITS)
+
+/* ranges larger than this are flushed as a whole address space */
+#define TLB_FLUSH_PAGES_MAX 64
+
+static unsigned int asid_bits;
+static unsigned long nr_asids;
+static unsigned long asid_generation = 1;
+static unsigned long next_asid = 1; /* ASID 0 is never handed out */
+static bitchunk_t asid_map[BITCHUNKS(NR_ASIDS_MAX)];
+
+void init_tlb()
+{
+    unsigned long satp = csr_read(sptbr);
+    unsigned long asid;
+    int cpu;
+
+    /* the implemented ASID bits read back as ones */
+    csr_write(sptbr, satp | (SATP_ASID_MASK << SATP_ASID_SHIFT));
+    asid = (csr_read(sptbr) >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+    csr_write(sptbr, satp);
+
+    for (asid_bits = 0; asid & 1; asid >>= 1)
+        asid_bits++;
+
+    nr_asids = asid_bits ? 1UL << asid_bits : 0;
+
+    /* too few ASIDs to be worth the generation rollovers */
+    if (nr_asids && nr_asids < 2 * ncpus) nr_asids = 0;
+
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        get_cpu_var(cpu, asid_gen) = asid_generation;
+        get_cpu_var(cpu, active_vm) = NULL;
+    }
+
+    if (nr_asids)
+        printk("tlb: %d ASID bits\n", asid_bits);
+    else
+        printk("tlb: no ASIDs, flushing the TLB on address space switches\n");
+}
+
+static void new_asid(struct vm_context* vm)
+{
+    unsigned long asid;
+
+    for (asid = next_asid; asid < nr_asids; asid++) {
+        if (!GET_BIT(asid_map, asid)) break;
+    }
+
+    if (asid >= nr_asids) {
+        /* out of ASIDs, harts pick up the new generation in
+         * switch_address_space() */
+        asid_generation++;
+        memset(asid_map, 0, sizeof(asid_map));
+        asid = 1;
+    }
+
+    SET_BIT(asid_map, asid);
+    next_asid = asid + 1;
+
+    vm->asid = asid;
+    vm->asid_gen = asid_generation;
+    /* the harts that ran it under its old ASID do not matter any more */
+    vm->cpu_mask = 0;
+}
+
+static void release_vm_local(void* arg)
+{
+    struct vm_context* vm = arg;
+
+    if (get_cpulocal_var(active_vm) == vm) {
+        /* a hart that went idle keeps the page table of the last process it
+         * ran, move it to initial_pgd which maps the kernel as well */
+        get_cpulocal_var(active_vm) = NULL;
+        write_ptbr((unsigned long)__pa(initial_pgd));
+    } else if (nr_asids) {
+        flush_tlb_asid(vm->asid);
+    }
+}
+
+/* forget an address space that is being destroyed and give back its ASID,
+ * on return no hart uses its page tables or caches its translations */
+void tlb_release_vm(struct vm_context* vm)
+{
+    unsigned long cpu_mask = vm->cpu_mask;
+    int cpu;
+
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        if (get_cpu_var(cpu, active_vm) == vm) cpu_mask |= 1UL << cpu;
+    }
+
+    smp_call_function_many(cpu_mask, release_vm_local, vm, 1);
+
+    if (nr_asids && vm->asid_gen == asid_generation)
+        UNSET_BIT(asid_map, vm->asid);
+    vm->asid_gen = 0;
+    vm->cpu_mask = 0;
+}
+
+void switch_address_space(struct proc* p)
+{
+    struct vm_context* vm = &p->vm;
+    struct vm_context* prev = get_cpulocal_var(active_vm);
+
+    if (prev == vm) return;
+    get_cpulocal_var(active_vm) = vm;
+
+    if (!nr_asids) {
+        /* the switch flushes everything the hart has cached for prev */
+        if (prev) prev->cpu_mask &= ~(1UL << cpuid);
+        vm->cpu_mask |= 1UL << cpuid;
+        write_ptbr(vm->ptbr_phys);
+        return;
+    }
+
+    if (vm->asid_gen != asid_generation) new_asid(vm);
+
+    if (get_cpulocal_var(asid_gen) != asid_generation) {
+        /* the TLB may hold entries of ASIDs that have been reassigned */
+        get_cpulocal_var(asid_gen) = asid_generation;
+        flush_tlb();
+    }
+
+    vm->cpu_mask |= 1UL << cpuid;
+    write_ptbr_asid(vm->ptbr_phys, vm->asid);
+}
+
+static void local_flush_range(unsigned long start, unsigned long size,
+                              long asid)
+{
+    unsigned long addr;
+
+    if (size > TLB_FLUSH_PAGES_MAX * PG_SIZE) {
+        if (asid == TLB_ASID_ALL || !nr_asids)
+            flush_tlb();
+        else
+            flush_tlb_asid(asid);
+        return;
+    }
+
+    for (addr = start; addr < start + size; addr += PG_SIZE) {
+        if (asid == TLB_ASID_ALL || !nr_asids)
+            flush_tlb_page(addr);
+        else
+            flush_tlb_page_asid(addr, asid);
+    }
+}
+
+static void local_flush_batch(struct tlb_batch* batch)
+{
+    int i;
+
+    if (batch->flush_all) {
+        flush_tlb();
+        return;
+    }
+
+    for (i = 0; i < batch->nr_ranges; i++) {
+        struct tlb_range* range = &batch->ranges[i];
+        local_flush_range(range->start, range->size, range->asid);
+    }
+}
+
+static void ipi_flush_batch(void* arg) { local_flush_batch(arg); }
+
+void tlb_batch_init(struct tlb_batch* batch)
+{
+    batch->cpu_mask = 0;
+    batch->nr_ranges = 0;
+    batch->flush_all = 0;
+}
+
+/* queue the invalidation of [start, start + size) in vm, or in the kernel
+ * mappings of every hart if vm is NULL */
+void tlb_batch_add(struct tlb_batch* batch, struct vm_context* vm,
+                   unsigned long start, unsigned long size)
+{
+    long asid = vm ? (long)vm->asid : TLB_ASID_ALL;
+    struct tlb_range* range;
+    int cpu;
+
+    if (vm) {
+        batch->cpu_mask |= vm->cpu_mask;
+    } else {
+        for (cpu = 0; cpu < ncpus; cpu++) {
+            if (get_cpu_var(cpu, cpu_online)) batch->cpu_mask |= 1UL << cpu;
+        }
+    }
+
+    if (batch->flush_all) return;
+
+    /* extend the last range if this one follows it */
+    if (batch->nr_ranges > 0) {
+        range = &batch->ranges[batch->nr_ranges - 1];
+
+        if (range->asid == asid && range->start + range->size == start) {
+            range->size += size;
+            return;
+        }
+    }
+
+    if (batch->nr_ranges == TLB_BATCH_MAX) {
+        batch->flush_all = 1;
+        return;
+    }
+
+    range = &batch->ranges[batch->nr_ranges++];
+    range->start = start;
+    range->size = size;
+    range->asid = asid;
+}
+
+/* carry out the queued invalidations on all harts concerned and wait until
+ * they are done */
+void tlb_batch_flush(struct tlb_batch* batch)
+{
+    unsigned long remote = batch->cpu_mask & ~(1UL << cpuid);
+
+    if (batch->cpu_mask & (1UL << cpuid)) local_flush_batch(batch);
+
+    if (remote) {
+        if (batch->nr_ranges == 1 && !batch->flush_all) {
+            struct tlb_range* range = &batch->ranges[0];
+            unsigned long hart_mask = 0;
+            int cpu;
+
+            for (cpu = 0; cpu < ncpus; cpu++) {
+                if (remote & (1UL << cpu))
+                    hart_mask |= 1UL << get_cpu_var(cpu, hart_id);
+            }
+
+            if (range->asid == TLB_ASID_ALL || !nr_asids)
+                sbi_remote_sfence_vma(&hart_mask, range->start, range->size);
+            else
+                sbi_remote_sfence_vma_asid(&hart_mask, range->start,
+                                           range->size, range->asid);
+        } else {
+            smp_call_function_many(remote, ipi_flush_batch, batch, 1);
+        }
+    }
+
+    tlb_batch_init(batch);
+}
+
+/* invalidate a range of the kernel mappings on every hart */
+void tlb_flush_kernel_range(unsigned long start, unsigned long size)
+{
+    struct tlb_batch batch;
+
+    tlb_batch_init(&batch);
+    tlb_batch_add(&batch, NULL, start, size);
+    tlb_batch_flush(&batch);
+}
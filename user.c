@@ -1,15 +1,78 @@
 #include "const.h"
 
+#include <stdint.h>
+
 const char str[] __attribute__((__section__(".user_data"))) = "Hello world!\n";
+const char child_str[] __attribute__((__section__(".user_data"))) =
+    "Hello from a child!\n";
+
+/* seen by all processes, see map_user_shared() */
+static uint32_t console_lock __attribute__((__section__(".user_shared")));
 
 void Init() __attribute__((__section__(".user_text_entry")));
+static void Child(unsigned long arg) __attribute__((__section__(".user_text")));
+void Bench(unsigned long arg) __attribute__((__section__(".user_text")));
+static void mutex_lock(uint32_t* m) __attribute__((__section__(".user_text")));
+static void mutex_unlock(uint32_t* m)
+    __attribute__((__section__(".user_text")));
+
+long __syscall(int call_nr, ...);
+
+/* Futex based mutex, 0: unlocked, 1: locked, 2: locked and maybe contended.
+ * Only the contended cases enter the kernel. */
+static void mutex_lock(uint32_t* m)
+{
+    uint32_t c = 0;
 
-void __syscall(int call_nr, ...);
+    if (__atomic_compare_exchange_n(m, &c, 1, 0, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED))
+        return;
+
+    if (c != 2) c = __atomic_exchange_n(m, 2, __ATOMIC_ACQUIRE);
+    while (c != 0) {
+        __syscall(SYS_FUTEX_WAIT, m, 2, 0);
+        c = __atomic_exchange_n(m, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void mutex_unlock(uint32_t* m)
+{
+    if (__atomic_exchange_n(m, 0, __ATOMIC_RELEASE) != 1)
+        __syscall(SYS_FUTEX_WAKE, m, 1);
+}
 
 /* the INIT process */
 void Init()
 {
+    int status;
+    long pid;
+
+    mutex_lock(&console_lock);
     __syscall(SYS_WRITE_CONSOLE, (unsigned long)str, 13);
+    mutex_unlock(&console_lock);
+
+    pid = __syscall(SYS_SPAWN, (unsigned long)Child, 0);
+    if (pid > 0) __syscall(SYS_WAIT, pid, &status, 0);
+
+#ifdef CONFIG_BENCH
+    pid = __syscall(SYS_SPAWN, (unsigned long)Bench, 0);
+    if (pid > 0) __syscall(SYS_WAIT, pid, &status, 0);
+#endif
+
+    /* reap the orphans it adopts, the kernel lets it sleep while it has no
+     * children */
+    while (1)
+        __syscall(SYS_WAIT, -1, &status, 0);
+}
+
+/* spawned by INIT, exits with the argument it was given */
+static void Child(unsigned long arg)
+{
+    mutex_lock(&console_lock);
+    __syscall(SYS_WRITE_CONSOLE, (unsigned long)child_str, 20);
+    mutex_unlock(&console_lock);
+
+    __syscall(SYS_EXIT, arg);
 
     while (1)
         ;
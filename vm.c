@@ -4,6 +4,7 @@
 #include "proc.h"
 #include "proto.h"
 
+#include <errno.h>
 #include <stdint.h> /* for uintptr_t */
 #include <string.h>
 
@@ -40,7 +41,10 @@ void setup_paging()
 static pte_t* pg_alloc_pt()
 {
     unsigned long phys_addr = alloc_pages(1);
-    pte_t* pt = (pte_t*)__va(phys_addr);
+    pte_t* pt;
+
+    if (!phys_addr) return NULL;
+    pt = (pte_t*)__va(phys_addr);
 
     memset(pt, 0, sizeof(pte_t) * NUM_PT_ENTRIES);
     return pt;
@@ -49,7 +53,10 @@ static pte_t* pg_alloc_pt()
 static pmde_t* pg_alloc_pmd()
 {
     unsigned long phys_addr = alloc_pages(1);
-    pmde_t* pmd = (pmde_t*)__va(phys_addr);
+    pmde_t* pmd;
+
+    if (!phys_addr) return NULL;
+    pmd = (pmde_t*)__va(phys_addr);
 
     memset(pmd, 0, sizeof(pmde_t) * NUM_PMD_ENTRIES);
     return pmd;
@@ -90,8 +97,154 @@ static inline pte_t* pte_offset(pmde_t* pt, unsigned long addr)
 
 static inline int pte_present(pte_t pte) { return pte & _PG_PRESENT; }
 
-void vm_map(struct proc* p, unsigned long phys_addr, void* vir_addr,
-            void* vir_end)
+/* reverse mappings of movable (anonymous user) frames, used by compaction to
+ * find the PTE that maps a frame */
+struct page_rmap {
+    struct page_rmap* next;
+    unsigned long phys;
+    struct proc* proc;
+    unsigned long vir_addr;
+    pte_t* pte;
+};
+
+#define RMAP_HASH_SIZE 256
+#define RMAP_HASH(phys) (((phys) >> PG_SHIFT) % RMAP_HASH_SIZE)
+
+static struct page_rmap* rmap_hash[RMAP_HASH_SIZE];
+
+static struct page_rmap* rmap_lookup(unsigned long phys)
+{
+    struct page_rmap* rmap;
+
+    for (rmap = rmap_hash[RMAP_HASH(phys)]; rmap; rmap = rmap->next) {
+        if (rmap->phys == phys) return rmap;
+    }
+
+    return NULL;
+}
+
+static inline void rmap_hash_add(struct page_rmap* rmap)
+{
+    struct page_rmap** head = &rmap_hash[RMAP_HASH(rmap->phys)];
+
+    rmap->next = *head;
+    *head = rmap;
+}
+
+static void rmap_hash_del(struct page_rmap* rmap)
+{
+    struct page_rmap** head = &rmap_hash[RMAP_HASH(rmap->phys)];
+    struct page_rmap *prev = NULL, *r;
+
+    for (r = *head; r && r != rmap; r = r->next)
+        prev = r;
+    if (!r) return;
+
+    if (prev)
+        prev->next = rmap->next;
+    else
+        *head = rmap->next;
+}
+
+/* returns -ENOMEM if there is no memory for the reverse mapping, the frame
+ * would not be freed with the address space without it */
+static int rmap_add(struct proc* p, unsigned long phys, void* vir_addr,
+                    pte_t* pte)
+{
+    struct page_rmap* rmap;
+
+    SLABALLOC(rmap);
+    if (!rmap) return -ENOMEM;
+
+    rmap->phys = phys;
+    rmap->proc = p;
+    rmap->vir_addr = (unsigned long)vir_addr;
+    rmap->pte = pte;
+    rmap_hash_add(rmap);
+
+    return 0;
+}
+
+int page_movable(unsigned long phys) { return rmap_lookup(phys) != NULL; }
+
+/* Migrating a frame that another hart may be writing to takes three steps:
+ * unmap_movable_page() clears the present bit of its PTE and queues the TLB
+ * invalidation, the caller flushes the batch, then migrate_page() copies the
+ * frame and maps the copy, all with the kernel lock held. An access in between
+ * faults, do_page_fault() runs once the lock is free again and finds the page
+ * mapped, and the access is retried. remap_movable_page() undoes the first step
+ * if the frame stays. */
+int unmap_movable_page(unsigned long phys, struct tlb_batch* batch)
+{
+    struct page_rmap* rmap = rmap_lookup(phys);
+
+    if (!rmap) return EINVAL;
+
+    *rmap->pte &= ~_PG_PRESENT;
+    tlb_batch_add(batch, &rmap->proc->vm, rmap->vir_addr, PG_SIZE);
+
+    return 0;
+}
+
+void remap_movable_page(unsigned long phys)
+{
+    struct page_rmap* rmap = rmap_lookup(phys);
+
+    if (rmap) *rmap->pte |= _PG_PRESENT;
+}
+
+/* move the contents of an unmapped movable frame to new_phys and map it */
+int migrate_page(unsigned long old_phys, unsigned long new_phys)
+{
+    struct page_rmap* rmap = rmap_lookup(old_phys);
+    pte_t pte;
+
+    if (!rmap) return EINVAL;
+
+    memcpy(__va(new_phys), __va(old_phys), PG_SIZE);
+
+    /* the PTE was not present, no invalidation needed */
+    pte = *rmap->pte | _PG_PRESENT;
+    *rmap->pte = pfn_pte(new_phys >> PG_SHIFT, pte & ((1 << PG_PFN_SHIFT) - 1));
+
+    rmap_hash_del(rmap);
+    rmap->phys = new_phys;
+    rmap_hash_add(rmap);
+
+    return 0;
+}
+
+/* find the PTE that maps vir_addr, allocating the intermediate tables if
+ * they are not present and alloc is set. NULL if there is no such PTE or no
+ * memory for the tables. */
+static pte_t* pt_walk(pde_t* pgd, unsigned long vir_addr, int alloc)
+{
+    pde_t* pde = pgd_offset(pgd, vir_addr);
+    if (!pde_present(*pde)) {
+        if (!alloc) return NULL;
+
+        pmde_t* new_pmd = pg_alloc_pmd();
+        if (!new_pmd) return NULL;
+        pde_populate(pde, new_pmd);
+    }
+
+    pmde_t* pmde = pmd_offset(pde, vir_addr);
+    if (!pmde_present(*pmde)) {
+        if (!alloc) return NULL;
+
+        pte_t* new_pt = pg_alloc_pt();
+        if (!new_pt) return NULL;
+        pmde_populate(pmde, new_pt);
+    }
+
+    return pte_offset(pmde, vir_addr);
+}
+
+/* map [vir_addr, vir_end) to the frames from phys_addr on, or to fresh zeroed
+ * frames if phys_addr is 0. Returns -ENOMEM if memory runs out, what has been
+ * mapped until then goes away with the address space (see vm_release()). */
+int vm_map(struct proc* p, unsigned long phys_addr, void* vir_addr,
+           void* vir_end)
 {
     pde_t* pgd = (pde_t*)p->vm.ptbr_vir;
 
@@ -99,28 +252,175 @@ void vm_map(struct proc* p, unsigned long phys_addr, void* vir_addr,
 
     while (vir_addr < vir_end) {
         unsigned long ph = phys_addr;
+        int movable = 0;
+        pte_t* pte;
+
         if (ph == 0) {
-            ph = alloc_pages(1);
+            if (!(ph = alloc_zeroed_page())) return -ENOMEM;
+            movable = 1;
         }
 
-        pde_t* pde = pgd_offset(pgd, (unsigned long)vir_addr);
-        if (!pde_present(*pde)) {
-            pmde_t* new_pmd = pg_alloc_pmd();
-            pde_populate(pde, new_pmd);
+        pte = pt_walk(pgd, (unsigned long)vir_addr, 1);
+        if (!pte || (movable && rmap_add(p, ph, vir_addr, pte))) {
+            if (movable) free_mem(ph, PG_SIZE);
+            return -ENOMEM;
         }
+        *pte = pfn_pte(ph >> PG_SHIFT, PROT_EXEC_WRITE);
 
-        pmde_t* pmde = pmd_offset(pde, (unsigned long)vir_addr);
-        if (!pmde_present(*pmde)) {
-            pte_t* new_pt = pg_alloc_pt();
-            pmde_populate(pmde, new_pt);
-        }
+        vir_addr += PG_SIZE;
+        if (phys_addr != 0) phys_addr += PG_SIZE;
+    }
 
-        pte_t* pte = pte_offset(pmde, (unsigned long)vir_addr);
+    return 0;
+}
+
+/* the physical address vir_addr is mapped to in the user half of the address
+ * space of p, 0 if it is not mapped */
+unsigned long vm_lookup(struct proc* p, unsigned long vir_addr)
+{
+    pte_t* pte;
+
+    if (vir_addr >= USER_ADDR_END) return 0;
+
+    pte = pt_walk((pde_t*)p->vm.ptbr_vir, vir_addr, 0);
+    if (!pte || !pte_present(*pte) || !(*pte & _PG_USER)) return 0;
+
+    return ((*pte >> PG_PFN_SHIFT) << PG_SHIFT) | (vir_addr % PG_SIZE);
+}
+
+/* map fresh frames at [vir_addr, vir_end) and fill them with the bytes at src
+ * (a kernel address), the rest of the last frame is zeroed */
+int vm_map_copy(struct proc* p, const void* src, size_t len, void* vir_addr,
+                void* vir_end)
+{
+    pde_t* pgd = (pde_t*)p->vm.ptbr_vir;
+
+    while (vir_addr < vir_end) {
+        unsigned long ph = alloc_pages(1);
+        size_t chunk = len < PG_SIZE ? len : PG_SIZE;
+        pte_t* pte;
+
+        if (!ph) return -ENOMEM;
+
+        memcpy(__va(ph), src, chunk);
+        memset(__va(ph) + chunk, 0, PG_SIZE - chunk);
+        src += chunk;
+        len -= chunk;
+
+        pte = pt_walk(pgd, (unsigned long)vir_addr, 1);
+        if (!pte || rmap_add(p, ph, vir_addr, pte)) {
+            free_mem(ph, PG_SIZE);
+            return -ENOMEM;
+        }
         *pte = pfn_pte(ph >> PG_SHIFT, PROT_EXEC_WRITE);
 
         vir_addr += PG_SIZE;
-        if (phys_addr != 0) phys_addr += PG_SIZE;
     }
+
+    return 0;
+}
+
+/* give p a page directory of its own, the kernel half is shared with
+ * initial_pgd */
+int vm_alloc_space(struct proc* p)
+{
+    unsigned long phys = alloc_pages(1);
+    pde_t* pgd;
+
+    if (!phys) return -ENOMEM;
+    pgd = (pde_t*)__va(phys);
+
+    memset(pgd, 0, sizeof(pde_t) * NUM_DIR_ENTRIES / 2);
+    memcpy(&pgd[NUM_DIR_ENTRIES / 2], &initial_pgd[NUM_DIR_ENTRIES / 2],
+           sizeof(pde_t) * NUM_DIR_ENTRIES / 2);
+
+    p->vm.ptbr_phys = phys;
+    p->vm.ptbr_vir = (reg_t*)pgd;
+
+    return 0;
+}
+
+/* frames with a reverse mapping belong to the address space, the others (the
+ * user text) are shared */
+static void free_user_frame(unsigned long phys)
+{
+    struct page_rmap* rmap = rmap_lookup(phys);
+
+    if (!rmap) return;
+
+    rmap_hash_del(rmap);
+    SLABFREE(rmap);
+    free_mem(phys, PG_SIZE);
+}
+
+/* tear down the user half of the address space of p, no hart may run it any
+ * more once this returns */
+void vm_release(struct proc* p)
+{
+    pde_t* pgd = (pde_t*)p->vm.ptbr_vir;
+    int i, j, k;
+
+    /* INIT runs on initial_pgd, which is never freed */
+    if (!pgd || pgd == initial_pgd) return;
+
+    tlb_release_vm(&p->vm);
+
+    for (i = 0; i < NUM_DIR_ENTRIES / 2; i++) {
+        pmde_t* pmd;
+
+        if (!pde_present(pgd[i])) continue;
+        pmd = pmd_offset(&pgd[i], 0);
+
+        for (j = 0; j < NUM_PMD_ENTRIES; j++) {
+            pte_t* pt;
+
+            if (!pmde_present(pmd[j])) continue;
+            pt = pte_offset(&pmd[j], 0);
+
+            for (k = 0; k < NUM_PT_ENTRIES; k++) {
+                if (pt[k]) free_user_frame((pt[k] >> PG_PFN_SHIFT) << PG_SHIFT);
+            }
+
+            free_mem((unsigned long)__pa(pt), PG_SIZE);
+        }
+
+        free_mem((unsigned long)__pa(pmd), PG_SIZE);
+    }
+
+    free_mem(p->vm.ptbr_phys, PG_SIZE);
+    p->vm.ptbr_phys = 0;
+    p->vm.ptbr_vir = NULL;
+}
+
+/* map a page into the kernel virtual areas, these live in the kernel half of
+ * initial_pgd and are shared by all address spaces */
+void kern_map_page(unsigned long phys_addr, unsigned long vir_addr)
+{
+    pte_t* pte = pt_walk(initial_pgd, vir_addr, 1);
+    *pte = pfn_pte(phys_addr >> PG_SHIFT, PROT_KERNEL);
+}
+
+/* make sure the kernel area containing vir_addr has its PMD allocated before
+ * any other address space copies the kernel half of initial_pgd */
+void kern_alloc_pmd(unsigned long vir_addr)
+{
+    pde_t* pde = pgd_offset(initial_pgd, vir_addr);
+
+    if (!pde_present(*pde)) pde_populate(pde, pg_alloc_pmd());
+}
+
+/* unmap a kernel page and return the frame it was mapped to, the caller is
+ * responsible for flushing the TLB */
+unsigned long kern_unmap_page(unsigned long vir_addr)
+{
+    pte_t* pte = pt_walk(initial_pgd, vir_addr, 0);
+    unsigned long phys_addr;
+
+    if (!pte || !pte_present(*pte)) return 0;
+
+    phys_addr = (*pte >> PG_PFN_SHIFT) << PG_SHIFT;
+    *pte = 0;
+
+    return phys_addr;
 }
 
-void switch_address_space(struct proc* p) { write_ptbr(p->vm.ptbr_phys); }
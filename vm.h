@@ -11,6 +11,25 @@
 #define USER_STACK_TOP 0x2000000000
 #define USER_STACK_SIZE 0x1000
 
+/* kernel virtual areas below the linear mapping, each one fits in a single
+ * page directory entry so that all address spaces share its page tables */
+#define KSTACK_AREA_START 0xffffffd000000000 /* kernel stacks */
+#define VMALLOC_START 0xffffffd040000000UL   /* vmalloc area */
+
+/* The kernel stack area has KSTACK_MAX slots of 2 * KSTACK_SIZE, the lower
+ * half of a slot is an unmapped guard and the upper half the stack. Both
+ * numbers are powers of two so that trap.S can tell whether an address is in a
+ * guard with shifts (see kstack.c). */
+#define KSTACK_MAX_SHIFT 12
+#define KSTACK_MAX (1 << KSTACK_MAX_SHIFT)
+#define KSTACK_SLOT_SHIFT 14
+#define KSTACK_SLOT_SIZE (1 << KSTACK_SLOT_SHIFT)
+
+/* per-hart stack a kernel stack overflow is reported on */
+#define OVERFLOW_STACK_SHIFT 12
+#define OVERFLOW_STACK_SIZE (1 << OVERFLOW_STACK_SHIFT)
+#define VMALLOC_END (VMALLOC_START + (1UL << PGD_SHIFT))
+
 #ifndef __ASSEMBLY__
 
 typedef unsigned long pde_t;  /* page directory entry */
@@ -35,6 +54,9 @@ typedef unsigned long pte_t;  /* page table entry */
 #define NUM_PMD_ENTRIES (PG_SIZE / sizeof(pmde_t))
 #define NUM_PT_ENTRIES (PG_SIZE / sizeof(pte_t))
 
+/* user space is the lower half of the address space */
+#define USER_ADDR_END ((NUM_DIR_ENTRIES / 2) << PGD_SHIFT)
+
 /* page table bits */
 #define _PG_PRESENT (1 << 0)
 #define _PG_READ (1 << 1)
@@ -64,6 +86,22 @@ typedef unsigned long pte_t;  /* page table entry */
 #ifndef __ASSEMBLY__
 extern pde_t initial_pgd[];
 
+/* pending TLB invalidations, collected with tlb_batch_add() and sent to the
+ * harts concerned all at once by tlb_batch_flush(), see tlb.c */
+#define TLB_BATCH_MAX 16
+#define TLB_ASID_ALL (-1L) /* kernel mappings, flush in all address spaces */
+
+struct tlb_batch {
+    unsigned long cpu_mask; /* harts that need to flush */
+    int nr_ranges;
+    int flush_all; /* too many ranges, flush the whole TLB */
+    struct tlb_range {
+        unsigned long start;
+        unsigned long size;
+        long asid;
+    } ranges[TLB_BATCH_MAX];
+};
+
 #define PTE_INDEX(v) (((unsigned long)(v) >> PG_SHIFT) & (NUM_PT_ENTRIES - 1))
 #define PMDE_INDEX(x) \
     (((unsigned long)(x) >> PMD_SHIFT) & (NUM_PMD_ENTRIES - 1))
@@ -103,6 +141,27 @@ static inline void flush_tlb()
     __asm__ __volatile__("sfence.vma" : : : "memory");
 }
 
+/* flush one page of all address spaces */
+static inline void flush_tlb_page(unsigned long addr)
+{
+    __asm__ __volatile__("sfence.vma %0" : : "r"(addr) : "memory");
+}
+
+/* flush one page of the address space tagged asid */
+static inline void flush_tlb_page_asid(unsigned long addr, unsigned long asid)
+{
+    __asm__ __volatile__("sfence.vma %0, %1"
+                         :
+                         : "r"(addr), "r"(asid)
+                         : "memory");
+}
+
+/* flush all non-global entries tagged asid */
+static inline void flush_tlb_asid(unsigned long asid)
+{
+    __asm__ __volatile__("sfence.vma x0, %0" : : "r"(asid) : "memory");
+}
+
 static inline unsigned long read_ptbr()
 {
     unsigned long ptbr = csr_read(sptbr);
@@ -115,6 +174,14 @@ static inline void write_ptbr(unsigned long ptbr)
     csr_write(sptbr, (ptbr >> PG_SHIFT) | SATP_MODE);
 }
 
+/* switch to a page table tagged with asid, entries of other address spaces
+ * stay in the TLB */
+static inline void write_ptbr_asid(unsigned long ptbr, unsigned long asid)
+{
+    csr_write(sptbr,
+              (ptbr >> PG_SHIFT) | (asid << SATP_ASID_SHIFT) | SATP_MODE);
+}
+
 #endif
 
 #endif
@@ -0,0 +1,220 @@
+#include "const.h"
+#include "list.h"
+#include "proto.h"
+#include "vm.h"
+
+#include <stddef.h>
+
+/* Virtually contiguous kernel allocations backed by scattered frames. Freed
+ * areas are unmapped right away but their address ranges are only reused
+ * after a TLB purge, which is deferred until enough of them pile up. */
+
+struct vm_area {
+    struct list_head list;
+    unsigned long addr;
+    unsigned long size; /* including the guard page */
+    int flags;
+#define VMA_OWN_FRAMES 0x1 /* frames were allocated by vmalloc() */
+};
+
+#define LAZY_MAX_PAGES 1024 /* unpurged pages before a forced TLB purge */
+#define LAZY_IDLE_PAGES 64  /* unpurged pages an idle hart purges */
+
+static DEF_LIST(free_areas); /* sorted by address */
+static DEF_LIST(busy_areas);
+static DEF_LIST(lazy_areas);
+static unsigned long lazy_pages;
+
+static void free_area_range(unsigned long addr, unsigned long size)
+{
+    struct vm_area *area, *prev = NULL, *new_area;
+
+    list_for_each_entry(area, &free_areas, list)
+    {
+        if (area->addr > addr) break;
+        prev = area;
+    }
+
+    /* merge with the neighbours if possible */
+    if (prev && prev->addr + prev->size == addr) {
+        prev->size += size;
+
+        if (&area->list != &free_areas &&
+            prev->addr + prev->size == area->addr) {
+            prev->size += area->size;
+            list_del(&area->list);
+            SLABFREE(area);
+        }
+        return;
+    }
+
+    if (&area->list != &free_areas && addr + size == area->addr) {
+        area->addr = addr;
+        area->size += size;
+        return;
+    }
+
+    SLABALLOC(new_area);
+    if (!new_area) return; /* leak the address range */
+
+    new_area->addr = addr;
+    new_area->size = size;
+    new_area->flags = 0;
+    __list_add(&new_area->list, area->list.prev, &area->list);
+}
+
+/* flush the TLBs once for all lazily freed areas and make their address ranges
+ * available again */
+static void purge_lazy_areas()
+{
+    struct vm_area *area, *tmp;
+    struct tlb_batch batch;
+
+    if (list_empty(&lazy_areas)) return;
+
+    tlb_batch_init(&batch);
+    list_for_each_entry(area, &lazy_areas, list)
+    {
+        tlb_batch_add(&batch, NULL, area->addr, area->size - PG_SIZE);
+    }
+    tlb_batch_flush(&batch);
+
+    list_for_each_entry_safe(area, tmp, &lazy_areas, list)
+    {
+        list_del(&area->list);
+        free_area_range(area->addr, area->size);
+        SLABFREE(area);
+    }
+
+    lazy_pages = 0;
+}
+
+/* called by an idle hart, returns 1 if there was enough to purge */
+int vmalloc_purge_idle()
+{
+    if (lazy_pages < LAZY_IDLE_PAGES) return 0;
+
+    purge_lazy_areas();
+    return 1;
+}
+
+static struct vm_area* alloc_area(unsigned long size)
+{
+    struct vm_area *area, *new_area;
+    int purged = 0;
+
+    SLABALLOC(new_area);
+    if (!new_area) return NULL;
+
+retry:
+    list_for_each_entry(area, &free_areas, list)
+    {
+        if (area->size < size) continue;
+
+        new_area->addr = area->addr;
+        new_area->size = size;
+        new_area->flags = 0;
+
+        area->addr += size;
+        area->size -= size;
+        if (area->size == 0) {
+            list_del(&area->list);
+            SLABFREE(area);
+        }
+
+        list_add(&new_area->list, &busy_areas);
+        return new_area;
+    }
+
+    if (!purged) {
+        purge_lazy_areas();
+        purged = 1;
+        goto retry;
+    }
+
+    SLABFREE(new_area);
+    return NULL;
+}
+
+static void unmap_area(struct vm_area* area)
+{
+    unsigned long addr;
+    unsigned long end = area->addr + area->size - PG_SIZE;
+
+    for (addr = area->addr; addr < end; addr += PG_SIZE) {
+        unsigned long phys_addr = kern_unmap_page(addr);
+
+        if (phys_addr && (area->flags & VMA_OWN_FRAMES))
+            free_mem(phys_addr, PG_SIZE);
+    }
+
+    list_del(&area->list);
+    list_add(&area->list, &lazy_areas);
+
+    lazy_pages += area->size / PG_SIZE;
+    if (lazy_pages > LAZY_MAX_PAGES) purge_lazy_areas();
+}
+
+void vmalloc_init()
+{
+    kern_alloc_pmd(VMALLOC_START);
+
+    free_area_range(VMALLOC_START, VMALLOC_END - VMALLOC_START);
+}
+
+void* vmalloc(size_t size)
+{
+    struct vm_area* area;
+    unsigned long addr;
+
+    size = roundup(size, PG_SIZE);
+    if (size == 0) return NULL;
+
+    /* leave an unmapped guard page after each area */
+    if ((area = alloc_area(size + PG_SIZE)) == NULL) return NULL;
+    area->flags |= VMA_OWN_FRAMES;
+
+    for (addr = area->addr; addr < area->addr + size; addr += PG_SIZE) {
+        unsigned long phys_addr = alloc_pages(1);
+
+        if (!phys_addr) {
+            unmap_area(area);
+            return NULL;
+        }
+
+        kern_map_page(phys_addr, addr);
+    }
+
+    return (void*)area->addr;
+}
+
+/* map nr_pages frames into one contiguous kernel range */
+void* vmap(const unsigned long* frames, size_t nr_pages)
+{
+    struct vm_area* area;
+    int i;
+
+    if (nr_pages == 0) return NULL;
+    if ((area = alloc_area((nr_pages + 1) * PG_SIZE)) == NULL) return NULL;
+
+    for (i = 0; i < nr_pages; i++) {
+        kern_map_page(frames[i], area->addr + i * PG_SIZE);
+    }
+
+    return (void*)area->addr;
+}
+
+void vfree(void* addr)
+{
+    struct vm_area* area;
+
+    list_for_each_entry(area, &busy_areas, list)
+    {
+        if (area->addr == (unsigned long)addr) {
+            unmap_area(area);
+            return;
+        }
+    }
+
+    printk("vfree: bad address %p\n", addr);
+}
@@ -0,0 +1,55 @@
+#include "cpulocals.h"
+#include "proc.h"
+#include "proto.h"
+#include "waitqueue.h"
+
+/* Wait queues. Kernel code that has to wait for an event puts the current
+ * process on a queue and gives up the hart, whoever causes the event wakes up
+ * the processes on the queue. Both happen with the kernel lock held.
+ *
+ * Kernel threads and processes in a system call can sleep, they continue
+ * where they were when they are picked again (see schedule_kernel()).
+ * Interrupt handlers and the idle loop cannot. */
+
+/* the process running on this hart, which is about to sleep */
+struct proc* sleeping_proc()
+{
+    struct proc* p = get_cpulocal_var(proc_ptr);
+
+    if (!p) panic("sleeping without a process");
+    return p;
+}
+
+/* sleep until woken up, callers recheck what they are waiting for since
+ * other wakeups (e.g. a timeout) are possible */
+void sleep_on(struct wait_queue_head* wq)
+{
+    struct proc* p = sleeping_proc();
+
+    list_add_tail(&p->wait_link, &wq->waiters);
+    PST_SET_FLAGS(p, PST_BLOCKED);
+
+    schedule_kernel(p);
+
+    /* still queued if something else has woken us up */
+    list_del(&p->wait_link);
+}
+
+static void wake_one(struct proc* p)
+{
+    list_del(&p->wait_link);
+    PST_UNSET_FLAGS(p, PST_BLOCKED);
+}
+
+/* wake up the process that has been waiting the longest */
+void wake_up(struct wait_queue_head* wq)
+{
+    if (!list_empty(&wq->waiters))
+        wake_one(list_first_entry(&wq->waiters, struct proc, wait_link));
+}
+
+void wake_up_all(struct wait_queue_head* wq)
+{
+    while (!list_empty(&wq->waiters))
+        wake_one(list_first_entry(&wq->waiters, struct proc, wait_link));
+}
@@ -0,0 +1,31 @@
+#ifndef _WAITQUEUE_H_
+#define _WAITQUEUE_H_
+
+#include "list.h"
+
+/* processes sleeping in the kernel until an event, see waitqueue.c */
+struct wait_queue_head {
+    struct list_head waiters;
+};
+
+#define WAIT_QUEUE_INIT(name)                \
+    {                                        \
+        .waiters = LIST_INIT((name).waiters) \
+    }
+#define DEF_WAIT_QUEUE(name) \
+    struct wait_queue_head name = WAIT_QUEUE_INIT(name)
+
+static inline void init_waitqueue_head(struct wait_queue_head* wq)
+{
+    INIT_LIST_HEAD(&wq->waiters);
+}
+
+/* sleep on wq until cond is true, cond is checked with the kernel lock held
+ * so a wakeup cannot be missed */
+#define wait_event(wq, cond) \
+    do {                     \
+        while (!(cond))      \
+            sleep_on(wq);    \
+    } while (0)
+
+#endif
@@ -0,0 +1,75 @@
+#include "cpulocals.h"
+#include "global.h"
+#include "proc.h"
+#include "proto.h"
+#include "waitqueue.h"
+#include "workqueue.h"
+
+/* Deferred work. Interrupt handlers and system calls queue the expensive part
+ * of what they do on the hart they run on and return, a kernel thread per
+ * hart (kworker/N) runs the items later in the order they were queued. Items
+ * run with the kernel lock held like any other kernel code, the worker gives
+ * up the hart between two items if something more important is waiting. */
+
+int sprintf(char* buf, const char* fmt, ...);
+
+static void worker_thread(void* arg);
+
+/* work may be queued from here on but only runs once start_workers() has been
+ * called */
+void init_workqueues()
+{
+    int cpu;
+
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        INIT_LIST_HEAD(get_cpu_var_ptr(cpu, work_list));
+        init_waitqueue_head(get_cpu_var_ptr(cpu, work_wait));
+    }
+}
+
+void start_workers()
+{
+    char name[PROC_NAME_MAX];
+    int cpu;
+
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        sprintf(name, "kworker/%d", cpu);
+        if (!kthread_create(name, worker_thread, NULL, cpu))
+            panic("unable to create the worker of CPU %d", cpu);
+    }
+}
+
+/* queue work on the worker of cpu, returns 0 if it is already queued */
+int queue_work_on(int cpu, struct work* work)
+{
+    if (work->pending) return 0;
+
+    work->pending = 1;
+    list_add_tail(&work->list, get_cpu_var_ptr(cpu, work_list));
+    wake_up(get_cpu_var_ptr(cpu, work_wait));
+
+    return 1;
+}
+
+int queue_work(struct work* work) { return queue_work_on(cpuid, work); }
+
+static void worker_thread(void* arg)
+{
+    struct list_head* queue = get_cpulocal_var_ptr(work_list);
+    struct proc* self = get_cpulocal_var(proc_ptr);
+
+    for (;;) {
+        while (!list_empty(queue)) {
+            struct work* work = list_first_entry(queue, struct work, list);
+
+            /* the item may queue itself again */
+            list_del(&work->list);
+            work->pending = 0;
+            work->func(work);
+
+            if (sched_need_resched(self)) schedule();
+        }
+
+        wait_event(get_cpulocal_var_ptr(work_wait), !list_empty(queue));
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+#include "list.h"
+
+/* a piece of deferred work, see workqueue.c */
+struct work {
+    struct list_head list;
+    void (*func)(struct work* work);
+    int pending; /* queued and not started yet */
+};
+
+#define WORK_INIT(name, f)                               \
+    {                                                    \
+        .list = LIST_INIT((name).list), .func = (f),     \
+        .pending = 0                                     \
+    }
+#define DEF_WORK(name, f) struct work name = WORK_INIT(name, f)
+#define INIT_WORK(work, f)                 \
+    do {                                   \
+        INIT_LIST_HEAD(&(work)->list);     \
+        (work)->func = (f);                \
+        (work)->pending = 0;               \
+    } while (0)
+
+#endif